@@ -0,0 +1,68 @@
+// Forwards its arguments to a running `mtl-gpu-asmcheck -serve=socket` and prints the result, so each check skips target setup
+// Doesn't need Apple's libLLVM, so it also builds on Linux
+
+#include "Server.h"
+
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+
+#include <unistd.h>
+
+/// Whether the server will read "-" because of arg: as an input, as the value after -input-list or -diff-input,
+/// or as -input-list=- and -diff-input=- with any number of leading dashes
+static bool readsStdin(const char* arg) {
+	if (strcmp(arg, "-") == 0) {
+		return true;
+	}
+	const char* name = arg + strspn(arg, "-");
+	return name != arg && (strcmp(name, "input-list=-") == 0 || strcmp(name, "diff-input=-") == 0);
+}
+
+int main(int argc, char** argv) {
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s socket [asmcheck options] <input.ll|input.bc|->...\n", argv[0]);
+		return 1;
+	}
+
+	ServerRequest request;
+	char cwd[PATH_MAX];
+	if (!getcwd(cwd, sizeof(cwd))) {
+		fprintf(stderr, "%s: getcwd: %s\n", argv[0], strerror(errno));
+		return 1;
+	}
+	request.workingDirectory = cwd;
+	bool wantsStdin = false;
+	for (int i = 2; i < argc; i++) {
+		request.args.push_back(argv[i]);
+		wantsStdin |= readsStdin(argv[i]);
+	}
+	// Only read stdin when asked to, it may be a pipe that never closes
+	if (wantsStdin) {
+		char buffer[65536];
+		size_t n;
+		while ((n = fread(buffer, 1, sizeof(buffer), stdin)) > 0) {
+			request.input.append(buffer, n);
+		}
+	}
+
+	std::string error;
+	int fd = connectSocket(argv[1], error);
+	if (fd < 0) {
+		fprintf(stderr, "%s: %s\n", argv[0], error.c_str());
+		return 1;
+	}
+	std::string payload;
+	ServerResponse response;
+	if (!writeFrame(fd, encodeRequest(request)) || !readFrame(fd, payload) || !decodeResponse(payload, response)) {
+		fprintf(stderr, "%s: lost connection to the server\n", argv[0]);
+		close(fd);
+		return 1;
+	}
+	close(fd);
+
+	fwrite(response.output.data(), 1, response.output.size(), stdout);
+	fwrite(response.errors.data(), 1, response.errors.size(), stderr);
+	return (int)response.status;
+}
@@ -0,0 +1,69 @@
+#include "CostEstimate.h"
+
+#include <algorithm>
+
+void CostEstimator::finishFunction() {
+	if (functions.empty()) {
+		return;
+	}
+	FunctionCost& cost = functions.back();
+	// Same as MCSchedModel::getReciprocalThroughput, but for the whole block instead of one instruction
+	cost.reciprocalThroughput = (double)cost.microOps / issueWidth;
+	cost.bottleneck = -1;
+	for (size_t i = 0; i < cost.resourceCycles.size(); i++) {
+		if (!resources[i].units) {
+			continue;
+		}
+		double cycles = (double)cost.resourceCycles[i] / resources[i].units;
+		if (cycles > cost.reciprocalThroughput) {
+			cost.reciprocalThroughput = cycles;
+			cost.bottleneck = (int)i;
+		}
+	}
+}
+
+void CostEstimator::setFunction(int function) {
+	if (!functions.empty() && functions.back().function == function) {
+		return;
+	}
+	finishFunction();
+	functions.emplace_back();
+	functions.back().function = function;
+	functions.back().resourceCycles.resize(resources.size());
+	std::fill(readyAt.begin(), readyAt.end(), 0);
+}
+
+void CostEstimator::addInst(int latency, unsigned microOps, const CostResourceUse* uses, size_t numUses,
+                            const unsigned* inputs, size_t numInputs, const unsigned* outputs, size_t numOutputs) {
+	if (functions.empty()) {
+		setFunction(-1);
+	}
+	FunctionCost& cost = functions.back();
+	cost.instructions++;
+	if (latency < 0) {
+		cost.unmodeled++;
+		latency = 1;
+		microOps = 1;
+	}
+	cost.microOps += microOps;
+	for (size_t i = 0; i < numUses; i++) {
+		if (uses[i].resource < cost.resourceCycles.size()) {
+			cost.resourceCycles[uses[i].resource] += uses[i].cycles;
+		}
+	}
+
+	uint64_t start = 0;
+	for (size_t i = 0; i < numInputs; i++) {
+		if (inputs[i] < readyAt.size()) {
+			start = std::max(start, readyAt[inputs[i]]);
+		}
+	}
+	uint64_t done = start + latency;
+	for (size_t i = 0; i < numOutputs; i++) {
+		if (outputs[i] >= readyAt.size()) {
+			readyAt.resize(outputs[i] + 1);
+		}
+		readyAt[outputs[i]] = done;
+	}
+	cost.criticalPath = std::max(cost.criticalPath, done);
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+// Static per-function cost estimates for -cost-estimate, in the spirit of llvm-mca but without simulating a pipeline
+// Each function's instructions are treated as one straight line block:
+// - The critical path is the longest chain of register dependencies, where an instruction's results are ready `latency` cycles after its last input
+// - The reciprocal throughput is how many cycles the block would take per iteration if it were repeated forever,
+//   limited by the issue width or by whichever processor resource is busiest
+// Only uses the standard library, the sched model lookups are done by the caller
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+struct CostResource {
+	std::string name;
+	unsigned units; ///< MCProcResourceDesc::NumUnits
+};
+
+struct CostResourceUse {
+	unsigned resource; ///< Index into the estimator's resources
+	unsigned cycles;
+};
+
+struct FunctionCost {
+	int function; ///< Index of the function in the module, -1 before the first function
+	uint64_t instructions = 0;
+	uint64_t unmodeled = 0; ///< Instructions the sched model had nothing for, counted as one micro-op with a latency of one
+	uint64_t microOps = 0;
+	uint64_t criticalPath = 0;
+	std::vector<uint64_t> resourceCycles; ///< Cycles used of each resource
+	double reciprocalThroughput = 0;
+	int bottleneck = -1; ///< Resource limiting the throughput, -1 if it's the issue width
+};
+
+class CostEstimator {
+	std::vector<CostResource> resources;
+	unsigned issueWidth;
+	std::vector<FunctionCost> functions;
+	std::vector<uint64_t> readyAt; ///< Cycle each register unit's last write is ready, within the current function
+
+	void finishFunction();
+
+public:
+	CostEstimator(std::vector<CostResource> resources, unsigned issueWidth): resources(std::move(resources)), issueWidth(issueWidth ? issueWidth : 1) {}
+
+	/// Instructions arrive in function order, so this starts a new function whenever it changes
+	void setFunction(int function);
+
+	/// inputs and outputs are register units, so writes to a register are seen by reads of its sub- and super-registers
+	/// A negative latency means the sched model had nothing for the instruction
+	void addInst(int latency, unsigned microOps, const CostResourceUse* uses, size_t numUses,
+	             const unsigned* inputs, size_t numInputs, const unsigned* outputs, size_t numOutputs);
+
+	/// Every function seen, in order, with the throughput filled in
+	const std::vector<FunctionCost>& finish() {
+		finishFunction();
+		return functions;
+	}
+
+	const std::vector<CostResource>& getResources() const { return resources; }
+};
@@ -0,0 +1,69 @@
+// Benchmarks the instruction alignment used by -diff-input, -diff-O and -diff-gpu on synthetic functions
+// Doesn't need Apple's libLLVM, so it also builds and runs on Linux
+
+#include "SequenceDiff.h"
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+struct BenchOptions {
+	size_t insts = 100000;
+	size_t distinct = 2000; ///< Distinct instructions, real functions repeat a lot of them
+};
+
+int main(int argc, char** argv) {
+	BenchOptions opts;
+	for (int i = 1; i < argc; i++) {
+		if (i + 1 < argc && !strcmp(argv[i], "-insts")) {
+			opts.insts = strtoull(argv[++i], nullptr, 0);
+		} else if (i + 1 < argc && !strcmp(argv[i], "-distinct")) {
+			opts.distinct = strtoull(argv[++i], nullptr, 0);
+		} else {
+			fprintf(stderr, "Usage: %s [-insts N] [-distinct N]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (!opts.insts || !opts.distinct) {
+		fprintf(stderr, "%s: -insts and -distinct have to be at least 1\n", argv[0]);
+		return 1;
+	}
+
+	uint64_t state = 0x9e3779b97f4a7c15ULL;
+	auto next = [&]{
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		return state;
+	};
+	std::vector<uint32_t> base(opts.insts);
+	for (uint32_t& inst : base) {
+		inst = next() % opts.distinct;
+	}
+
+	// From a small change to a function that was rewritten entirely
+	printf("%zu instructions, %zu distinct\n", opts.insts, opts.distinct);
+	for (size_t changes : {opts.insts / 1000, opts.insts / 100, opts.insts / 20, opts.insts}) {
+		std::vector<uint32_t> changed = base;
+		for (size_t c = 0; c < changes && !changed.empty(); c++) {
+			size_t pos = next() % changed.size();
+			switch (next() % 3) {
+				case 0: changed.erase(changed.begin() + pos); break;
+				case 1: changed.insert(changed.begin() + pos, next() % opts.distinct); break;
+				default: changed[pos] = next() % opts.distinct; break;
+			}
+		}
+		auto start = std::chrono::steady_clock::now();
+		std::vector<DiffOp> ops = diffSequences(base.data(), base.size(), changed.data(), changed.size());
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+		size_t edits = 0;
+		for (DiffOp op : ops) {
+			edits += op != DiffOp::Equal;
+		}
+		printf("%8zu random edits: %8.3fms, script has %zu insertions and deletions\n", changes, elapsed.count() * 1e3, edits);
+	}
+	return 0;
+}
@@ -0,0 +1,215 @@
+#include "EncodingCache.h"
+
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static constexpr char CacheMagic[8] = {'A', 'G', 'X', 'E', 'C', 'A', 'C', 'H'};
+static constexpr uint32_t CacheVersion = 1;
+static constexpr uint64_t InitialSlots = 1 << 16;
+
+struct EncodingCache::Header {
+	char magic[8];
+	uint32_t version;
+	uint32_t dirty; ///< Set while a process has the file open, a dirty file at open means someone crashed mid-update
+	uint64_t slotCount;
+	uint64_t used;
+};
+
+struct EncodingCache::Slot {
+	uint64_t keyLo;
+	uint64_t keyHi;
+	uint8_t len; ///< 0 for empty slots
+	uint8_t reserved[7];
+	uint8_t bytes[MaxBytes];
+};
+
+void EncodingKeyHasher::add(const void* data, size_t size) {
+	const uint8_t* ptr = static_cast<const uint8_t*>(data);
+	while (size >= 8) {
+		uint64_t word;
+		memcpy(&word, ptr, 8);
+		add(word);
+		ptr += 8;
+		size -= 8;
+	}
+	uint64_t tail = size;
+	for (size_t i = 0; i < size; i++) {
+		tail = tail << 8 | ptr[i];
+	}
+	add(tail);
+}
+
+static uint64_t finalize(uint64_t x) {
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+	return x;
+}
+
+EncodingKey EncodingKeyHasher::finish() const {
+	return {finalize(a ^ (b << 1)), finalize(b + a)};
+}
+
+std::unique_ptr<EncodingCache> EncodingCache::open(const std::string& path, std::string& error) {
+	std::unique_ptr<EncodingCache> cache(new EncodingCache());
+	cache->fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+	if (cache->fd < 0) {
+		error = path + ": " + strerror(errno);
+		return nullptr;
+	}
+	if (flock(cache->fd, LOCK_EX | LOCK_NB) != 0) {
+		error = path + " is in use by another process";
+		return nullptr;
+	}
+
+	struct stat st;
+	if (fstat(cache->fd, &st) != 0) {
+		error = path + ": " + strerror(errno);
+		return nullptr;
+	}
+	Header existing = {};
+	bool valid = (size_t)st.st_size >= sizeof(Header)
+	          && pread(cache->fd, &existing, sizeof(existing), 0) == sizeof(existing)
+	          && memcmp(existing.magic, CacheMagic, sizeof(CacheMagic)) == 0
+	          && existing.version == CacheVersion
+	          && !existing.dirty
+	          && existing.slotCount && (existing.slotCount & (existing.slotCount - 1)) == 0
+	          && (uint64_t)st.st_size == sizeof(Header) + existing.slotCount * sizeof(Slot);
+	if (!valid && ftruncate(cache->fd, 0) != 0) {
+		error = path + ": " + strerror(errno);
+		return nullptr;
+	}
+	if (!cache->map(valid ? existing.slotCount : InitialSlots, error)) {
+		error = path + ": " + error;
+		return nullptr;
+	}
+	if (!valid) {
+		memcpy(cache->header->magic, CacheMagic, sizeof(CacheMagic));
+		cache->header->version = CacheVersion;
+		cache->header->slotCount = InitialSlots;
+		cache->header->used = 0;
+	}
+	cache->header->dirty = 1;
+	msync(cache->header, sizeof(Header), MS_SYNC);
+	return cache;
+}
+
+EncodingCache::~EncodingCache() {
+	if (header) {
+		msync(header, mappedSize, MS_SYNC);
+		header->dirty = 0;
+		msync(header, sizeof(Header), MS_SYNC);
+		munmap(header, mappedSize);
+	}
+	if (fd >= 0) {
+		close(fd);
+	}
+}
+
+bool EncodingCache::map(uint64_t slotCount, std::string& error) {
+	if (header) {
+		munmap(header, mappedSize);
+		header = nullptr;
+		slots = nullptr;
+	}
+	size_t size = sizeof(Header) + slotCount * sizeof(Slot);
+	if (ftruncate(fd, size) != 0) {
+		error = strerror(errno);
+		return false;
+	}
+	void* mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (mem == MAP_FAILED) {
+		error = strerror(errno);
+		return false;
+	}
+	mappedSize = size;
+	header = static_cast<Header*>(mem);
+	slots = reinterpret_cast<Slot*>(header + 1);
+	return true;
+}
+
+bool EncodingCache::lookup(EncodingKey key, uint8_t* bytes, size_t& len) const {
+	std::shared_lock<std::shared_mutex> guard(lock);
+	if (!header) {
+		return false; // A grow failed
+	}
+	uint64_t mask = header->slotCount - 1;
+	for (uint64_t i = key.lo & mask; ; i = (i + 1) & mask) {
+		const Slot& slot = slots[i];
+		if (!slot.len) {
+			return false;
+		}
+		if (slot.keyLo == key.lo && slot.keyHi == key.hi) {
+			len = slot.len;
+			memcpy(bytes, slot.bytes, len);
+			return true;
+		}
+	}
+}
+
+void EncodingCache::insertLocked(EncodingKey key, const uint8_t* bytes, size_t len) {
+	uint64_t mask = header->slotCount - 1;
+	for (uint64_t i = key.lo & mask; ; i = (i + 1) & mask) {
+		Slot& slot = slots[i];
+		if (slot.len && (slot.keyLo != key.lo || slot.keyHi != key.hi)) {
+			continue;
+		}
+		if (!slot.len) {
+			header->used++;
+		}
+		slot.keyLo = key.lo;
+		slot.keyHi = key.hi;
+		memcpy(slot.bytes, bytes, len);
+		slot.len = (uint8_t)len;
+		return;
+	}
+}
+
+bool EncodingCache::grow() {
+	std::vector<Slot> live;
+	live.reserve(header->used);
+	for (uint64_t i = 0; i < header->slotCount; i++) {
+		if (slots[i].len) {
+			live.push_back(slots[i]);
+		}
+	}
+	uint64_t newCount = header->slotCount * 2;
+	std::string error;
+	if (!map(newCount, error)) {
+		return false;
+	}
+	memset(slots, 0, newCount * sizeof(Slot));
+	header->slotCount = newCount;
+	header->used = 0;
+	for (const Slot& slot : live) {
+		insertLocked({slot.keyLo, slot.keyHi}, slot.bytes, slot.len);
+	}
+	return true;
+}
+
+void EncodingCache::insert(EncodingKey key, const uint8_t* bytes, size_t len) {
+	if (len == 0 || len > MaxBytes) {
+		return;
+	}
+	std::unique_lock<std::shared_mutex> guard(lock);
+	if (!header) {
+		return; // A grow failed
+	}
+	// Keep the load factor under 70% so probe chains stay short
+	if ((header->used + 1) * 10 > header->slotCount * 7 && !grow()) {
+		return;
+	}
+	if (header) {
+		insertLocked(key, bytes, len);
+	}
+}
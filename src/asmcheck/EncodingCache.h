@@ -0,0 +1,64 @@
+#pragma once
+
+// Persistent cache of instruction encodings, stored in a memory mapped hash table file
+// Only uses the standard library and POSIX
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <shared_mutex>
+#include <string>
+
+struct EncodingKey {
+	uint64_t lo;
+	uint64_t hi;
+};
+
+/// Builds a 128-bit EncodingKey out of a sequence of values
+class EncodingKeyHasher {
+	uint64_t a;
+	uint64_t b;
+public:
+	explicit EncodingKeyHasher(uint64_t seed = 0): a(seed ^ 0x243f6a8885a308d3ULL), b(~seed ^ 0x13198a2e03707344ULL) {}
+
+	void add(uint64_t value) {
+		a = (a ^ value) * 0x9e3779b97f4a7c15ULL;
+		a ^= a >> 32;
+		b = (b + value) * 0xc2b2ae3d27d4eb4fULL;
+		b ^= b >> 29;
+	}
+
+	void add(const void* data, size_t size);
+
+	EncodingKey finish() const;
+};
+
+class EncodingCache {
+	struct Header;
+	struct Slot;
+
+	int fd = -1;
+	Header* header = nullptr;
+	Slot* slots = nullptr;
+	size_t mappedSize = 0;
+	mutable std::shared_mutex lock;
+
+	EncodingCache() = default;
+	bool map(uint64_t slotCount, std::string& error);
+	void insertLocked(EncodingKey key, const uint8_t* bytes, size_t len);
+	bool grow();
+
+public:
+	/// Longest encoding that can be stored
+	static constexpr size_t MaxBytes = 24;
+
+	/// Opens (or creates) a cache file, returns nullptr and sets error on failure
+	/// The file is locked for as long as the cache is open, so two processes can't share it
+	static std::unique_ptr<EncodingCache> open(const std::string& path, std::string& error);
+	~EncodingCache();
+
+	/// Thread safe, copies the encoding into `bytes` (which must have room for MaxBytes) and returns true on a hit
+	bool lookup(EncodingKey key, uint8_t* bytes, size_t& len) const;
+	/// Thread safe, ignores encodings that are empty or longer than MaxBytes
+	void insert(EncodingKey key, const uint8_t* bytes, size_t len);
+};
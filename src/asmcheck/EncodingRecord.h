@@ -0,0 +1,59 @@
+#pragma once
+
+// Layout of the records written by -emit-format=binary
+// Only uses the standard library so consumers don't need any LLVM headers
+//
+// A file is one BinaryFileHeader followed by fixed-size BinaryRecords, all little endian
+// Every record is the same size, so the file can be mmapped and indexed directly
+
+#include <cstddef>
+#include <cstdint>
+
+enum class RecordOperandKind : uint8_t {
+	Invalid,
+	Reg,   ///< value is the register number
+	Imm,   ///< value is the immediate
+	FPImm, ///< value is the bit pattern of the double
+	Expr,  ///< value is unused, jsonl output has the expression's text
+	Inst,  ///< value is unused
+};
+
+enum RecordFlags : uint8_t {
+	RecordOperandsTruncated = 1 << 0, ///< The MCInst had more than MaxRecordOperands operands
+	RecordBytesTruncated    = 1 << 1, ///< The encoding was longer than MaxRecordBytes
+	RecordHasFixups         = 1 << 2, ///< The encoder emitted fixups, so some bytes will be changed by the object writer
+	RecordTwiddled          = 1 << 3, ///< Made by -twiddle rather than the compiler
+};
+
+constexpr size_t MaxRecordOperands = 12;
+constexpr size_t MaxRecordBytes = 16;
+constexpr char BinaryRecordMagic[8] = {'A', 'G', 'X', 'E', 'N', 'C', 'R', 'D'};
+constexpr uint32_t BinaryRecordVersion = 1;
+
+struct BinaryFileHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t recordSize;
+};
+
+struct BinaryRecord {
+	uint32_t input;       ///< Index of the input file in the run
+	uint32_t opcode;
+	uint64_t descFlags;   ///< MCInstrDesc::Flags
+	uint64_t tsFlags;     ///< MCInstrDesc::TSFlags
+	uint16_t schedClass;
+	uint8_t descSize;     ///< MCInstrDesc::getSize(), the actual encoding length is numBytes
+	uint8_t numDefs;
+	uint8_t numOperands;  ///< Number of operands in the MCInst, only the first MaxRecordOperands are stored
+	uint8_t numBytes;
+	uint8_t flags;        ///< RecordFlags
+	uint8_t reserved;
+	uint8_t operandKinds[MaxRecordOperands]; ///< RecordOperandKind
+	uint8_t bytes[MaxRecordBytes];
+	uint32_t reserved2;
+	int64_t operandValues[MaxRecordOperands];
+};
+
+static_assert(sizeof(BinaryFileHeader) == 16, "Binary header layout is part of the file format");
+static_assert(sizeof(BinaryRecord) == 160, "Binary record layout is part of the file format");
+static_assert(offsetof(BinaryRecord, operandValues) % 8 == 0, "Operand values should be aligned");
@@ -0,0 +1,166 @@
+#include "FPImmTable.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <unordered_map>
+
+namespace {
+
+/// NaNs are built by hand so their payloads survive, converting them through float or double can quiet them
+double doubleFromParts(uint32_t sign, uint32_t mantissa, int mantissaBits) {
+	uint64_t bits = (uint64_t)sign << 63 | 0x7ffULL << 52 | (uint64_t)mantissa << (52 - mantissaBits);
+	double res;
+	memcpy(&res, &bits, sizeof(res));
+	return res;
+}
+
+uint32_t halfToFloatBits(uint16_t half) {
+	uint32_t sign = half >> 15, exp = (half >> 10) & 0x1f, mantissa = half & 0x3ff;
+	if (exp == 0x1f) {
+		return sign << 31 | 0xffu << 23 | mantissa << 13;
+	}
+	float f = (float)fpImmToDouble(FPImmFormat::Half, half);
+	uint32_t bits;
+	memcpy(&bits, &f, sizeof(bits));
+	return bits;
+}
+
+void appendHexPattern(std::string& out, FPImmFormat format, uint32_t bits) {
+	static const char hex[] = "0123456789abcdef";
+	out += "0x";
+	for (int shift = format == FPImmFormat::Half ? 12 : 28; shift >= 0; shift -= 4) {
+		out += hex[(bits >> shift) & 15];
+	}
+}
+
+} // namespace
+
+double fpImmToDouble(FPImmFormat format, uint32_t bits) {
+	if (format == FPImmFormat::Half) {
+		uint32_t sign = (bits >> 15) & 1, exp = (bits >> 10) & 0x1f, mantissa = bits & 0x3ff;
+		if (exp == 0x1f) {
+			return doubleFromParts(sign, mantissa, 10);
+		}
+		double magnitude = exp ? std::ldexp(1024 + mantissa, exp - 25) : std::ldexp(mantissa, -24);
+		return sign ? -magnitude : magnitude;
+	}
+	if ((bits & 0x7f800000) == 0x7f800000) {
+		return doubleFromParts(bits >> 31, bits & 0x7fffff, 23);
+	}
+	float f;
+	memcpy(&f, &bits, sizeof(f));
+	return f;
+}
+
+uint64_t hashFPImmEncoding(const uint8_t* bytes, size_t size) {
+	// FNV-1a
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (size_t i = 0; i < size; i++) {
+		hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+std::vector<uint32_t> fpImmPatterns(FPImmFormat format, uint32_t floatStride) {
+	std::vector<uint32_t> patterns;
+	if (format == FPImmFormat::Half) {
+		patterns.resize(0x10000);
+		for (uint32_t i = 0; i < 0x10000; i++) {
+			patterns[i] = i;
+		}
+		return patterns;
+	}
+	// Constants that fit in a half are the likeliest to have a short form, so they're always included
+	for (uint32_t i = 0; i < 0x10000; i++) {
+		patterns.push_back(halfToFloatBits(i));
+	}
+	if (floatStride) {
+		for (uint64_t bits = 0; bits <= UINT32_MAX; bits += floatStride) {
+			patterns.push_back((uint32_t)bits);
+		}
+	}
+	std::sort(patterns.begin(), patterns.end());
+	patterns.erase(std::unique(patterns.begin(), patterns.end()), patterns.end());
+	return patterns;
+}
+
+FPImmTable buildFPImmTable(FPImmFormat format, const std::vector<uint32_t>& patterns, const std::vector<FPImmResult>& results) {
+	FPImmTable table;
+	table.format = format;
+
+	uint8_t shortest = UINT8_MAX;
+	// Keyed on hash and size, the number of patterns that encoded that way
+	std::unordered_map<uint64_t, uint32_t> seen;
+	auto key = [](const FPImmResult& res) { return res.hash ^ (uint64_t)res.size << 56; };
+	for (const FPImmResult& res : results) {
+		if (!res.fixup) {
+			shortest = std::min(shortest, res.size);
+			seen[key(res)]++;
+		}
+	}
+
+	for (size_t i = 0; i < results.size(); i++) {
+		const FPImmResult& res = results[i];
+		FPImmClass cls = FPImmClass::Inline;
+		if (res.fixup) {
+			cls = FPImmClass::Fixup;
+		} else if (seen[key(res)] > 1) {
+			cls = FPImmClass::Shared;
+		} else if (res.size > shortest) {
+			cls = FPImmClass::Wide;
+		}
+		table.counts[(size_t)cls]++;
+		if (!table.ranges.empty() && table.ranges.back().cls == cls && table.ranges.back().size == res.size) {
+			table.ranges.back().last = patterns[i];
+			table.ranges.back().count++;
+		} else {
+			table.ranges.push_back({patterns[i], patterns[i], 1, cls, res.size});
+		}
+	}
+	return table;
+}
+
+const char* fpImmFormatName(FPImmFormat format) {
+	return format == FPImmFormat::Half ? "half" : "float";
+}
+
+const char* fpImmClassName(FPImmClass cls) {
+	switch (cls) {
+		case FPImmClass::Inline: return "inline";
+		case FPImmClass::Wide:   return "wide";
+		case FPImmClass::Shared: return "shared";
+		case FPImmClass::Fixup:  return "fixup";
+	}
+	return "unknown";
+}
+
+void appendFPImmTableText(std::string& out, const FPImmTable& table) {
+	for (const FPImmRange& range : table.ranges) {
+		out += '\t';
+		appendHexPattern(out, table.format, range.first);
+		out += '-';
+		appendHexPattern(out, table.format, range.last);
+		out += ' ' + std::to_string(range.count) + ' ' + fpImmClassName(range.cls) + ' ' + std::to_string(range.size) + " bytes\n";
+	}
+}
+
+void appendFPImmTableJSON(std::string& out, const FPImmTable& table) {
+	out += "{\"format\":\"";
+	out += fpImmFormatName(table.format);
+	out += "\",\"counts\":{";
+	for (size_t c = 0; c < 4; c++) {
+		out += c ? ",\"" : "\"";
+		out += fpImmClassName((FPImmClass)c);
+		out += "\":" + std::to_string(table.counts[c]);
+	}
+	out += "},\"ranges\":[";
+	for (size_t i = 0; i < table.ranges.size(); i++) {
+		const FPImmRange& range = table.ranges[i];
+		out += i ? ",[" : "[";
+		out += std::to_string(range.first) + ',' + std::to_string(range.last) + ',' + std::to_string(range.count) + ",\"";
+		out += fpImmClassName(range.cls);
+		out += "\"," + std::to_string(range.size) + ']';
+	}
+	out += "]}";
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+// Works out which floating point constants an instruction can hold inline, from a -fp-imm-table sweep
+// The sweep encodes every half bit pattern and a strided subset of float bit patterns, this classifies the results
+// and squeezes them into ranges of bit patterns that encoded the same way
+// Only uses the standard library
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+enum class FPImmFormat : uint8_t {
+	Half,
+	Float,
+};
+
+enum class FPImmClass : uint8_t {
+	Inline, ///< Encoded in the shortest size seen, and no other value gave the same bytes
+	Wide,   ///< Longer than the shortest encoding seen, the constant needed extra bytes
+	Shared, ///< Gave the same bytes as another value, so the constant wasn't kept exactly
+	Fixup,  ///< The encoder emitted a fixup, the constant went somewhere else
+};
+
+/// What encoding one bit pattern produced, the bytes themselves are only kept as a hash
+struct FPImmResult {
+	uint64_t hash = 0;
+	uint8_t size = 0;
+	bool fixup = false;
+};
+
+/// Consecutive swept bit patterns that all got the same class and size
+struct FPImmRange {
+	uint32_t first;
+	uint32_t last;
+	uint32_t count; ///< Patterns swept in [first, last], only all of them for halves
+	FPImmClass cls;
+	uint8_t size;
+};
+
+struct FPImmTable {
+	FPImmFormat format;
+	uint64_t counts[4] = {}; ///< Per FPImmClass
+	std::vector<FPImmRange> ranges;
+};
+
+double fpImmToDouble(FPImmFormat format, uint32_t bits);
+uint64_t hashFPImmEncoding(const uint8_t* bytes, size_t size);
+
+/// The bit patterns to sweep in ascending order: all 65536 for halves,
+/// for floats every floatStride-th pattern plus every half value widened to float
+std::vector<uint32_t> fpImmPatterns(FPImmFormat format, uint32_t floatStride);
+
+/// results is parallel to patterns
+FPImmTable buildFPImmTable(FPImmFormat format, const std::vector<uint32_t>& patterns, const std::vector<FPImmResult>& results);
+
+const char* fpImmFormatName(FPImmFormat format);
+const char* fpImmClassName(FPImmClass cls);
+
+/// One "first-last count class size" line per range, each starting with a tab
+void appendFPImmTableText(std::string& out, const FPImmTable& table);
+/// {"format":..., "counts":{...}, "ranges":[[first,last,count,"class",size],...]}
+void appendFPImmTableJSON(std::string& out, const FPImmTable& table);
@@ -0,0 +1,264 @@
+#include "FieldInference.h"
+
+#include <algorithm>
+#include <map>
+
+namespace {
+
+/// A set of samples that only differ in the operand being inferred
+using SampleGroup = std::vector<const TwiddleSample*>;
+
+bool getBit(const std::vector<uint8_t>& bytes, int bit) {
+	size_t byte = bit / 8;
+	return byte < bytes.size() && (bytes[byte] >> (bit % 8) & 1);
+}
+
+uint64_t gatherBits(const std::vector<uint8_t>& bytes, const std::vector<int>& bits) {
+	uint64_t res = 0;
+	for (size_t i = 0; i < bits.size(); i++) {
+		if (bits[i] >= 0 && getBit(bytes, bits[i])) {
+			res |= 1ULL << i;
+		}
+	}
+	return res;
+}
+
+uint64_t fieldMask(size_t width) {
+	return width >= 64 ? ~0ULL : (1ULL << width) - 1;
+}
+
+bool isContiguous(const std::vector<int>& positions) {
+	for (size_t i = 1; i < positions.size(); i++) {
+		if (positions[i] != positions[i - 1] + 1) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/// Checks whether gathering `bits` gives operand value + some constant for every sample, and finds that constant
+bool findOffset(const std::vector<SampleGroup>& groups, size_t dim, const std::vector<int>& bits, int64_t& offset) {
+	uint64_t mask = fieldMask(bits.size());
+	bool found = false;
+	uint64_t diff = 0;
+	for (const SampleGroup& group : groups) {
+		for (const TwiddleSample* sample : group) {
+			uint64_t cur = (gatherBits(sample->bytes, bits) - (uint64_t)sample->values[dim]) & mask;
+			if (!found) {
+				diff = cur;
+				found = true;
+			} else if (cur != diff) {
+				return false;
+			}
+		}
+	}
+	// Report as a signed offset
+	if (bits.size() < 64 && diff >> (bits.size() - 1) & 1) {
+		diff |= ~mask;
+	}
+	offset = (int64_t)diff;
+	return true;
+}
+
+/// Looks for an operand value bit that matches each changing encoding bit, for fields that aren't in order
+bool findBitMapping(const std::vector<SampleGroup>& groups, size_t dim, const std::vector<int>& changing, std::vector<int>& bits) {
+	bits.clear();
+	for (int pos : changing) {
+		int match = -1;
+		for (int j = 0; j < 64 && match < 0; j++) {
+			bool ok = true;
+			for (const SampleGroup& group : groups) {
+				for (const TwiddleSample* sample : group) {
+					if (getBit(sample->bytes, pos) != ((uint64_t)sample->values[dim] >> j & 1)) {
+						ok = false;
+						break;
+					}
+				}
+				if (!ok) {
+					break;
+				}
+			}
+			if (ok) {
+				match = j;
+			}
+		}
+		if (match < 0) {
+			return false;
+		}
+		if ((size_t)match >= bits.size()) {
+			bits.resize(match + 1, -1);
+		}
+		if (bits[match] >= 0) {
+			return false;
+		}
+		bits[match] = pos;
+	}
+	return true;
+}
+
+InferredField inferField(unsigned operand, size_t dim, const std::vector<TwiddleSample>& samples) {
+	InferredField field;
+	field.operand = operand;
+	field.samples = samples.size();
+	if (samples.empty()) {
+		return field;
+	}
+
+	// Group by the values of the other operands so their bits cancel out
+	std::map<std::vector<int64_t>, SampleGroup> byOthers;
+	size_t maxLen = 0;
+	for (const TwiddleSample& sample : samples) {
+		std::vector<int64_t> others = sample.values;
+		others.erase(others.begin() + dim);
+		byOthers[others].push_back(&sample);
+		if (maxLen && sample.bytes.size() != maxLen) {
+			field.sizeVaries = true;
+		}
+		maxLen = std::max(maxLen, sample.bytes.size());
+	}
+	std::vector<SampleGroup> groups;
+	for (auto& entry : byOthers) {
+		groups.push_back(std::move(entry.second));
+	}
+
+	std::vector<uint8_t> changed(maxLen);
+	for (const SampleGroup& group : groups) {
+		const std::vector<uint8_t>& ref = group[0]->bytes;
+		for (const TwiddleSample* sample : group) {
+			for (size_t i = 0; i < maxLen; i++) {
+				uint8_t a = i < ref.size() ? ref[i] : 0;
+				uint8_t b = i < sample->bytes.size() ? sample->bytes[i] : 0;
+				changed[i] |= a ^ b;
+			}
+		}
+	}
+
+	std::vector<int> little;
+	for (size_t i = 0; i < maxLen * 8; i++) {
+		if (changed[i / 8] >> (i % 8) & 1) {
+			little.push_back((int)i);
+		}
+	}
+	if (little.empty()) {
+		return field;
+	}
+
+	// Big endian significance of each bit, for fields that cross byte boundaries the other way
+	auto bigIndex = [&](int bit) { return (int)(maxLen - 1 - bit / 8) * 8 + bit % 8; };
+	std::vector<int> big = little;
+	std::sort(big.begin(), big.end(), [&](int a, int b) { return bigIndex(a) < bigIndex(b); });
+	std::vector<int> bigPositions;
+	for (int bit : big) {
+		bigPositions.push_back(bigIndex(bit));
+	}
+
+	field.bits = little;
+	if (little.size() <= 64) {
+		if (findOffset(groups, dim, little, field.offset)) {
+			field.kind = FieldKind::Linear;
+			field.order = isContiguous(little) ? FieldBitOrder::Little : FieldBitOrder::Scattered;
+			return field;
+		}
+		if (findOffset(groups, dim, big, field.offset)) {
+			field.kind = FieldKind::Linear;
+			field.bits = big;
+			field.order = isContiguous(bigPositions) ? FieldBitOrder::Big : FieldBitOrder::Scattered;
+			return field;
+		}
+		std::vector<int> mapped;
+		if (findBitMapping(groups, dim, little, mapped)) {
+			field.kind = FieldKind::Linear;
+			field.order = FieldBitOrder::Scattered;
+			field.offset = 0;
+			field.bits = std::move(mapped);
+			return field;
+		}
+	}
+
+	field.kind = FieldKind::Table;
+	if (little.size() <= 64) {
+		std::map<int64_t, uint64_t> table;
+		for (const SampleGroup& group : groups) {
+			for (const TwiddleSample* sample : group) {
+				table.emplace(sample->values[dim], gatherBits(sample->bytes, little));
+			}
+		}
+		field.table.assign(table.begin(), table.end());
+	}
+	return field;
+}
+
+const char* kindName(FieldKind kind) {
+	switch (kind) {
+		case FieldKind::Unused: return "unused";
+		case FieldKind::Linear: return "linear";
+		case FieldKind::Table:  return "table";
+	}
+	return "unknown";
+}
+
+const char* orderName(FieldBitOrder order) {
+	switch (order) {
+		case FieldBitOrder::Little:    return "little";
+		case FieldBitOrder::Big:       return "big";
+		case FieldBitOrder::Scattered: return "scattered";
+	}
+	return "unknown";
+}
+
+} // namespace
+
+std::vector<InferredField> inferFields(const std::vector<unsigned>& operands, const std::vector<TwiddleSample>& samples) {
+	std::vector<InferredField> fields;
+	for (size_t dim = 0; dim < operands.size(); dim++) {
+		fields.push_back(inferField(operands[dim], dim, samples));
+	}
+	return fields;
+}
+
+void appendFieldTableJSON(std::string& out, uint32_t opcode, const std::vector<uint8_t>& baseline, const std::vector<InferredField>& fields) {
+	static const char hex[] = "0123456789abcdef";
+	out += "{\"opcode\":" + std::to_string(opcode) + ",\"baseline\":\"";
+	for (uint8_t byte : baseline) {
+		out += hex[byte >> 4];
+		out += hex[byte & 15];
+	}
+	out += "\",\"fields\":[";
+	for (size_t i = 0; i < fields.size(); i++) {
+		const InferredField& field = fields[i];
+		if (i) {
+			out += ',';
+		}
+		out += "{\"operand\":" + std::to_string(field.operand) + ",\"kind\":\"" + kindName(field.kind) + "\"";
+		if (field.kind != FieldKind::Unused) {
+			out += ",\"bits\":[";
+			for (size_t j = 0; j < field.bits.size(); j++) {
+				if (j) {
+					out += ',';
+				}
+				out += field.bits[j] < 0 ? "null" : std::to_string(field.bits[j]);
+			}
+			out += ']';
+		}
+		if (field.kind == FieldKind::Linear) {
+			out += ",\"bitOrder\":\"";
+			out += orderName(field.order);
+			out += "\",\"offset\":" + std::to_string(field.offset);
+		}
+		if (field.kind == FieldKind::Table) {
+			out += ",\"table\":[";
+			for (size_t j = 0; j < field.table.size(); j++) {
+				if (j) {
+					out += ',';
+				}
+				out += '[' + std::to_string(field.table[j].first) + ',' + std::to_string(field.table[j].second) + ']';
+			}
+			out += ']';
+		}
+		if (field.sizeVaries) {
+			out += ",\"sizeVaries\":true";
+		}
+		out += ",\"samples\":" + std::to_string(field.samples) + '}';
+	}
+	out += "]}";
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+// Works out which encoding bits an operand controls from the results of a -twiddle sweep
+// Only uses the standard library so it can also be run on recordings without Apple's libLLVM
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+struct TwiddleSample {
+	std::vector<int64_t> values; ///< Value of each swept operand (FPImms as the bits of the double)
+	std::vector<uint8_t> bytes;
+};
+
+enum class FieldKind {
+	Unused, ///< The operand never changed the encoding
+	Linear, ///< The field holds the operand value plus a constant offset
+	Table,  ///< Some other mapping, see InferredField::table
+};
+
+enum class FieldBitOrder {
+	Little,    ///< Contiguous bits when the encoding is read as a little endian number
+	Big,       ///< Contiguous bits when the encoding is read as a big endian number
+	Scattered, ///< Not contiguous either way
+};
+
+struct InferredField {
+	unsigned operand = 0;
+	FieldKind kind = FieldKind::Unused;
+	FieldBitOrder order = FieldBitOrder::Little;
+	/// Encoding bits the operand changes, numbered byte * 8 + bit
+	/// For linear fields bits[i] is bit i of the field (and is -1 if that field bit never varied)
+	std::vector<int> bits;
+	/// For linear fields, field value = operand value + offset
+	int64_t offset = 0;
+	/// For table fields, operand value -> field value with bits[i] as bit i
+	std::vector<std::pair<int64_t, uint64_t>> table;
+	size_t samples = 0;
+	bool sizeVaries = false;
+};
+
+/// Infers one field per swept operand
+/// `operands` are the MCInst operand indices matching TwiddleSample::values, the baseline encoding should be included in `samples`
+std::vector<InferredField> inferFields(const std::vector<unsigned>& operands, const std::vector<TwiddleSample>& samples);
+
+/// Appends the fields as a single line JSON object
+void appendFieldTableJSON(std::string& out, uint32_t opcode, const std::vector<uint8_t>& baseline, const std::vector<InferredField>& fields);
@@ -0,0 +1,188 @@
+// Benchmarks the per-instruction text formatting on synthetic MCInsts
+// Compares InstFormatter against the raw_ostream based formatting it replaced, and checks both print the same thing
+
+#include "InstFormatter.h"
+
+#include "llvm/MC/MCInst.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <vector>
+
+using namespace llvm;
+
+struct BenchOptions {
+	size_t insts = 100000;
+	size_t rounds = 20;
+};
+
+struct SyntheticInst {
+	MCInst inst;
+	std::vector<uint8_t> bytes;
+};
+
+/// Instructions with a mix of operands similar to what AGX2 emits: mostly registers and small immediates, some big immediates and float immediates
+static std::vector<SyntheticInst> makeInsts(size_t count) {
+	uint64_t state = 0x9e3779b97f4a7c15ULL;
+	auto next = [&]{
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		return state;
+	};
+	std::vector<SyntheticInst> insts(count);
+	for (SyntheticInst& synthetic : insts) {
+		synthetic.inst.setOpcode(next() % 2048);
+		unsigned numOperands = 2 + next() % 6;
+		for (unsigned i = 0; i < numOperands; i++) {
+			uint64_t kind = next() % 16;
+			if (kind < 9) {
+				synthetic.inst.addOperand(MCOperand::createReg(next() % 300));
+			} else if (kind < 13) {
+				synthetic.inst.addOperand(MCOperand::createImm((int64_t)(next() % 512) - 256));
+			} else if (kind < 15) {
+				synthetic.inst.addOperand(MCOperand::createImm(next()));
+			} else if (next() % 4) {
+				synthetic.inst.addOperand(MCOperand::createFPImm((double)(next() % 1000) / 8));
+			} else {
+				// -twiddle and -fp-imm-table sweeps hit these
+				static const double special[] = {
+					std::numeric_limits<double>::infinity(), -std::numeric_limits<double>::infinity(),
+					std::numeric_limits<double>::quiet_NaN(), -std::numeric_limits<double>::quiet_NaN(),
+					-0.0, std::numeric_limits<double>::denorm_min(),
+				};
+				synthetic.inst.addOperand(MCOperand::createFPImm(special[next() % (sizeof(special) / sizeof(special[0]))]));
+			}
+		}
+		synthetic.bytes.resize(next() % 2 ? 8 : 12);
+		for (uint8_t& byte : synthetic.bytes) {
+			byte = next();
+		}
+	}
+	return insts;
+}
+
+static std::vector<std::string> makeRegisterNames() {
+	std::vector<std::string> names;
+	for (unsigned i = 0; i < 300; i++) {
+		names.push_back((i < 256 ? "r" : "u") + std::to_string(i % 256) + (i % 2 ? "h" : "l"));
+	}
+	return names;
+}
+
+/// What CodeEmitterWrapper did before InstFormatter, a raw_ostream write per piece of the line
+static void formatBaseline(raw_ostream& out, const std::vector<std::string>& names, const SyntheticInst& synthetic) {
+	const MCInst& inst = synthetic.inst;
+	out << "Encoding ";
+	out << "Op #" << inst.getOpcode();
+	for (unsigned i = 0; i < inst.getNumOperands(); i++) {
+		const MCOperand& operand = inst.getOperand(i);
+		out << (i == 0 ? " " : ", ");
+		if (operand.isReg()) {
+			out << names[operand.getReg()];
+		} else if (operand.isImm()) {
+			if ((int64_t)(int16_t)operand.getImm() != operand.getImm()) {
+				out << "0x";
+				out.write_hex(operand.getImm());
+			} else {
+				out << operand.getImm();
+			}
+		} else if (operand.isFPImm()) {
+			out << operand.getFPImm() << "f";
+		}
+	}
+	out << "\n";
+	out << "\tResult: ";
+	const char* hexEnc = "0123456789abcdef";
+	for (uint8_t c : synthetic.bytes) {
+		out << hexEnc[c / 16] << hexEnc[c % 16];
+		out << " ";
+	}
+	out << "\n";
+}
+
+static void formatFast(raw_ostream& out, const InstFormatter& formatter, LineBuilder& line, const SyntheticInst& synthetic) {
+	line.clear();
+	line.append("Encoding ");
+	formatter.appendInst(line, synthetic.inst);
+	line.newline();
+	line.append("\tResult: ");
+	line.appendHexBytes(synthetic.bytes.data(), synthetic.bytes.size());
+	line.newline();
+	out.write(line.data(), line.size());
+}
+
+template <typename Fn>
+static double timeRounds(const BenchOptions& opts, std::string& output, Fn&& format) {
+	double best = 1e30;
+	for (size_t round = 0; round < opts.rounds; round++) {
+		output.clear();
+		raw_string_ostream out(output);
+		auto start = std::chrono::steady_clock::now();
+		format(out);
+		out.flush();
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+		best = std::min(best, elapsed.count());
+	}
+	return best;
+}
+
+static void usage(const char* progName) {
+	fprintf(stderr, "Usage: %s [-insts N] [-rounds N]\n", progName);
+	exit(1);
+}
+
+int main(int argc, char** argv) {
+	BenchOptions opts;
+	for (int i = 1; i < argc; i++) {
+		if (i + 1 >= argc) {
+			usage(argv[0]);
+		}
+		unsigned long long value = strtoull(argv[i + 1], nullptr, 0);
+		if (!strcmp(argv[i], "-insts")) {
+			opts.insts = value;
+		} else if (!strcmp(argv[i], "-rounds")) {
+			opts.rounds = value;
+		} else {
+			usage(argv[0]);
+		}
+		i++;
+	}
+	if (!opts.insts || !opts.rounds) {
+		usage(argv[0]);
+	}
+
+	std::vector<SyntheticInst> insts = makeInsts(opts.insts);
+	std::vector<std::string> names = makeRegisterNames();
+	InstFormatter formatter(names, nullptr);
+	LineBuilder line;
+
+	std::string baselineOutput;
+	std::string fastOutput;
+	double baseline = timeRounds(opts, baselineOutput, [&](raw_ostream& out) {
+		for (const SyntheticInst& inst : insts) {
+			formatBaseline(out, names, inst);
+		}
+	});
+	double fast = timeRounds(opts, fastOutput, [&](raw_ostream& out) {
+		for (const SyntheticInst& inst : insts) {
+			formatFast(out, formatter, line, inst);
+		}
+	});
+
+	printf("%zu synthetic instructions, best of %zu rounds\n", opts.insts, opts.rounds);
+	printf("raw_ostream:   %8.3fms  %12.0f records/s  %8.1f MB/s\n", baseline * 1e3, opts.insts / baseline, baselineOutput.size() / baseline / 1e6);
+	printf("InstFormatter: %8.3fms  %12.0f records/s  %8.1f MB/s  speedup %.2fx\n", fast * 1e3, opts.insts / fast, fastOutput.size() / fast / 1e6, baseline / fast);
+	if (baselineOutput != fastOutput) {
+		fprintf(stderr, "InstFormatter output differs from the raw_ostream output!\n");
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,106 @@
+#include "InstFormatter.h"
+
+#include "llvm/MC/MCExpr.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <cmath>
+#include <cstdio>
+
+using namespace llvm;
+
+const LineBuilder::HexTable LineBuilder::hexTable;
+
+void LineBuilder::appendUnsigned(uint64_t value) {
+	char digits[20];
+	char* end = digits + sizeof(digits);
+	char* pos = end;
+	do {
+		*--pos = '0' + value % 10;
+		value /= 10;
+	} while (value);
+	buf.append(pos, end - pos);
+}
+
+void LineBuilder::appendSigned(int64_t value) {
+	if (value < 0) {
+		buf.push_back('-');
+		appendUnsigned(-(uint64_t)value);
+	} else {
+		appendUnsigned(value);
+	}
+}
+
+void LineBuilder::appendHex(uint64_t value) {
+	static const char digits[] = "0123456789abcdef";
+	char hex[16];
+	char* end = hex + sizeof(hex);
+	char* pos = end;
+	do {
+		*--pos = digits[value & 15];
+		value >>= 4;
+	} while (value);
+	buf.append(pos, end - pos);
+}
+
+void InstFormatter::appendRegister(LineBuilder& line, unsigned reg) const {
+	if (reg < registerNames.size()) {
+		line.append(registerNames[reg]);
+	} else {
+		line.append('r');
+		line.appendUnsigned(reg);
+	}
+}
+
+void InstFormatter::appendInst(LineBuilder& line, const MCInst& inst) const {
+	line.append("Op #");
+	line.appendUnsigned(inst.getOpcode());
+	for (unsigned i = 0; i < inst.getNumOperands(); i++) {
+		const MCOperand& operand = inst.getOperand(i);
+		line.append(i == 0 ? " " : ", ");
+		if (!operand.isValid()) {
+			line.append("<InvalidOperand>");
+		} else if (operand.isReg()) {
+			appendRegister(line, operand.getReg());
+		} else if (operand.isImm()) {
+			int64_t imm = operand.getImm();
+			if ((int64_t)(int16_t)imm != imm) {
+				// Display large numbers as hex
+				line.append("0x");
+				line.appendHex(imm);
+			} else {
+				line.appendSigned(imm);
+			}
+		} else if (operand.isFPImm()) {
+			// Same as raw_ostream's operator<<(double), which goes through write_double
+			// That prints every NaN as "nan" and both infinities as "INF", with no sign
+			double fp = operand.getFPImm();
+			if (std::isnan(fp)) {
+				line.append("nan");
+			} else if (std::isinf(fp)) {
+				line.append("INF");
+			} else {
+				char str[64];
+				int len = snprintf(str, sizeof(str), "%.6e", fp);
+				line.append(str, len);
+			}
+			line.append('f');
+		} else if (operand.isExpr()) {
+			// Rare enough to go through raw_ostream
+			std::string str;
+			raw_string_ostream os(str);
+			bool target = operand.getExpr()->getKind() == MCExpr::Target;
+			if (target) {
+				os << "<Target Specific Expr ";
+			}
+			operand.getExpr()->print(os, asmInfo);
+			if (target) {
+				os << ">";
+			}
+			line.append(os.str());
+		} else if (operand.isInst()) {
+			line.append("<SubInst>");
+		} else {
+			line.append("<UnrecognizedOperand>");
+		}
+	}
+}
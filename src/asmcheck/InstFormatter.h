@@ -0,0 +1,86 @@
+#pragma once
+
+// Fast formatting for the per-instruction text output
+// Lines are built in a reusable buffer and written with one call per record, instead of many small raw_ostream writes
+
+#include "llvm/MC/MCAsmInfo.h"
+#include "llvm/MC/MCInst.h"
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+/// Growable text buffer that knows where the current line started, for padding to a column
+class LineBuilder {
+	std::string buf;
+	size_t lineStart = 0;
+
+	struct HexTable {
+		char pairs[256][3];
+		constexpr HexTable(): pairs() {
+			const char* digits = "0123456789abcdef";
+			for (int i = 0; i < 256; i++) {
+				pairs[i][0] = digits[i >> 4];
+				pairs[i][1] = digits[i & 15];
+				pairs[i][2] = ' ';
+			}
+		}
+	};
+	static const HexTable hexTable;
+
+public:
+	void clear() {
+		buf.clear();
+		lineStart = 0;
+	}
+	const char* data() const { return buf.data(); }
+	size_t size() const { return buf.size(); }
+
+	void append(char c) { buf.push_back(c); }
+	void append(const char* str) { buf.append(str, strlen(str)); }
+	void append(const char* str, size_t len) { buf.append(str, len); }
+	void append(const std::string& str) { buf.append(str); }
+
+	void newline() {
+		buf.push_back('\n');
+		lineStart = buf.size();
+	}
+
+	/// Adds spaces until the current line is column characters long
+	void padTo(size_t column) {
+		size_t current = buf.size() - lineStart;
+		if (current < column) {
+			buf.append(column - current, ' ');
+		}
+	}
+
+	void appendUnsigned(uint64_t value);
+	void appendSigned(int64_t value);
+	/// Lowercase hex without a prefix or leading zeros, like raw_ostream::write_hex
+	void appendHex(uint64_t value);
+	/// Each byte as two hex digits followed by a space
+	void appendHexBytes(const uint8_t* bytes, size_t count) {
+		size_t pos = buf.size();
+		buf.resize(pos + count * 3);
+		char* out = &buf[pos];
+		for (size_t i = 0; i < count; i++) {
+			memcpy(out + i * 3, hexTable.pairs[bytes[i]], 3);
+		}
+	}
+};
+
+/// Formats MCInsts the way mtl-gpu-asmcheck prints them, with register names looked up once up front
+class InstFormatter {
+	std::vector<std::string> registerNames;
+	const llvm::MCAsmInfo* asmInfo;
+
+public:
+	/// registerNames is indexed by register number, asmInfo is used to print expression operands
+	InstFormatter(std::vector<std::string> registerNames, const llvm::MCAsmInfo* asmInfo): registerNames(std::move(registerNames)), asmInfo(asmInfo) {}
+
+	void appendRegister(LineBuilder& line, unsigned reg) const;
+
+	/// "Op #opcode operand, operand, ..."
+	void appendInst(LineBuilder& line, const llvm::MCInst& inst) const;
+};
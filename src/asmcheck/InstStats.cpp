@@ -0,0 +1,178 @@
+#include "InstStats.h"
+
+#include "common/JSON.h"
+
+#include <cstdio>
+#include <map>
+#include <string>
+
+/// In llvm::MCID::Flag order
+static const char* const FlagNames[] = {
+	"Variadic", "HasOptionalDef", "Pseudo", "Return", "Call", "Barrier", "Terminator", "Branch", "IndirectBranch",
+	"Compare", "MoveImm", "MoveReg", "Bitcast", "Select", "DelaySlot", "FoldableAsLoad", "MayLoad", "MayStore",
+	"Predicable", "NotDuplicable", "UnmodeledSideEffects", "Commutable", "ConvertibleTo3Addr", "UsesCustomInserter",
+	"HasPostISelHook", "Rematerializable", "CheapAsAMove", "ExtraSrcRegAllocReq", "ExtraDefRegAllocReq",
+	"RegSequence", "ExtractSubreg", "InsertSubreg", "Convergent", "Add", "Trap",
+};
+static_assert(sizeof(FlagNames) / sizeof(*FlagNames) == 35, "Every llvm::MCID flag needs a name");
+
+/// Indexed by RecordOperandKind
+static const char* const OperandKindNames[] = {"invalid", "reg", "imm", "fpimm", "expr", "inst"};
+
+namespace {
+
+struct Row {
+	std::string key;
+	std::string name;
+	uint64_t count = 0;
+	uint64_t bytes = 0;
+};
+
+struct Table {
+	const char* name;
+	std::vector<Row> rows;
+};
+
+} // namespace
+
+void InstStats::merge(const InstStats& other) {
+	modules += other.modules;
+	for (size_t i = 0; i < counts.size(); i++) {
+		counts[i] += other.counts[i];
+		bytes[i] += other.bytes[i];
+	}
+	for (size_t i = 0; i < operandKinds.size(); i++) {
+		operandKinds[i] += other.operandKinds[i];
+	}
+	if (sizes.size() < other.sizes.size()) {
+		sizes.resize(other.sizes.size());
+	}
+	for (size_t i = 0; i < other.sizes.size(); i++) {
+		sizes[i] += other.sizes[i];
+	}
+}
+
+/// Folds the per opcode counts into every table
+static std::vector<Table> makeTables(const std::vector<InstStatsOpcodeInfo>& info, const std::vector<uint64_t>& counts, const std::vector<uint64_t>& bytes, const std::vector<uint64_t>& operandKinds, const std::vector<uint64_t>& sizes) {
+	std::vector<Row> opcodes;
+	std::map<unsigned, Row> schedClasses;
+	std::vector<Row> flags(sizeof(FlagNames) / sizeof(*FlagNames));
+	std::map<uint64_t, Row> tsFlags;
+	std::vector<Row> kinds(sizeof(OperandKindNames) / sizeof(*OperandKindNames));
+
+	for (unsigned opcode = 0; opcode < counts.size(); opcode++) {
+		if (!counts[opcode]) {
+			continue;
+		}
+		static const InstStatsOpcodeInfo unknown;
+		const InstStatsOpcodeInfo& desc = opcode < info.size() ? info[opcode] : unknown;
+		uint64_t count = counts[opcode];
+		uint64_t size = bytes[opcode];
+
+		opcodes.push_back({std::to_string(opcode), desc.name, count, size});
+
+		Row& sched = schedClasses[desc.schedClass];
+		sched.count += count;
+		sched.bytes += size;
+
+		for (size_t flag = 0; flag < flags.size(); flag++) {
+			if (desc.flags & (1ULL << flag)) {
+				flags[flag].count += count;
+				flags[flag].bytes += size;
+			}
+		}
+
+		Row& ts = tsFlags[desc.tsFlags];
+		ts.count += count;
+		ts.bytes += size;
+
+		for (size_t kind = 0; kind < kinds.size(); kind++) {
+			kinds[kind].count += operandKinds[opcode * kinds.size() + kind];
+		}
+	}
+
+	std::vector<Table> tables;
+	tables.push_back({"opcode", std::move(opcodes)});
+
+	tables.push_back({"sched_class", {}});
+	for (auto& entry : schedClasses) {
+		entry.second.key = std::to_string(entry.first);
+		tables.back().rows.push_back(std::move(entry.second));
+	}
+
+	tables.push_back({"size", {}});
+	for (size_t size = 0; size < sizes.size(); size++) {
+		if (sizes[size]) {
+			tables.back().rows.push_back({std::to_string(size), "", sizes[size], sizes[size] * size});
+		}
+	}
+
+	tables.push_back({"flag", {}});
+	for (size_t flag = 0; flag < flags.size(); flag++) {
+		if (flags[flag].count) {
+			flags[flag].key = std::to_string(flag);
+			flags[flag].name = FlagNames[flag];
+			tables.back().rows.push_back(std::move(flags[flag]));
+		}
+	}
+
+	tables.push_back({"ts_flags", {}});
+	for (auto& entry : tsFlags) {
+		char key[24];
+		snprintf(key, sizeof(key), "0x%016llx", (unsigned long long)entry.first);
+		entry.second.key = key;
+		tables.back().rows.push_back(std::move(entry.second));
+	}
+
+	// Operand kinds count operands, not instructions, so they don't have a byte total
+	tables.push_back({"operand_kind", {}});
+	for (size_t kind = 0; kind < kinds.size(); kind++) {
+		if (kinds[kind].count) {
+			kinds[kind].key = std::to_string(kind);
+			kinds[kind].name = OperandKindNames[kind];
+			tables.back().rows.push_back(std::move(kinds[kind]));
+		}
+	}
+	return tables;
+}
+
+void InstStats::writeJSON(std::string& out, const std::vector<InstStatsOpcodeInfo>& info) const {
+	uint64_t totalCount = 0;
+	uint64_t totalBytes = 0;
+	for (size_t i = 0; i < counts.size(); i++) {
+		totalCount += counts[i];
+		totalBytes += bytes[i];
+	}
+	out += "{\n\t\"modules\": " + std::to_string(modules) + ",\n\t\"instructions\": " + std::to_string(totalCount) + ",\n\t\"bytes\": " + std::to_string(totalBytes);
+	for (const Table& table : makeTables(info, counts, bytes, operandKinds, sizes)) {
+		out += ",\n\t\"";
+		out += table.name;
+		out += "\": [";
+		const char* delim = "\n";
+		for (const Row& row : table.rows) {
+			out += delim;
+			out += "\t\t{\"key\": ";
+			appendJSONString(out, row.key);
+			if (!row.name.empty()) {
+				out += ", \"name\": ";
+				appendJSONString(out, row.name);
+			}
+			out += ", \"count\": " + std::to_string(row.count) + ", \"bytes\": " + std::to_string(row.bytes) + "}";
+			delim = ",\n";
+		}
+		out += "\n\t]";
+	}
+	out += "\n}\n";
+}
+
+void InstStats::writeCSV(std::string& out, const std::vector<InstStatsOpcodeInfo>& info) const {
+	// Keys and names are numbers and tablegen identifiers, so nothing needs quoting
+	out += "table,key,name,count,bytes\n";
+	out += "modules,,," + std::to_string(modules) + ",\n";
+	for (const Table& table : makeTables(info, counts, bytes, operandKinds, sizes)) {
+		for (const Row& row : table.rows) {
+			out += table.name;
+			out += "," + row.key + "," + row.name + "," + std::to_string(row.count) + "," + std::to_string(row.bytes) + "\n";
+		}
+	}
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+// Instruction histograms for -inst-stats, collected per module and merged into one table for the whole run
+// Everything is counted per opcode, since sched class, MCID flags and TSFlags are properties of the opcode and can be folded in when writing
+// Only uses the standard library, so mtl-gpu-asmcheck-replay can produce the same tables from a recording
+
+#include "EncodingRecord.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/// The MCInstrDesc fields the tables are grouped by
+struct InstStatsOpcodeInfo {
+	std::string name;
+	uint64_t flags = 0;   ///< MCInstrDesc::Flags
+	uint64_t tsFlags = 0; ///< MCInstrDesc::TSFlags
+	uint32_t schedClass = 0;
+};
+
+class InstStats {
+	static constexpr size_t NumOperandKinds = 6; ///< RecordOperandKind
+
+	uint64_t modules = 0;
+	std::vector<uint64_t> counts;       ///< Instructions per opcode
+	std::vector<uint64_t> bytes;        ///< Encoded bytes per opcode
+	std::vector<uint64_t> operandKinds; ///< Operands per opcode and RecordOperandKind
+	std::vector<uint64_t> sizes;        ///< Instructions per encoded size
+
+public:
+	explicit InstStats(unsigned numOpcodes): counts(numOpcodes), bytes(numOpcodes), operandKinds(numOpcodes * NumOperandKinds), sizes(17) {}
+
+	unsigned numOpcodes() const { return (unsigned)counts.size(); }
+
+	void addModule() { modules++; }
+
+	/// Returns false (and counts nothing) if the opcode is out of range, otherwise follow up with addOperand for each operand
+	bool add(unsigned opcode, size_t size) {
+		if (opcode >= counts.size()) {
+			return false;
+		}
+		counts[opcode]++;
+		bytes[opcode] += size;
+		if (size >= sizes.size()) {
+			sizes.resize(size + 1);
+		}
+		sizes[size]++;
+		return true;
+	}
+
+	void addOperand(unsigned opcode, RecordOperandKind kind) {
+		if ((size_t)kind < NumOperandKinds) {
+			operandKinds[opcode * NumOperandKinds + (size_t)kind]++;
+		}
+	}
+
+	/// Adds other's counts into these, both have to be for the same number of opcodes
+	void merge(const InstStats& other);
+
+	/// One object with tables per opcode, sched class, encoded size, MCID flag, TSFlags value and operand kind
+	/// info is indexed by opcode and only needs to be filled in for opcodes that were seen
+	void writeJSON(std::string& out, const std::vector<InstStatsOpcodeInfo>& info) const;
+	/// One row per table entry, as `table,key,name,count,bytes`, so it's easy to filter and sort
+	void writeCSV(std::string& out, const std::vector<InstStatsOpcodeInfo>& info) const;
+};
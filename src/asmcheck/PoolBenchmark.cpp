@@ -0,0 +1,116 @@
+// Benchmarks the -j worker pool with a stand-in for the AGX2 code emitter
+// Doesn't need Apple's libLLVM, so it also builds and runs on Linux
+
+#include "common/WorkerPool.h"
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+struct BenchOptions {
+	unsigned jobs = 0;
+	size_t modules = 256;
+	size_t instsPerModule = 20000;
+};
+
+/// Rough imitation of what a compile job does per instruction: pick operands, encode them, and format a log line
+static JobResult fakeCompileModule(size_t module, size_t numInsts) {
+	JobResult result;
+	uint64_t state = 0x9e3779b97f4a7c15ULL * (module + 1);
+	auto next = [&]{
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		return state;
+	};
+	char line[128];
+	for (size_t i = 0; i < numInsts; i++) {
+		uint64_t opcode = next() % 1024;
+		uint64_t ops[3] = { next() % 128, next() % 128, next() % 65536 };
+		uint8_t bytes[8];
+		uint64_t enc = opcode | ops[0] << 10 | ops[1] << 17 | ops[2] << 24;
+		for (int round = 0; round < 16; round++) {
+			enc = (enc ^ (enc >> 29)) * 0xbf58476d1ce4e5b9ULL;
+		}
+		memcpy(bytes, &enc, sizeof(bytes));
+		int len = snprintf(line, sizeof(line), "Encoding Op #%u r%u, r%u, %u\n\tResult: ", (unsigned)opcode, (unsigned)ops[0], (unsigned)ops[1], (unsigned)ops[2]);
+		result.output.append(line, len);
+		for (uint8_t byte : bytes) {
+			len = snprintf(line, sizeof(line), "%02x ", byte);
+			result.output.append(line, len);
+		}
+		result.output += '\n';
+	}
+	return result;
+}
+
+struct RunResult {
+	double seconds;
+	uint64_t hash;
+	size_t bytes;
+};
+
+static RunResult run(unsigned workers, const BenchOptions& opts) {
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	size_t bytes = 0;
+	auto start = std::chrono::steady_clock::now();
+	runJobsOrdered(workers, opts.modules, [&](unsigned, size_t index) {
+		return fakeCompileModule(index, opts.instsPerModule);
+	}, [&](size_t, JobResult& result) {
+		// Stands in for writing to stdout, and checks the merge order is the same for every worker count
+		for (char c : result.output) {
+			hash = (hash ^ (uint8_t)c) * 0x100000001b3ULL;
+		}
+		bytes += result.output.size();
+	});
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	return {elapsed.count(), hash, bytes};
+}
+
+static void usage(const char* progName) {
+	fprintf(stderr, "Usage: %s [-j N] [-modules N] [-insts N]\n", progName);
+	exit(1);
+}
+
+int main(int argc, char** argv) {
+	BenchOptions opts;
+	for (int i = 1; i < argc; i++) {
+		if (i + 1 >= argc) {
+			usage(argv[0]);
+		}
+		unsigned long long value = strtoull(argv[i + 1], nullptr, 0);
+		if (!strcmp(argv[i], "-j")) {
+			opts.jobs = (unsigned)value;
+		} else if (!strcmp(argv[i], "-modules")) {
+			opts.modules = value;
+		} else if (!strcmp(argv[i], "-insts")) {
+			opts.instsPerModule = value;
+		} else {
+			usage(argv[0]);
+		}
+		i++;
+	}
+
+	unsigned maxWorkers = resolveWorkerCount(opts.jobs, opts.modules);
+	printf("%zu modules x %zu instructions, stand-in emitter\n", opts.modules, opts.instsPerModule);
+	RunResult base = run(1, opts);
+	printf("%3u worker%s: %8.3fs  %10.0f insts/s\n", 1, " ", base.seconds, opts.modules * opts.instsPerModule / base.seconds);
+	for (unsigned workers = 2; workers <= maxWorkers; workers *= 2) {
+		if (workers * 2 > maxWorkers) {
+			workers = maxWorkers;
+		}
+		RunResult res = run(workers, opts);
+		printf("%3u workers: %8.3fs  %10.0f insts/s  speedup %.2fx (%.0f%% of linear)\n",
+			workers, res.seconds, opts.modules * opts.instsPerModule / res.seconds,
+			base.seconds / res.seconds, 100 * base.seconds / res.seconds / workers);
+		if (res.hash != base.hash || res.bytes != base.bytes) {
+			fprintf(stderr, "Output with %u workers differs from serial output!\n", workers);
+			return 1;
+		}
+	}
+	return 0;
+}
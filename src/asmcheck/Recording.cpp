@@ -0,0 +1,219 @@
+#include "Recording.h"
+
+#include <cstring>
+
+void RecordingWriter::putU64(uint64_t value) {
+	for (int i = 0; i < 8; i++) {
+		out.push_back(char(value >> (i * 8)));
+	}
+}
+
+void RecordingWriter::writeHeader(std::string& out) {
+	out.append(RecordingMagic, sizeof(RecordingMagic));
+	for (int i = 0; i < 4; i++) {
+		out.push_back(char(RecordingVersion >> (i * 8)));
+	}
+}
+
+void RecordingWriter::beginModule(uint32_t input, std::string_view filename) {
+	haveDesc.clear();
+	haveRegister.clear();
+	out.push_back('M');
+	putVarint(input);
+	putString(filename);
+}
+
+void RecordingWriter::writeDesc(uint32_t opcode, const RecordedDesc& desc) {
+	if (opcode >= haveDesc.size()) {
+		haveDesc.resize(size_t(opcode) + 1);
+	}
+	haveDesc[opcode] = true;
+	out.push_back('D');
+	putVarint(opcode);
+	putString(desc.name);
+	putU64(desc.flags);
+	putU64(desc.tsFlags);
+	putVarint(desc.schedClass);
+	putVarint(desc.size);
+	putVarint(desc.numDefs);
+	putVarint(desc.numOperands);
+}
+
+void RecordingWriter::writeRegister(uint32_t reg, std::string_view name) {
+	if (reg >= haveRegister.size()) {
+		haveRegister.resize(size_t(reg) + 1);
+	}
+	haveRegister[reg] = true;
+	out.push_back('N');
+	putVarint(reg);
+	putString(name);
+}
+
+void RecordingWriter::writeSweep(uint32_t opcode, const std::vector<unsigned>& operands) {
+	out.push_back('S');
+	putVarint(opcode);
+	putVarint(operands.size());
+	for (unsigned operand : operands) {
+		putVarint(operand);
+	}
+}
+
+bool RecordingReader::getVarint(uint64_t& value) {
+	value = 0;
+	for (int shift = 0; shift < 64; shift += 7) {
+		if (pos == end) {
+			return false;
+		}
+		uint8_t byte = *pos++;
+		value |= uint64_t(byte & 0x7f) << shift;
+		if (!(byte & 0x80)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+bool RecordingReader::getSigned(int64_t& value) {
+	uint64_t raw;
+	if (!getVarint(raw)) {
+		return false;
+	}
+	value = int64_t(raw >> 1) ^ -int64_t(raw & 1);
+	return true;
+}
+
+bool RecordingReader::getU64(uint64_t& value) {
+	if (end - pos < 8) {
+		return false;
+	}
+	value = 0;
+	for (int i = 0; i < 8; i++) {
+		value |= uint64_t(uint8_t(pos[i])) << (i * 8);
+	}
+	pos += 8;
+	return true;
+}
+
+bool RecordingReader::getString(std::string_view& str) {
+	uint64_t size;
+	if (!getVarint(size) || size > uint64_t(end - pos)) {
+		return false;
+	}
+	str = std::string_view(pos, size);
+	pos += size;
+	return true;
+}
+
+bool RecordingReader::readHeader(std::string& error) {
+	if (end - pos < 12 || memcmp(pos, RecordingMagic, sizeof(RecordingMagic)) != 0) {
+		error = "not a recording";
+		return false;
+	}
+	uint32_t version = 0;
+	for (int i = 0; i < 4; i++) {
+		version |= uint32_t(uint8_t(pos[8 + i])) << (i * 8);
+	}
+	if (version != RecordingVersion) {
+		error = "recording version " + std::to_string(version) + " isn't supported, expected " + std::to_string(RecordingVersion);
+		return false;
+	}
+	pos += 12;
+	return true;
+}
+
+RecordingReader::Entry RecordingReader::next() {
+	if (pos == end) {
+		return Entry::End;
+	}
+	char tag = *pos++;
+	uint64_t a, b, c, d, e;
+	switch (tag) {
+		case 'M': {
+			if (!getVarint(a) || !getString(moduleFilename)) {
+				return Entry::Error;
+			}
+			moduleInput = uint32_t(a);
+			return Entry::Module;
+		}
+		case 'D': {
+			std::string_view name;
+			if (!getVarint(a) || !getString(name) || !getU64(desc.flags) || !getU64(desc.tsFlags)
+			    || !getVarint(b) || !getVarint(c) || !getVarint(d) || !getVarint(e)) {
+				return Entry::Error;
+			}
+			descOpcode = uint32_t(a);
+			desc.name.assign(name.data(), name.size());
+			desc.schedClass = uint32_t(b);
+			desc.size = uint32_t(c);
+			desc.numDefs = uint32_t(d);
+			desc.numOperands = uint32_t(e);
+			return Entry::Desc;
+		}
+		case 'N': {
+			if (!getVarint(a) || !getString(regName)) {
+				return Entry::Error;
+			}
+			reg = uint32_t(a);
+			return Entry::Register;
+		}
+		case 'S': {
+			if (!getVarint(a) || !getVarint(b) || b > uint64_t(end - pos)) {
+				return Entry::Error;
+			}
+			sweepOpcode = uint32_t(a);
+			sweepOperands.clear();
+			for (uint64_t i = 0; i < b; i++) {
+				if (!getVarint(c)) {
+					return Entry::Error;
+				}
+				sweepOperands.push_back(unsigned(c));
+			}
+			return Entry::Sweep;
+		}
+		case 'I': {
+			if (!getVarint(a) || pos == end) {
+				return Entry::Error;
+			}
+			inst.opcode = uint32_t(a);
+			inst.flags = uint8_t(*pos++);
+			if (!getVarint(c)) {
+				return Entry::Error;
+			}
+			inst.mcFlags = uint32_t(c);
+			if (!getVarint(b) || b > uint64_t(end - pos)) {
+				return Entry::Error;
+			}
+			// Resizing keeps the vector's allocation, so reading doesn't allocate once it's big enough
+			inst.operands.resize(b);
+			for (RecordedOperand& operand : inst.operands) {
+				if (pos == end) {
+					return Entry::Error;
+				}
+				operand.kind = RecordOperandKind(*pos++);
+				operand.value = 0;
+				operand.text = std::string_view();
+				bool ok = true;
+				switch (operand.kind) {
+					case RecordOperandKind::Reg:   ok = getVarint(c); operand.value = int64_t(c); break;
+					case RecordOperandKind::Imm:   ok = getSigned(operand.value); break;
+					case RecordOperandKind::FPImm: ok = getU64(c); operand.value = int64_t(c); break;
+					case RecordOperandKind::Expr:  ok = getString(operand.text); break;
+					case RecordOperandKind::Inst:
+					case RecordOperandKind::Invalid:
+						break;
+					default:
+						return Entry::Error;
+				}
+				if (!ok) {
+					return Entry::Error;
+				}
+			}
+			if (!getString(inst.bytes)) {
+				return Entry::Error;
+			}
+			return Entry::Inst;
+		}
+		default:
+			return Entry::Error;
+	}
+}
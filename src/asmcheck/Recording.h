@@ -0,0 +1,161 @@
+#pragma once
+
+// Format of -record files, a stream of every MCInst the encoder saw, read back by mtl-gpu-asmcheck-replay
+// Only uses the standard library so recordings can be analyzed on machines without Apple's libLLVM
+//
+// A file is RecordingMagic and a 4 byte little endian version, followed by entries that are each a tag byte and its fields
+// Numbers are LEB128 varints (signed ones zigzag encoded), u64s are 8 bytes little endian, strings are a varint length and the bytes
+//
+// 'M' module:   varint input index, string filename.  Desc and register entries only apply until the next module
+// 'D' desc:     varint opcode, string name, u64 flags, u64 tsFlags, varint schedClass, varint size, varint numDefs, varint numOperands
+// 'N' register: varint register, string name
+// 'S' sweep:    varint opcode, varint count, that many varint operand indices.  The twiddled instructions after it come from this -twiddle sweep
+// 'I' inst:     varint opcode, u8 RecordFlags, varint MCInst flags, varint operand count, the operands, varint byte count, the encoded bytes
+//               Each operand is a RecordOperandKind byte followed by Reg: varint, Imm: signed varint, FPImm: u64 bits, Expr: string
+//
+// Within a module, an opcode's desc and a register's name come before the first instruction that uses them
+// They can be repeated (parallel -twiddle chunks each write their own), a repeat replaces the earlier entry
+
+#include "EncodingRecord.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+constexpr char RecordingMagic[8] = {'A', 'G', 'X', 'R', 'E', 'C', 'R', 'D'};
+constexpr uint32_t RecordingVersion = 2;
+
+/// The MCInstrDesc fields a recording keeps per opcode
+struct RecordedDesc {
+	std::string name;
+	uint64_t flags = 0;
+	uint64_t tsFlags = 0;
+	uint32_t schedClass = 0;
+	uint32_t size = 0;
+	uint32_t numDefs = 0;
+	uint32_t numOperands = 0;
+};
+
+struct RecordedOperand {
+	RecordOperandKind kind;
+	int64_t value;         ///< Register number, immediate or the bits of the double
+	std::string_view text; ///< Expression text
+};
+
+struct RecordedInst {
+	uint32_t opcode;
+	uint8_t flags;    ///< RecordFlags
+	uint32_t mcFlags; ///< MCInst::getFlags()
+	std::vector<RecordedOperand> operands;
+	std::string_view bytes;
+};
+
+/// Appends entries to a string, tracking which descs and register names the current module already has
+class RecordingWriter {
+	std::string& out;
+	std::vector<bool> haveDesc;
+	std::vector<bool> haveRegister;
+
+	void putVarint(uint64_t value) {
+		while (value >= 0x80) {
+			out.push_back(char(value | 0x80));
+			value >>= 7;
+		}
+		out.push_back(char(value));
+	}
+	void putSigned(int64_t value) { putVarint((uint64_t(value) << 1) ^ uint64_t(value >> 63)); }
+	void putU64(uint64_t value);
+	void putString(std::string_view str) {
+		putVarint(str.size());
+		out.append(str.data(), str.size());
+	}
+
+public:
+	explicit RecordingWriter(std::string& out): out(out) {}
+
+	static void writeHeader(std::string& out);
+
+	/// A writer for entries that will be added to this one with append, which starts out knowing what this module already has
+	/// Lets threads record in parallel and have their entries put in order afterwards
+	RecordingWriter fork(std::string& forkOut) const {
+		RecordingWriter writer(forkOut);
+		writer.haveDesc = haveDesc;
+		writer.haveRegister = haveRegister;
+		return writer;
+	}
+	void append(const std::string& entries) { out += entries; }
+
+	void beginModule(uint32_t input, std::string_view filename);
+
+	bool needsDesc(uint32_t opcode) const { return opcode >= haveDesc.size() || !haveDesc[opcode]; }
+	void writeDesc(uint32_t opcode, const RecordedDesc& desc);
+	bool needsRegister(uint32_t reg) const { return reg >= haveRegister.size() || !haveRegister[reg]; }
+	void writeRegister(uint32_t reg, std::string_view name);
+
+	void writeSweep(uint32_t opcode, const std::vector<unsigned>& operands);
+
+	/// Instructions are written as beginInst, one add call per operand, then endInst
+	void beginInst(uint32_t opcode, uint8_t flags, uint32_t mcFlags, size_t numOperands) {
+		out.push_back('I');
+		putVarint(opcode);
+		out.push_back(char(flags));
+		putVarint(mcFlags);
+		putVarint(numOperands);
+	}
+	void addReg(uint32_t reg) {
+		out.push_back(char(RecordOperandKind::Reg));
+		putVarint(reg);
+	}
+	void addImm(int64_t imm) {
+		out.push_back(char(RecordOperandKind::Imm));
+		putSigned(imm);
+	}
+	void addFPImm(uint64_t bits) {
+		out.push_back(char(RecordOperandKind::FPImm));
+		putU64(bits);
+	}
+	void addExpr(std::string_view text) {
+		out.push_back(char(RecordOperandKind::Expr));
+		putString(text);
+	}
+	/// Inst and Invalid operands, which have no value
+	void addOther(RecordOperandKind kind) { out.push_back(char(kind)); }
+	void endInst(const char* bytes, size_t size) {
+		putVarint(size);
+		out.append(bytes, size);
+	}
+};
+
+/// Reads entries from a recording in memory (usually mmapped), without copying instruction data
+class RecordingReader {
+	const char* pos;
+	const char* end;
+
+	bool getVarint(uint64_t& value);
+	bool getSigned(int64_t& value);
+	bool getU64(uint64_t& value);
+	bool getString(std::string_view& str);
+
+public:
+	enum class Entry { Module, Desc, Register, Sweep, Inst, End, Error };
+
+	RecordingReader(const char* data, size_t size): pos(data), end(data + size) {}
+
+	/// Checks the magic and version, call before next()
+	bool readHeader(std::string& error);
+
+	/// Reads the next entry into the matching fields below
+	Entry next();
+
+	uint32_t moduleInput = 0;
+	std::string_view moduleFilename;
+	uint32_t descOpcode = 0;
+	RecordedDesc desc;
+	uint32_t reg = 0;
+	std::string_view regName;
+	uint32_t sweepOpcode = 0;
+	std::vector<unsigned> sweepOperands;
+	RecordedInst inst;
+};
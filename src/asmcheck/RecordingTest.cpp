@@ -0,0 +1,176 @@
+// Round-trips -record entries through RecordingWriter and RecordingReader, including varint and zigzag edge cases,
+// and checks that truncated files, overlong varints and other versions are rejected instead of misread
+// Doesn't need Apple's libLLVM, so it also builds and runs on Linux, `make check-std` runs it
+
+#include "Recording.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <iterator>
+#include <limits>
+#include <string>
+#include <vector>
+
+static int failures = 0;
+
+static void check(bool ok, const char* what) {
+	if (!ok && failures++ < 20) {
+		printf("FAIL: %s\n", what);
+	}
+}
+
+static const int64_t Imms[] = {
+	0, 1, -1, 63, -64, 64, -65, 8191, -8192, INT32_MAX, INT32_MIN,
+	std::numeric_limits<int64_t>::max(), std::numeric_limits<int64_t>::min(),
+};
+
+/// A recording with one of every entry, and the file offsets where each entry ends
+static std::string makeRecording(std::vector<size_t>& boundaries) {
+	std::string out;
+	RecordingWriter::writeHeader(out);
+	boundaries.push_back(out.size());
+	RecordingWriter writer(out);
+
+	writer.beginModule(300, "kernels.ll");
+	boundaries.push_back(out.size());
+	RecordedDesc desc;
+	desc.name = "FMADD32";
+	desc.flags = UINT64_MAX;
+	desc.tsFlags = 0x8000000000000001ULL;
+	desc.schedClass = 1000;
+	desc.size = 8;
+	desc.numDefs = 1;
+	desc.numOperands = 4;
+	check(writer.needsDesc(70000), "a new module needs descs");
+	writer.writeDesc(70000, desc);
+	boundaries.push_back(out.size());
+	check(!writer.needsDesc(70000), "a written desc isn't needed again");
+	writer.writeRegister(70000, "r0l");
+	boundaries.push_back(out.size());
+	writer.writeSweep(70000, {0, 3, 127, 128});
+	boundaries.push_back(out.size());
+
+	writer.beginInst(70000, RecordTwiddled | RecordHasFixups, UINT32_MAX, 5 + std::size(Imms));
+	writer.addReg(UINT32_MAX);
+	writer.addFPImm(0xfff8000000000001ULL);
+	writer.addExpr(std::string_view("sym\0+4", 6));
+	writer.addOther(RecordOperandKind::Inst);
+	writer.addOther(RecordOperandKind::Invalid);
+	for (int64_t imm : Imms) {
+		writer.addImm(imm);
+	}
+	writer.endInst("\x00\x80\xff", 3);
+	boundaries.push_back(out.size());
+
+	// Entries written by a fork start out knowing the module's descs
+	std::string forked;
+	RecordingWriter fork = writer.fork(forked);
+	check(!fork.needsDesc(70000) && fork.needsRegister(5), "a fork knows what the module already has");
+	fork.beginInst(0, 0, 0, 0);
+	fork.endInst("", 0);
+	writer.append(forked);
+	boundaries.push_back(out.size());
+
+	writer.beginModule(0, "");
+	boundaries.push_back(out.size());
+	check(writer.needsDesc(70000) && writer.needsRegister(70000), "a new module starts without descs or registers");
+	return out;
+}
+
+static void checkRoundTrip(const std::string& file) {
+	RecordingReader reader(file.data(), file.size());
+	std::string error;
+	check(reader.readHeader(error), "the header reads back");
+
+	check(reader.next() == RecordingReader::Entry::Module && reader.moduleInput == 300 && reader.moduleFilename == "kernels.ll", "module");
+	check(reader.next() == RecordingReader::Entry::Desc && reader.descOpcode == 70000, "desc opcode");
+	check(reader.desc.name == "FMADD32" && reader.desc.flags == UINT64_MAX && reader.desc.tsFlags == 0x8000000000000001ULL, "desc name and flags");
+	check(reader.desc.schedClass == 1000 && reader.desc.size == 8 && reader.desc.numDefs == 1 && reader.desc.numOperands == 4, "desc fields");
+	check(reader.next() == RecordingReader::Entry::Register && reader.reg == 70000 && reader.regName == "r0l", "register");
+	check(reader.next() == RecordingReader::Entry::Sweep && reader.sweepOpcode == 70000 && reader.sweepOperands == std::vector<unsigned>{0, 3, 127, 128}, "sweep");
+
+	check(reader.next() == RecordingReader::Entry::Inst, "instruction");
+	const RecordedInst& inst = reader.inst;
+	check(inst.opcode == 70000 && inst.flags == (RecordTwiddled | RecordHasFixups) && inst.mcFlags == UINT32_MAX, "instruction opcode and flags");
+	check(inst.operands.size() == 5 + std::size(Imms), "operand count");
+	if (inst.operands.size() == 5 + std::size(Imms)) {
+		check(inst.operands[0].kind == RecordOperandKind::Reg && inst.operands[0].value == UINT32_MAX, "register operand");
+		check(inst.operands[1].kind == RecordOperandKind::FPImm && uint64_t(inst.operands[1].value) == 0xfff8000000000001ULL, "FP immediate operand");
+		check(inst.operands[2].kind == RecordOperandKind::Expr && inst.operands[2].text == std::string_view("sym\0+4", 6), "expression operand");
+		check(inst.operands[3].kind == RecordOperandKind::Inst && inst.operands[4].kind == RecordOperandKind::Invalid, "operands without values");
+		for (size_t i = 0; i < std::size(Imms); i++) {
+			check(inst.operands[5 + i].kind == RecordOperandKind::Imm && inst.operands[5 + i].value == Imms[i], "zigzag immediate");
+		}
+	}
+	check(inst.bytes == std::string_view("\x00\x80\xff", 3), "instruction bytes");
+
+	check(reader.next() == RecordingReader::Entry::Inst && reader.inst.operands.empty() && reader.inst.bytes.empty(), "forked instruction");
+	check(reader.next() == RecordingReader::Entry::Module && reader.moduleInput == 0 && reader.moduleFilename.empty(), "second module");
+	check(reader.next() == RecordingReader::Entry::End, "end");
+}
+
+/// Cutting the file anywhere has to end in Error, or in End right where an entry ended
+static void checkTruncated(const std::string& file, const std::vector<size_t>& boundaries) {
+	for (size_t size = boundaries[0]; size < file.size(); size++) {
+		RecordingReader reader(file.data(), size);
+		std::string error;
+		reader.readHeader(error);
+		size_t entries = 0;
+		RecordingReader::Entry entry;
+		while ((entry = reader.next()) != RecordingReader::Entry::End && entry != RecordingReader::Entry::Error) {
+			entries++;
+		}
+		bool atBoundary = boundaries[entries] == size;
+		if (entry != (atBoundary ? RecordingReader::Entry::End : RecordingReader::Entry::Error)) {
+			check(false, "truncated recording");
+			printf("  cut at %zu of %zu after %zu entries\n", size, file.size(), entries);
+		}
+	}
+}
+
+static void checkRejected(const std::string& file, const char* what) {
+	RecordingReader reader(file.data(), file.size());
+	std::string error;
+	check(!reader.readHeader(error) && !error.empty(), what);
+}
+
+int main() {
+	std::vector<size_t> boundaries;
+	std::string file = makeRecording(boundaries);
+	checkRoundTrip(file);
+	checkTruncated(file, boundaries);
+
+	std::string header;
+	RecordingWriter::writeHeader(header);
+	checkRejected(header.substr(0, 11), "a short header is rejected");
+	std::string otherMagic = header;
+	otherMagic[0] = 'X';
+	checkRejected(otherMagic, "another magic is rejected");
+	std::string otherVersion = header;
+	otherVersion[8] = char(RecordingVersion + 1);
+	checkRejected(otherVersion, "another version is rejected");
+	{
+		RecordingReader reader(otherVersion.data(), otherVersion.size());
+		std::string error;
+		reader.readHeader(error);
+		check(error.find("version") != std::string::npos, "the version error says so");
+	}
+
+	// A varint can't run past 64 bits, and an unknown tag isn't skipped
+	std::string overlong = header + 'M' + std::string(10, '\x80') + '\x01' + '\0';
+	RecordingReader overlongReader(overlong.data(), overlong.size());
+	std::string error;
+	overlongReader.readHeader(error);
+	check(overlongReader.next() == RecordingReader::Entry::Error, "an overlong varint is rejected");
+	std::string unknown = header + 'Z';
+	RecordingReader unknownReader(unknown.data(), unknown.size());
+	unknownReader.readHeader(error);
+	check(unknownReader.next() == RecordingReader::Entry::Error, "an unknown tag is rejected");
+
+	if (failures) {
+		printf("%d failures\n", failures);
+		return 1;
+	}
+	printf("PASS: recordings round-trip\n");
+	return 0;
+}
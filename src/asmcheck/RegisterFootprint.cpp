@@ -0,0 +1,37 @@
+#include "RegisterFootprint.h"
+
+std::vector<RegisterClassUsage> RegisterFootprint::usage(const FunctionFootprint& function) {
+	std::vector<RegisterClassUsage> result;
+	for (size_t c = 0; c < function.used.size(); c++) {
+		const std::vector<uint64_t>& bits = function.used[c];
+		RegisterClassUsage usage = {uint32_t(c), 0, 0};
+		for (size_t word = 0; word < bits.size(); word++) {
+			if (bits[word]) {
+				usage.distinct += __builtin_popcountll(bits[word]);
+				usage.highest = uint32_t(word * 64 + 63 - __builtin_clzll(bits[word]));
+			}
+		}
+		if (usage.distinct) {
+			result.push_back(usage);
+		}
+	}
+	return result;
+}
+
+void RegisterFootprintSummary::add(const std::vector<RegisterClassUsage>& usage, const std::string& where, uint64_t order) {
+	functions++;
+	for (const RegisterClassUsage& use : usage) {
+		Peak& peak = peaks[use.regClass];
+		if (!peak.seen || use.highest > peak.highest || (use.highest == peak.highest && order < peak.highestOrder)) {
+			peak.highest = use.highest;
+			peak.highestWhere = where;
+			peak.highestOrder = order;
+		}
+		if (!peak.seen || use.distinct > peak.distinct || (use.distinct == peak.distinct && order < peak.distinctOrder)) {
+			peak.distinct = use.distinct;
+			peak.distinctWhere = where;
+			peak.distinctOrder = order;
+		}
+		peak.seen = true;
+	}
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+// Which registers each function touches, for -register-footprint
+// Every register is mapped to an index in one register class up front, so tracking an operand is a table lookup and setting a bit
+// Only uses the standard library, the register class tables come from the caller
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/// Where a register sits in the class it's tracked in
+struct RegisterSlot {
+	static constexpr uint32_t None = UINT32_MAX;
+	uint32_t regClass = None;
+	uint32_t index = 0;
+};
+
+struct RegisterClassUsage {
+	uint32_t regClass;
+	uint32_t distinct; ///< Registers of the class used
+	uint32_t highest;  ///< Highest index used, so highest + 1 registers have to be allocated
+};
+
+struct FunctionFootprint {
+	int function; ///< Index of the function in the module, -1 before the first function
+	std::vector<std::vector<uint64_t>> used; ///< Bitset of used indices per class, empty for classes that weren't touched
+};
+
+class RegisterFootprint {
+	const std::vector<RegisterSlot>& slots;
+	size_t numClasses;
+	std::vector<FunctionFootprint> functions;
+
+public:
+	/// slots is indexed by register number and has to outlive this
+	RegisterFootprint(const std::vector<RegisterSlot>& slots, size_t numClasses): slots(slots), numClasses(numClasses) {}
+
+	/// Instructions arrive in function order, so this starts a new function whenever it changes
+	void setFunction(int function) {
+		if (functions.empty() || functions.back().function != function) {
+			functions.push_back({function, std::vector<std::vector<uint64_t>>(numClasses)});
+		}
+	}
+
+	void addRegister(unsigned reg) {
+		if (reg >= slots.size() || slots[reg].regClass == RegisterSlot::None) {
+			return;
+		}
+		if (functions.empty()) {
+			setFunction(-1);
+		}
+		const RegisterSlot& slot = slots[reg];
+		std::vector<uint64_t>& bits = functions.back().used[slot.regClass];
+		if (slot.index / 64 >= bits.size()) {
+			bits.resize(slot.index / 64 + 1);
+		}
+		bits[slot.index / 64] |= uint64_t(1) << (slot.index % 64);
+	}
+
+	const std::vector<FunctionFootprint>& getFunctions() const { return functions; }
+
+	/// The classes a function used, in class order
+	static std::vector<RegisterClassUsage> usage(const FunctionFootprint& function);
+};
+
+/// The largest footprint of each class across a whole run
+class RegisterFootprintSummary {
+public:
+	struct Peak {
+		uint32_t highest = 0;
+		uint32_t distinct = 0;
+		std::string highestWhere; ///< Where the highest index was seen, as "function (input)"
+		std::string distinctWhere;
+		uint64_t highestOrder = 0;
+		uint64_t distinctOrder = 0;
+		bool seen = false;
+	};
+
+private:
+	std::vector<Peak> peaks;
+	uint64_t functions = 0;
+
+public:
+	explicit RegisterFootprintSummary(size_t numClasses): peaks(numClasses) {}
+
+	/// Ties go to the lowest order, so the summary doesn't depend on which thread finished first
+	void add(const std::vector<RegisterClassUsage>& usage, const std::string& where, uint64_t order);
+
+	uint64_t numFunctions() const { return functions; }
+	const std::vector<Peak>& getPeaks() const { return peaks; }
+};
@@ -0,0 +1,523 @@
+// Analyzes recordings made with `mtl-gpu-asmcheck -record`, without recompiling anything
+// Only uses the standard library, so it builds (and recordings can be looked at) on machines without Apple's libLLVM
+
+#include "FieldInference.h"
+#include "InstStats.h"
+#include "Recording.h"
+#include "SequenceDiff.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char* progName;
+
+/// A recording mapped into memory, instructions are read straight out of the mapping
+class MappedRecording {
+	const char* data = nullptr;
+	size_t size = 0;
+
+public:
+	MappedRecording() = default;
+	MappedRecording(const MappedRecording&) = delete;
+	MappedRecording& operator=(const MappedRecording&) = delete;
+	~MappedRecording() {
+		if (size) {
+			munmap(const_cast<char*>(data), size);
+		}
+	}
+
+	/// Maps the file and checks its header
+	bool open(const char* path, std::string& error) {
+		int fd = ::open(path, O_RDONLY);
+		if (fd < 0) {
+			error = strerror(errno);
+			return false;
+		}
+		struct stat st;
+		if (fstat(fd, &st) != 0) {
+			error = strerror(errno);
+			close(fd);
+			return false;
+		}
+		if (st.st_size) {
+			void* mem = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (mem == MAP_FAILED) {
+				error = strerror(errno);
+				close(fd);
+				return false;
+			}
+			data = static_cast<const char*>(mem);
+			size = st.st_size;
+		}
+		close(fd);
+		return RecordingReader(data, size).readHeader(error);
+	}
+
+	/// A reader positioned at the first entry
+	RecordingReader reader() const {
+		RecordingReader reader(data, size);
+		std::string error;
+		reader.readHeader(error);
+		return reader;
+	}
+};
+
+/// Descs and register names of the module being read
+struct ModuleNames {
+	std::vector<RecordedDesc> descs;
+	std::vector<std::string> registers;
+
+	void clear() {
+		descs.clear();
+		registers.clear();
+	}
+	/// Updates these from a Desc or Register entry
+	void add(RecordingReader::Entry entry, const RecordingReader& reader) {
+		if (entry == RecordingReader::Entry::Desc) {
+			if (reader.descOpcode >= descs.size()) {
+				descs.resize(reader.descOpcode + 1);
+			}
+			descs[reader.descOpcode] = reader.desc;
+		} else if (entry == RecordingReader::Entry::Register) {
+			if (reader.reg >= registers.size()) {
+				registers.resize(reader.reg + 1);
+			}
+			registers[reader.reg].assign(reader.regName.data(), reader.regName.size());
+		}
+	}
+};
+
+/// Same layout as asmcheck's text output, with the opcode's name in place of its number
+static void appendInst(std::string& line, const ModuleNames& names, const RecordedInst& inst) {
+	char buf[64];
+	if (inst.opcode < names.descs.size() && !names.descs[inst.opcode].name.empty()) {
+		line += names.descs[inst.opcode].name;
+	} else {
+		line += "Op #" + std::to_string(inst.opcode);
+	}
+	for (size_t i = 0; i < inst.operands.size(); i++) {
+		const RecordedOperand& operand = inst.operands[i];
+		line += i == 0 ? " " : ", ";
+		switch (operand.kind) {
+			case RecordOperandKind::Reg:
+				if (uint64_t(operand.value) < names.registers.size()) {
+					line += names.registers[operand.value];
+				} else {
+					line += "r" + std::to_string(operand.value);
+				}
+				break;
+			case RecordOperandKind::Imm:
+				if ((int64_t)(int16_t)operand.value != operand.value) {
+					snprintf(buf, sizeof(buf), "0x%" PRIx64, uint64_t(operand.value));
+					line += buf;
+				} else {
+					line += std::to_string(operand.value);
+				}
+				break;
+			case RecordOperandKind::FPImm: {
+				double fp;
+				memcpy(&fp, &operand.value, sizeof(fp));
+				snprintf(buf, sizeof(buf), "%.6ef", fp);
+				line += buf;
+				break;
+			}
+			case RecordOperandKind::Expr:
+				line.append(operand.text.data(), operand.text.size());
+				break;
+			case RecordOperandKind::Inst:
+				line += "<SubInst>";
+				break;
+			default:
+				line += "<InvalidOperand>";
+				break;
+		}
+	}
+}
+
+static void appendBytes(std::string& line, std::string_view bytes) {
+	static const char hex[] = "0123456789abcdef";
+	for (char c : bytes) {
+		line += hex[uint8_t(c) / 16];
+		line += hex[uint8_t(c) % 16];
+		line += ' ';
+	}
+}
+
+/// Opcode, MCInst flags and operands, the same things asmcheck -dedup keys on
+static void makeShapeKey(std::string& key, const RecordedInst& inst) {
+	key.assign(reinterpret_cast<const char*>(&inst.opcode), sizeof(inst.opcode));
+	key.append(reinterpret_cast<const char*>(&inst.mcFlags), sizeof(inst.mcFlags));
+	for (const RecordedOperand& operand : inst.operands) {
+		key += char(operand.kind);
+		key.append(reinterpret_cast<const char*>(&operand.value), sizeof(operand.value));
+		key.append(operand.text.data(), operand.text.size());
+		key += '\0';
+	}
+}
+
+static bool readError(const char* path) {
+	fprintf(stderr, "%s: %s: recording is truncated or corrupt\n", progName, path);
+	return false;
+}
+
+static bool printRecording(const char* path, const MappedRecording& file) {
+	RecordingReader reader = file.reader();
+	ModuleNames names;
+	std::string line;
+	for (RecordingReader::Entry entry; (entry = reader.next()) != RecordingReader::Entry::End;) {
+		line.clear();
+		switch (entry) {
+			case RecordingReader::Entry::Error:
+				return readError(path);
+			case RecordingReader::Entry::Module:
+				names.clear();
+				line += "==> ";
+				line.append(reader.moduleFilename.data(), reader.moduleFilename.size());
+				line += " <==\n";
+				break;
+			case RecordingReader::Entry::Inst:
+				line += reader.inst.flags & RecordTwiddled ? "Twiddled " : "Encoding ";
+				appendInst(line, names, reader.inst);
+				line += "\n\tResult: ";
+				appendBytes(line, reader.inst.bytes);
+				line += reader.inst.flags & RecordHasFixups ? "(has fixups)\n" : "\n";
+				break;
+			default:
+				names.add(entry, reader);
+				break;
+		}
+		fwrite(line.data(), 1, line.size(), stdout);
+	}
+	return true;
+}
+
+static bool printStats(const std::vector<const char*>& paths, const std::vector<std::unique_ptr<MappedRecording>>& files, bool csv) {
+	// The recording only has descs for opcodes that were used, so find the highest one before counting
+	std::vector<InstStatsOpcodeInfo> info;
+	for (size_t i = 0; i < files.size(); i++) {
+		RecordingReader reader = files[i]->reader();
+		for (RecordingReader::Entry entry; (entry = reader.next()) != RecordingReader::Entry::End;) {
+			if (entry == RecordingReader::Entry::Error) {
+				return readError(paths[i]);
+			}
+			if (entry == RecordingReader::Entry::Desc) {
+				if (reader.descOpcode >= info.size()) {
+					info.resize(reader.descOpcode + 1);
+				}
+				info[reader.descOpcode] = {reader.desc.name, reader.desc.flags, reader.desc.tsFlags, reader.desc.schedClass};
+			}
+		}
+	}
+	// Twiddled instructions aren't counted, same as -inst-stats
+	InstStats stats(info.size());
+	for (const std::unique_ptr<MappedRecording>& file : files) {
+		RecordingReader reader = file->reader();
+		for (RecordingReader::Entry entry; (entry = reader.next()) != RecordingReader::Entry::End;) {
+			if (entry == RecordingReader::Entry::Module) {
+				stats.addModule();
+			} else if (entry == RecordingReader::Entry::Inst && !(reader.inst.flags & RecordTwiddled)) {
+				if (stats.add(reader.inst.opcode, reader.inst.bytes.size())) {
+					for (const RecordedOperand& operand : reader.inst.operands) {
+						stats.addOperand(reader.inst.opcode, operand.kind);
+					}
+				}
+			}
+		}
+	}
+	std::string out;
+	if (csv) {
+		stats.writeCSV(out, info);
+	} else {
+		stats.writeJSON(out, info);
+	}
+	fwrite(out.data(), 1, out.size(), stdout);
+	return true;
+}
+
+static bool printDedup(const char* path, const MappedRecording& file) {
+	struct Shape {
+		uint64_t count;
+		std::string desc;
+	};
+	RecordingReader reader = file.reader();
+	ModuleNames names;
+	std::unordered_map<std::string, size_t> index;
+	std::vector<Shape> shapes;
+	uint64_t total = 0;
+	std::string key;
+	auto flush = [&]{
+		if (!total) {
+			return;
+		}
+		printf("Deduplicated %" PRIu64 " instructions to %zu unique\n", total, shapes.size());
+		std::stable_sort(shapes.begin(), shapes.end(), [](const Shape& a, const Shape& b) { return a.count > b.count; });
+		for (const Shape& shape : shapes) {
+			if (shape.count > 1) {
+				printf("\t%" PRIu64 "x %s\n", shape.count, shape.desc.c_str());
+			}
+		}
+		index.clear();
+		shapes.clear();
+		total = 0;
+	};
+	for (RecordingReader::Entry entry; (entry = reader.next()) != RecordingReader::Entry::End;) {
+		if (entry == RecordingReader::Entry::Error) {
+			return readError(path);
+		} else if (entry == RecordingReader::Entry::Module) {
+			flush();
+			names.clear();
+			printf("==> %.*s <==\n", (int)reader.moduleFilename.size(), reader.moduleFilename.data());
+		} else if (entry == RecordingReader::Entry::Inst) {
+			if (reader.inst.flags & RecordTwiddled) {
+				continue;
+			}
+			total++;
+			makeShapeKey(key, reader.inst);
+			auto inserted = index.emplace(key, shapes.size());
+			if (inserted.second) {
+				Shape shape = {0, {}};
+				appendInst(shape.desc, names, reader.inst);
+				shapes.push_back(std::move(shape));
+			}
+			shapes[inserted.first->second].count++;
+		} else {
+			names.add(entry, reader);
+		}
+	}
+	flush();
+	return true;
+}
+
+/// Reruns -twiddle-infer on every sweep in the recording
+static bool printInferred(const char* path, const MappedRecording& file) {
+	RecordingReader reader = file.reader();
+	std::vector<TwiddleSample> samples;
+	std::vector<unsigned> operands;
+	uint32_t sweepOpcode = 0;
+	bool inSweep = false;
+	TwiddleSample baseline;
+	std::string table;
+
+	auto sampleOf = [&](const RecordedInst& inst) {
+		TwiddleSample sample;
+		for (unsigned operand : operands) {
+			sample.values.push_back(operand < inst.operands.size() ? inst.operands[operand].value : 0);
+		}
+		sample.bytes.assign(inst.bytes.begin(), inst.bytes.end());
+		return sample;
+	};
+	auto finishSweep = [&]{
+		if (inSweep && samples.size() > 1) {
+			table.clear();
+			appendFieldTableJSON(table, sweepOpcode, samples[0].bytes, inferFields(operands, samples));
+			printf("%s\n", table.c_str());
+		}
+		inSweep = false;
+		samples.clear();
+	};
+
+	// A sweep's baseline is the compiled instruction recorded just before it
+	const RecordedInst* last = nullptr;
+	RecordedInst lastInst;
+	for (RecordingReader::Entry entry; (entry = reader.next()) != RecordingReader::Entry::End;) {
+		switch (entry) {
+			case RecordingReader::Entry::Error:
+				return readError(path);
+			case RecordingReader::Entry::Module:
+				finishSweep();
+				last = nullptr;
+				break;
+			case RecordingReader::Entry::Sweep:
+				finishSweep();
+				if (!last || last->opcode != reader.sweepOpcode) {
+					fprintf(stderr, "%s: %s: sweep of opcode #%u has no baseline instruction, skipping it\n", progName, path, reader.sweepOpcode);
+					break;
+				}
+				inSweep = true;
+				sweepOpcode = reader.sweepOpcode;
+				operands = reader.sweepOperands;
+				samples.push_back(sampleOf(*last));
+				break;
+			case RecordingReader::Entry::Inst:
+				if (!(reader.inst.flags & RecordTwiddled)) {
+					finishSweep();
+					lastInst = reader.inst;
+					last = &lastInst;
+				} else if (inSweep && reader.inst.opcode == sweepOpcode) {
+					samples.push_back(sampleOf(reader.inst));
+				}
+				break;
+			default:
+				break;
+		}
+	}
+	finishSweep();
+	return true;
+}
+
+/// Compares two recordings module by module and prints the instructions only one has, and the ones encoded differently
+static bool printDiff(const char* pathA, const MappedRecording& fileA, const char* pathB, const MappedRecording& fileB) {
+	struct DiffInst {
+		std::string line;
+		std::string_view bytes;
+		uint8_t flags;
+	};
+	RecordingReader readers[2] = {fileA.reader(), fileB.reader()};
+	const char* paths[2] = {pathA, pathB};
+	ModuleNames names[2];
+	std::vector<DiffInst> insts[2];
+	std::vector<uint32_t> ids[2];
+	std::unordered_map<std::string, uint32_t> idOf;
+	std::string key;
+	uint64_t module = 0;
+	uint64_t differences = 0;
+
+	/// Reads the rest of the current module, returns the entry it stopped at
+	auto readModule = [&](int side) {
+		insts[side].clear();
+		ids[side].clear();
+		while (true) {
+			RecordingReader::Entry entry = readers[side].next();
+			if (entry == RecordingReader::Entry::Module || entry == RecordingReader::Entry::End || entry == RecordingReader::Entry::Error) {
+				return entry;
+			}
+			if (entry != RecordingReader::Entry::Inst) {
+				names[side].add(entry, readers[side]);
+				continue;
+			}
+			const RecordedInst& inst = readers[side].inst;
+			DiffInst diffInst = {std::string(), inst.bytes, inst.flags};
+			appendInst(diffInst.line, names[side], inst);
+			diffInst.line += "\t; ";
+			appendBytes(diffInst.line, inst.bytes);
+			insts[side].push_back(std::move(diffInst));
+			makeShapeKey(key, inst);
+			ids[side].push_back(idOf.emplace(key, (uint32_t)idOf.size()).first->second);
+		}
+	};
+
+	// Lined up by opcode and operands like -diff-input, so one inserted instruction doesn't make every later one differ
+	auto diffModule = [&]{
+		size_t i = 0, j = 0;
+		for (DiffOp op : diffSequences(ids[0].data(), ids[0].size(), ids[1].data(), ids[1].size())) {
+			if (op == DiffOp::Delete) {
+				printf("Module %" PRIu64 " instruction %zu only in %s:\n- %s\n", module, i, paths[0], insts[0][i].line.c_str());
+				differences++;
+				i++;
+			} else if (op == DiffOp::Insert) {
+				printf("Module %" PRIu64 " instruction %zu only in %s:\n+ %s\n", module, j, paths[1], insts[1][j].line.c_str());
+				differences++;
+				j++;
+			} else {
+				if (insts[0][i].bytes != insts[1][j].bytes || insts[0][i].flags != insts[1][j].flags) {
+					printf("Module %" PRIu64 " instruction %zu:\n- %s\n+ %s\n", module, i, insts[0][i].line.c_str(), insts[1][j].line.c_str());
+					differences++;
+				}
+				i++;
+				j++;
+			}
+		}
+	};
+
+	// Anything before the first module entry is diffed as module 0
+	RecordingReader::Entry entries[2] = {readModule(0), readModule(1)};
+	while (true) {
+		for (int side = 0; side < 2; side++) {
+			if (entries[side] == RecordingReader::Entry::Error) {
+				return readError(paths[side]);
+			}
+		}
+		diffModule();
+		if (entries[0] != entries[1]) {
+			printf("%s has more modules\n", entries[0] == RecordingReader::Entry::Module ? paths[0] : paths[1]);
+			differences++;
+			break;
+		}
+		if (entries[0] == RecordingReader::Entry::End) {
+			break;
+		}
+		module = readers[0].moduleInput;
+		names[0].clear();
+		names[1].clear();
+		entries[0] = readModule(0);
+		entries[1] = readModule(1);
+	}
+	printf("%" PRIu64 " differences\n", differences);
+	return differences == 0;
+}
+
+static void usage() {
+	fprintf(stderr,
+		"Usage: %s print <recording>...\n"
+		"       %s stats [-format=json|csv] <recording>...\n"
+		"       %s dedup <recording>...\n"
+		"       %s infer <recording>...\n"
+		"       %s diff <recording> <recording>\n",
+		progName, progName, progName, progName, progName);
+	exit(1);
+}
+
+int main(int argc, char** argv) {
+	progName = argv[0];
+	if (argc < 3) {
+		usage();
+	}
+	std::string mode = argv[1];
+	bool csv = false;
+	std::vector<const char*> paths;
+	for (int i = 2; i < argc; i++) {
+		if (!strcmp(argv[i], "-format=csv")) {
+			csv = true;
+		} else if (!strcmp(argv[i], "-format=json")) {
+			csv = false;
+		} else {
+			paths.push_back(argv[i]);
+		}
+	}
+	if (paths.empty() || (mode == "diff" && paths.size() != 2)) {
+		usage();
+	}
+
+	std::vector<std::unique_ptr<MappedRecording>> files;
+	for (const char* path : paths) {
+		std::string error;
+		auto file = std::make_unique<MappedRecording>();
+		if (!file->open(path, error)) {
+			fprintf(stderr, "%s: %s: %s\n", progName, path, error.c_str());
+			return 1;
+		}
+		files.push_back(std::move(file));
+	}
+
+	bool ok = true;
+	if (mode == "stats") {
+		ok = printStats(paths, files, csv);
+	} else if (mode == "diff") {
+		ok = printDiff(paths[0], *files[0], paths[1], *files[1]);
+	} else if (mode == "print" || mode == "dedup" || mode == "infer") {
+		for (size_t i = 0; i < files.size(); i++) {
+			if (mode == "print") {
+				ok &= printRecording(paths[i], *files[i]);
+			} else if (mode == "dedup") {
+				ok &= printDedup(paths[i], *files[i]);
+			} else {
+				ok &= printInferred(paths[i], *files[i]);
+			}
+		}
+	} else {
+		usage();
+	}
+	return ok ? 0 : 1;
+}
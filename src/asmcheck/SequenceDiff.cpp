@@ -0,0 +1,148 @@
+#include "SequenceDiff.h"
+
+#include <algorithm>
+
+namespace {
+
+class Differ {
+	const uint32_t* a;
+	const uint32_t* b;
+	size_t costLimit;
+	std::vector<int64_t> forward;
+	std::vector<int64_t> backward;
+
+public:
+	std::vector<bool> deleted;  ///< Per element of a
+	std::vector<bool> inserted; ///< Per element of b
+
+	Differ(const uint32_t* a, size_t n, const uint32_t* b, size_t m, size_t costLimit)
+		: a(a), b(b), costLimit(costLimit), deleted(n), inserted(m) {}
+
+	/// Finds a point on the shortest path through a[aLo, aHi) x b[bLo, bHi), both of which are non-empty
+	/// Searches from both ends at once until the paths overlap, returns the point as offsets from (aLo, bLo)
+	void bisect(size_t aLo, size_t aHi, size_t bLo, size_t bHi, int64_t& splitX, int64_t& splitY) {
+		const int64_t n = aHi - aLo;
+		const int64_t m = bHi - bLo;
+		const int64_t maxD = (n + m + 1) / 2;
+		const int64_t offset = maxD + 1;
+		const size_t length = 2 * maxD + 3;
+		forward.assign(length, -1);
+		backward.assign(length, -1);
+		forward[offset + 1] = 0;
+		backward[offset + 1] = 0;
+		const int64_t delta = n - m;
+		// If the difference is odd, the paths meet while extending the forward path, otherwise the backward one
+		const bool front = delta & 1;
+		int64_t kStart1 = 0, kEnd1 = 0, kStart2 = 0, kEnd2 = 0;
+		int64_t bestX = 0, bestY = 0;
+		for (int64_t d = 0; d < maxD; d++) {
+			if ((size_t)d > costLimit && bestX + bestY > 0) {
+				splitX = bestX;
+				splitY = bestY;
+				return;
+			}
+			for (int64_t k = -d + kStart1; k <= d - kEnd1; k += 2) {
+				int64_t x = k == -d || (k != d && forward[offset + k - 1] < forward[offset + k + 1]) ? forward[offset + k + 1] : forward[offset + k - 1] + 1;
+				int64_t y = x - k;
+				while (x < n && y < m && a[aLo + x] == b[bLo + y]) {
+					x++;
+					y++;
+				}
+				forward[offset + k] = x;
+				if (x > n) {
+					kEnd1 += 2;
+				} else if (y > m) {
+					kStart1 += 2;
+				} else {
+					if (x + y > bestX + bestY) {
+						bestX = x;
+						bestY = y;
+					}
+					if (front) {
+						int64_t k2 = offset + delta - k;
+						if (k2 >= 0 && (size_t)k2 < length && backward[k2] != -1 && x >= n - backward[k2]) {
+							splitX = x;
+							splitY = y;
+							return;
+						}
+					}
+				}
+			}
+			for (int64_t k = -d + kStart2; k <= d - kEnd2; k += 2) {
+				int64_t x = k == -d || (k != d && backward[offset + k - 1] < backward[offset + k + 1]) ? backward[offset + k + 1] : backward[offset + k - 1] + 1;
+				int64_t y = x - k;
+				while (x < n && y < m && a[aHi - x - 1] == b[bHi - y - 1]) {
+					x++;
+					y++;
+				}
+				backward[offset + k] = x;
+				if (x > n) {
+					kEnd2 += 2;
+				} else if (y > m) {
+					kStart2 += 2;
+				} else if (!front) {
+					int64_t k1 = offset + delta - k;
+					if (k1 >= 0 && (size_t)k1 < length && forward[k1] != -1) {
+						int64_t x1 = forward[k1];
+						int64_t y1 = offset + x1 - k1;
+						if (x1 >= n - x) {
+							splitX = x1;
+							splitY = y1;
+							return;
+						}
+					}
+				}
+			}
+		}
+		// Nothing in common
+		splitX = n;
+		splitY = 0;
+	}
+
+	void compare(size_t aLo, size_t aHi, size_t bLo, size_t bHi) {
+		while (aLo < aHi && bLo < bHi && a[aLo] == b[bLo]) {
+			aLo++;
+			bLo++;
+		}
+		while (aLo < aHi && bLo < bHi && a[aHi - 1] == b[bHi - 1]) {
+			aHi--;
+			bHi--;
+		}
+		if (aLo == aHi) {
+			std::fill(inserted.begin() + bLo, inserted.begin() + bHi, true);
+			return;
+		}
+		if (bLo == bHi) {
+			std::fill(deleted.begin() + aLo, deleted.begin() + aHi, true);
+			return;
+		}
+		int64_t x, y;
+		bisect(aLo, aHi, bLo, bHi, x, y);
+		compare(aLo, aLo + x, bLo, bLo + y);
+		compare(aLo + x, aHi, bLo + y, bHi);
+	}
+};
+
+} // namespace
+
+std::vector<DiffOp> diffSequences(const uint32_t* a, size_t n, const uint32_t* b, size_t m, size_t costLimit) {
+	Differ differ(a, n, b, m, costLimit);
+	differ.compare(0, n, 0, m);
+	std::vector<DiffOp> ops;
+	ops.reserve(std::max(n, m));
+	size_t i = 0, j = 0;
+	while (i < n || j < m) {
+		if (i < n && differ.deleted[i]) {
+			ops.push_back(DiffOp::Delete);
+			i++;
+		} else if (j < m && differ.inserted[j]) {
+			ops.push_back(DiffOp::Insert);
+			j++;
+		} else {
+			ops.push_back(DiffOp::Equal);
+			i++;
+			j++;
+		}
+	}
+	return ops;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+// Aligns two instruction sequences for -diff-input, -diff-O and -diff-gpu
+// Uses Myers' O(ND) algorithm in its linear space form, on instructions interned to integers so comparisons are cheap
+// Only uses the standard library
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+enum class DiffOp : uint8_t {
+	Equal,  ///< Consumes one element of each sequence
+	Delete, ///< Consumes one element of a
+	Insert, ///< Consumes one element of b
+};
+
+/// A shortest edit script turning a into b, deletions before insertions within a changed span
+/// Once a span needs more than costLimit edits it settles for a good split instead of the best one (like GNU diff does),
+/// so very different sequences stay fast at the cost of a slightly longer script
+std::vector<DiffOp> diffSequences(const uint32_t* a, size_t n, const uint32_t* b, size_t m, size_t costLimit = 256);
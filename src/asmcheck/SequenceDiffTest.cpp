@@ -0,0 +1,127 @@
+// Checks diffSequences against a quadratic LCS, on random sequences and with a costLimit low enough to cut the search short
+// Doesn't need Apple's libLLVM, so it also builds and runs on Linux, `make check-std` runs it
+
+#include "SequenceDiff.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+static uint64_t state = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t next() {
+	state ^= state << 13;
+	state ^= state >> 7;
+	state ^= state << 17;
+	return state;
+}
+
+static std::vector<uint32_t> randomSequence(size_t maxLength, uint32_t distinct) {
+	std::vector<uint32_t> seq(next() % (maxLength + 1));
+	for (uint32_t& element : seq) {
+		element = next() % distinct;
+	}
+	return seq;
+}
+
+static size_t lcsLength(const std::vector<uint32_t>& a, const std::vector<uint32_t>& b) {
+	std::vector<size_t> prev(b.size() + 1), cur(b.size() + 1);
+	for (size_t i = 1; i <= a.size(); i++) {
+		for (size_t j = 1; j <= b.size(); j++) {
+			cur[j] = a[i - 1] == b[j - 1] ? prev[j - 1] + 1 : std::max(prev[j], cur[j - 1]);
+		}
+		std::swap(prev, cur);
+	}
+	return prev[b.size()];
+}
+
+/// Checks ops turns a into b and keeps deletions before insertions, returns the number of edits or -1 if it's invalid
+static long checkScript(const std::vector<DiffOp>& ops, const std::vector<uint32_t>& a, const std::vector<uint32_t>& b) {
+	size_t i = 0, j = 0;
+	long edits = 0;
+	bool inserting = false;
+	for (DiffOp op : ops) {
+		if (op == DiffOp::Equal) {
+			if (i >= a.size() || j >= b.size() || a[i] != b[j]) {
+				return -1;
+			}
+			i++;
+			j++;
+			inserting = false;
+		} else if (op == DiffOp::Delete) {
+			if (i >= a.size() || inserting) {
+				return -1;
+			}
+			i++;
+			edits++;
+		} else {
+			if (j >= b.size()) {
+				return -1;
+			}
+			j++;
+			edits++;
+			inserting = true;
+		}
+	}
+	return i == a.size() && j == b.size() ? edits : -1;
+}
+
+static void printSequence(const char* name, const std::vector<uint32_t>& seq) {
+	printf("%s:", name);
+	for (uint32_t element : seq) {
+		printf(" %u", element);
+	}
+	printf("\n");
+}
+
+int main() {
+	int failures = 0;
+	auto check = [&](const std::vector<uint32_t>& a, const std::vector<uint32_t>& b, size_t costLimit, bool shortest) {
+		std::vector<DiffOp> ops = diffSequences(a.data(), a.size(), b.data(), b.size(), costLimit);
+		long edits = checkScript(ops, a, b);
+		long best = (long)(a.size() + b.size() - 2 * lcsLength(a, b));
+		if (edits < 0 || (shortest && edits != best)) {
+			if (failures++ < 10) {
+				printf("FAIL: costLimit %zu gave %s (%ld edits, shortest is %ld)\n", costLimit, edits < 0 ? "an invalid script" : "a longer script", edits, best);
+				printSequence("a", a);
+				printSequence("b", b);
+			}
+		}
+	};
+
+	// Small alphabets give lots of equal runs and ties between paths, which is where the overlap checks matter
+	for (int iter = 0; iter < 20000; iter++) {
+		uint32_t distinct = 1 + next() % 8;
+		check(randomSequence(40, distinct), randomSequence(40, distinct), SIZE_MAX, true);
+	}
+
+	// b as a few edits of a, the usual shape of a -diff-O or -diff-gpu function
+	for (int iter = 0; iter < 2000; iter++) {
+		std::vector<uint32_t> a = randomSequence(300, 50);
+		std::vector<uint32_t> b = a;
+		for (size_t edits = next() % 10; edits && !b.empty(); edits--) {
+			size_t pos = next() % b.size();
+			switch (next() % 3) {
+				case 0: b.erase(b.begin() + pos); break;
+				case 1: b.insert(b.begin() + pos, next() % 50); break;
+				default: b[pos] = next() % 50; break;
+			}
+		}
+		check(a, b, SIZE_MAX, true);
+	}
+
+	// Past costLimit the split isn't the best one any more, but the script still has to turn a into b
+	for (int iter = 0; iter < 2000; iter++) {
+		uint32_t distinct = 1 + next() % 20;
+		check(randomSequence(200, distinct), randomSequence(200, distinct), next() % 4, false);
+	}
+	check(randomSequence(5000, 1000), randomSequence(5000, 1000), 8, false);
+
+	if (failures) {
+		printf("%d failures\n", failures);
+		return 1;
+	}
+	printf("PASS: diffSequences matches the LCS\n");
+	return 0;
+}
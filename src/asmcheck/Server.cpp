@@ -0,0 +1,217 @@
+#include "Server.h"
+
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <iterator>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/// Anything bigger than this is assumed to be a client speaking the wrong protocol
+static constexpr uint32_t MaxFrameSize = 1u << 30;
+
+static bool readAll(int fd, char* data, size_t size) {
+	while (size) {
+		ssize_t n = read(fd, data, size);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return false;
+		}
+		data += n;
+		size -= n;
+	}
+	return true;
+}
+
+static bool writeAll(int fd, const char* data, size_t size) {
+	while (size) {
+		ssize_t n = write(fd, data, size);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return false;
+		}
+		data += n;
+		size -= n;
+	}
+	return true;
+}
+
+static void putU32(std::string& out, uint32_t value) {
+	char bytes[4] = {char(value), char(value >> 8), char(value >> 16), char(value >> 24)};
+	out.append(bytes, 4);
+}
+
+static uint32_t getU32(const char* data) {
+	const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+	return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | (uint32_t(bytes[3]) << 24);
+}
+
+bool readFrame(int fd, std::string& payload) {
+	char header[4];
+	if (!readAll(fd, header, sizeof(header))) {
+		return false;
+	}
+	uint32_t size = getU32(header);
+	if (size > MaxFrameSize) {
+		return false;
+	}
+	payload.resize(size);
+	return readAll(fd, &payload[0], size);
+}
+
+bool writeFrame(int fd, const std::string& payload) {
+	std::string header;
+	putU32(header, (uint32_t)payload.size());
+	return writeAll(fd, header.data(), header.size()) && writeAll(fd, payload.data(), payload.size());
+}
+
+std::string encodeRequest(const ServerRequest& request) {
+	std::string payload;
+	putU32(payload, (uint32_t)request.args.size() + 1);
+	payload.append(request.workingDirectory.c_str(), request.workingDirectory.size() + 1);
+	for (const std::string& arg : request.args) {
+		payload.append(arg.c_str(), arg.size() + 1);
+	}
+	payload += request.input;
+	return payload;
+}
+
+bool decodeRequest(const std::string& payload, ServerRequest& request) {
+	if (payload.size() < 4) {
+		return false;
+	}
+	uint32_t count = getU32(payload.data());
+	size_t pos = 4;
+	std::vector<std::string> strings;
+	for (uint32_t i = 0; i < count; i++) {
+		size_t end = payload.find('\0', pos);
+		if (end == std::string::npos) {
+			return false;
+		}
+		strings.emplace_back(payload, pos, end - pos);
+		pos = end + 1;
+	}
+	if (strings.empty()) {
+		return false;
+	}
+	request.workingDirectory = std::move(strings[0]);
+	request.args.assign(std::make_move_iterator(strings.begin() + 1), std::make_move_iterator(strings.end()));
+	request.input = payload.substr(pos);
+	return true;
+}
+
+std::string encodeResponse(const ServerResponse& response) {
+	std::string payload;
+	putU32(payload, response.status);
+	putU32(payload, (uint32_t)response.output.size());
+	payload += response.output;
+	payload += response.errors;
+	return payload;
+}
+
+bool decodeResponse(const std::string& payload, ServerResponse& response) {
+	if (payload.size() < 8) {
+		return false;
+	}
+	response.status = getU32(payload.data());
+	uint32_t outputSize = getU32(payload.data() + 4);
+	if (outputSize > payload.size() - 8) {
+		return false;
+	}
+	response.output = payload.substr(8, outputSize);
+	response.errors = payload.substr(8 + outputSize);
+	return true;
+}
+
+void serveStream(int in, int out, const RequestHandler& handler) {
+	std::string payload;
+	while (readFrame(in, payload)) {
+		ServerRequest request;
+		ServerResponse response;
+		if (decodeRequest(payload, request)) {
+			response = handler(request);
+		} else {
+			response.status = 1;
+			response.errors = "malformed request\n";
+		}
+		if (!writeFrame(out, encodeResponse(response))) {
+			return;
+		}
+	}
+}
+
+static bool makeAddress(const std::string& path, sockaddr_un& addr, std::string& error) {
+	memset(&addr, 0, sizeof(addr));
+	if (path.size() >= sizeof(addr.sun_path)) {
+		error = path + ": socket path is too long";
+		return false;
+	}
+	addr.sun_family = AF_UNIX;
+	memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+	return true;
+}
+
+bool serveSocket(const std::string& path, const RequestHandler& handler, std::string& error) {
+	sockaddr_un addr;
+	if (!makeAddress(path, addr, error)) {
+		return false;
+	}
+	// A socket left behind by a server that was killed would make bind fail, but don't take over from one that's still running
+	struct stat st;
+	if (lstat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+		std::string ignored;
+		int existing = connectSocket(path, ignored);
+		if (existing >= 0) {
+			close(existing);
+			error = path + ": another server is already listening here";
+			return false;
+		}
+		unlink(path.c_str());
+	}
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || listen(fd, 64) < 0) {
+		error = path + ": " + strerror(errno);
+		if (fd >= 0) {
+			close(fd);
+		}
+		return false;
+	}
+	// A client going away mid response shouldn't take the server down with it
+	signal(SIGPIPE, SIG_IGN);
+	while (true) {
+		int conn = accept(fd, nullptr, nullptr);
+		if (conn < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			error = path + ": " + strerror(errno);
+			close(fd);
+			return false;
+		}
+		serveStream(conn, conn, handler);
+		close(conn);
+	}
+}
+
+int connectSocket(const std::string& path, std::string& error) {
+	sockaddr_un addr;
+	if (!makeAddress(path, addr, error)) {
+		return -1;
+	}
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+		error = path + ": " + strerror(errno);
+		if (fd >= 0) {
+			close(fd);
+		}
+		return -1;
+	}
+	return fd;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+// Framing for mtl-gpu-asmcheck -serve, only uses the standard library and POSIX so the client builds without Apple's libLLVM
+//
+// Every message is a 4 byte little endian length followed by that many bytes of payload
+// Request payload:  4 byte string count, then the working directory and each argument, NUL terminated, then the contents of the "-" input
+// Response payload: 4 byte exit status, 4 byte output length, the output, then the error output
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+/// A request is handled like running the tool with `args` from `workingDirectory`
+struct ServerRequest {
+	std::string workingDirectory;
+	std::vector<std::string> args;
+	std::string input; ///< What the request sees when it reads "-"
+};
+
+struct ServerResponse {
+	uint32_t status = 0;
+	std::string output;
+	std::string errors;
+};
+
+using RequestHandler = std::function<ServerResponse(const ServerRequest& request)>;
+
+bool readFrame(int fd, std::string& payload);
+bool writeFrame(int fd, const std::string& payload);
+
+std::string encodeRequest(const ServerRequest& request);
+bool decodeRequest(const std::string& payload, ServerRequest& request);
+std::string encodeResponse(const ServerResponse& response);
+bool decodeResponse(const std::string& payload, ServerResponse& response);
+
+/// Answers requests read from `in` on `out` until `in` is closed
+void serveStream(int in, int out, const RequestHandler& handler);
+
+/// Listens on a Unix domain socket at `path` and answers its connections one at a time
+/// Only returns on error
+bool serveSocket(const std::string& path, const RequestHandler& handler, std::string& error);
+
+/// Connects to a socket made by serveSocket, returning -1 on failure
+int connectSocket(const std::string& path, std::string& error);
@@ -0,0 +1,181 @@
+#include "TargetInfo.h"
+#include "TargetInfoFile.h"
+
+#include "llvm/Support/Format.h"
+
+#include <cstring>
+#include <string>
+#include <vector>
+
+using namespace llvm;
+
+namespace {
+
+class StringTable {
+	std::string data;
+public:
+	uint32_t add(StringRef str) {
+		uint32_t offset = (uint32_t)data.size();
+		data.append(str.data(), str.size());
+		data.push_back('\0');
+		return offset;
+	}
+	const std::string& contents() const { return data; }
+};
+
+/// Appends count registers to lists, returning the index of the first
+uint32_t addRegisterList(std::vector<uint16_t>& lists, const MCPhysReg* regs, unsigned count) {
+	uint32_t index = (uint32_t)lists.size();
+	lists.insert(lists.end(), regs, regs + count);
+	return index;
+}
+
+template <typename T>
+void writeTable(raw_ostream& os, const std::vector<T>& table) {
+	os.write(reinterpret_cast<const char*>(table.data()), table.size() * sizeof(T));
+}
+
+void padTo8(raw_ostream& os) {
+	static const char zeros[8] = {};
+	os.write(zeros, -os.tell() & 7);
+}
+
+const char* operandTypeName(uint8_t type) {
+	switch (type) {
+		case MCOI::OPERAND_UNKNOWN:   return "unknown";
+		case MCOI::OPERAND_IMMEDIATE: return "imm";
+		case MCOI::OPERAND_REGISTER:  return "reg";
+		case MCOI::OPERAND_MEMORY:    return "mem";
+		case MCOI::OPERAND_PCREL:     return "pcrel";
+		default:                      return type >= MCOI::OPERAND_FIRST_TARGET ? "target" : "generic";
+	}
+}
+
+} // namespace
+
+void writeTargetInfo(raw_ostream& os, const MCInstrInfo& ii, const MCRegisterInfo& mri) {
+	StringTable strings;
+	std::vector<TargetInfoOpcode> opcodes;
+	std::vector<TargetInfoOperand> operands;
+	std::vector<TargetInfoRegister> registers;
+	std::vector<TargetInfoRegisterClass> classes;
+	std::vector<uint16_t> lists;
+
+	for (unsigned opcode = 0; opcode < ii.getNumOpcodes(); opcode++) {
+		const MCInstrDesc& desc = ii.get(opcode);
+		TargetInfoOpcode entry = {};
+		entry.name = strings.add(ii.getName(opcode));
+		entry.firstOperand = (uint32_t)operands.size();
+		entry.flags = desc.Flags;
+		entry.tsFlags = desc.TSFlags;
+		entry.numImplicitUses = desc.getNumImplicitUses();
+		entry.numImplicitDefs = desc.getNumImplicitDefs();
+		entry.implicitUses = addRegisterList(lists, desc.getImplicitUses(), entry.numImplicitUses);
+		entry.implicitDefs = addRegisterList(lists, desc.getImplicitDefs(), entry.numImplicitDefs);
+		entry.numOperands = desc.getNumOperands();
+		entry.schedClass = desc.getSchedClass();
+		entry.numDefs = desc.getNumDefs();
+		entry.size = desc.getSize();
+		for (const MCOperandInfo& info : desc.operands()) {
+			operands.push_back({info.RegClass, info.Flags, info.OperandType, info.Constraints});
+		}
+		opcodes.push_back(entry);
+	}
+
+	for (unsigned reg = 0; reg < mri.getNumRegs(); reg++) {
+		registers.push_back({strings.add(mri.getName(reg))});
+	}
+
+	for (const MCRegisterClass& rc : mri.regclasses()) {
+		TargetInfoRegisterClass entry = {};
+		entry.name = strings.add(mri.getRegClassName(&rc));
+		entry.members = addRegisterList(lists, rc.begin(), rc.getNumRegs());
+		entry.numMembers = rc.getNumRegs();
+		entry.physRegSize = rc.getPhysRegSize();
+		entry.copyCost = rc.getCopyCost();
+		entry.allocatable = rc.isAllocatable();
+		classes.push_back(entry);
+	}
+
+	// Tables go in header order, each starting 8 byte aligned
+	TargetInfoHeader header = {};
+	memcpy(header.magic, TargetInfoMagic, sizeof(header.magic));
+	header.version = TargetInfoVersion;
+	header.headerSize = sizeof(header);
+	uint32_t offset = sizeof(header);
+	auto place = [&](TargetInfoTable& table, size_t count, size_t entrySize) {
+		table.offset = offset;
+		table.count = (uint32_t)count;
+		offset = (offset + count * entrySize + 7) & ~7u;
+	};
+	place(header.opcodes, opcodes.size(), sizeof(TargetInfoOpcode));
+	place(header.operands, operands.size(), sizeof(TargetInfoOperand));
+	place(header.registers, registers.size(), sizeof(TargetInfoRegister));
+	place(header.registerClasses, classes.size(), sizeof(TargetInfoRegisterClass));
+	place(header.registerLists, lists.size(), sizeof(uint16_t));
+	place(header.strings, strings.contents().size(), 1);
+
+	uint64_t start = os.tell();
+	os.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	writeTable(os, opcodes);
+	padTo8(os);
+	writeTable(os, operands);
+	padTo8(os);
+	writeTable(os, registers);
+	padTo8(os);
+	writeTable(os, classes);
+	padTo8(os);
+	writeTable(os, lists);
+	padTo8(os);
+	os << strings.contents();
+	padTo8(os);
+	assert(os.tell() - start == offset && "Table offsets in the header don't match what was written");
+	(void)start;
+}
+
+static void writeRegisterList(raw_ostream& os, const MCRegisterInfo& mri, const MCPhysReg* regs, unsigned count) {
+	for (unsigned i = 0; i < count; i++) {
+		os << (i ? " " : "") << mri.getName(regs[i]);
+	}
+}
+
+void writeOpcodeCSV(raw_ostream& os, const MCInstrInfo& ii, const MCRegisterInfo& mri) {
+	// Names and fields never contain commas or quotes, so nothing needs quoting
+	os << "opcode,name,size,defs,operands,flags,ts_flags,sched_class,implicit_uses,implicit_defs,operand_info\n";
+	for (unsigned opcode = 0; opcode < ii.getNumOpcodes(); opcode++) {
+		const MCInstrDesc& desc = ii.get(opcode);
+		os << opcode << "," << ii.getName(opcode) << "," << desc.getSize() << "," << desc.getNumDefs() << "," << desc.getNumOperands() << ",";
+		os << format_hex(desc.Flags, 18) << "," << format_hex(desc.TSFlags, 18) << "," << desc.getSchedClass() << ",";
+		writeRegisterList(os, mri, desc.getImplicitUses(), desc.getNumImplicitUses());
+		os << ",";
+		writeRegisterList(os, mri, desc.getImplicitDefs(), desc.getNumImplicitDefs());
+		os << ",";
+		for (unsigned i = 0; i < desc.getNumOperands(); i++) {
+			const MCOperandInfo& info = desc.OpInfo[i];
+			os << (i ? " " : "") << operandTypeName(info.OperandType);
+			if (info.RegClass >= 0 && (unsigned)info.RegClass < mri.getNumRegClasses() && !info.isLookupPtrRegClass()) {
+				os << ":" << mri.getRegClassName(&mri.getRegClass(info.RegClass));
+			}
+			int tied = desc.getOperandConstraint(i, MCOI::TIED_TO);
+			if (tied >= 0) {
+				os << ":tied" << tied;
+			}
+		}
+		os << "\n";
+	}
+}
+
+void writeRegisterCSV(raw_ostream& os, const MCRegisterInfo& mri) {
+	os << "register,name,classes\n";
+	for (unsigned reg = 0; reg < mri.getNumRegs(); reg++) {
+		os << reg << "," << mri.getName(reg) << ",";
+		const char* delim = "";
+		for (const MCRegisterClass& rc : mri.regclasses()) {
+			if (rc.contains(reg)) {
+				os << delim << mri.getRegClassName(&rc);
+				delim = " ";
+			}
+		}
+		os << "\n";
+	}
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+// Writes every opcode's MCInstrDesc and every register and register class for -export-target-info
+// The binary layout is in TargetInfoFile.h
+
+#include "llvm/MC/MCInstrInfo.h"
+#include "llvm/MC/MCRegisterInfo.h"
+#include "llvm/Support/raw_ostream.h"
+
+/// The indexed binary file described by TargetInfoFile.h
+void writeTargetInfo(llvm::raw_ostream& os, const llvm::MCInstrInfo& ii, const llvm::MCRegisterInfo& mri);
+
+/// One row per opcode, operands are listed as `type:class` separated by spaces
+void writeOpcodeCSV(llvm::raw_ostream& os, const llvm::MCInstrInfo& ii, const llvm::MCRegisterInfo& mri);
+
+/// One row per register, with the register classes it's a member of
+void writeRegisterCSV(llvm::raw_ostream& os, const llvm::MCRegisterInfo& mri);
@@ -0,0 +1,76 @@
+#pragma once
+
+// Layout of the file written by -export-target-info, a dump of the AGX2 MCInstrInfo and MCRegisterInfo tables
+// Only uses the standard library so offline tools can answer opcode and register questions without Apple's libLLVM
+//
+// The file is a TargetInfoHeader followed by the tables it points at, all little endian
+// Every table is an array of fixed size entries, so the file can be mmapped and indexed by opcode, register or class number
+// Names are offsets into the string table, which is NUL terminated strings back to back
+
+#include <cstddef>
+#include <cstdint>
+
+constexpr char TargetInfoMagic[8] = {'A', 'G', 'X', 'T', 'I', 'N', 'F', 'O'};
+constexpr uint32_t TargetInfoVersion = 1;
+
+/// Where a table starts (from the beginning of the file) and how many entries it has
+struct TargetInfoTable {
+	uint32_t offset;
+	uint32_t count;
+};
+
+struct TargetInfoHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t headerSize;
+	TargetInfoTable opcodes;         ///< TargetInfoOpcode, indexed by opcode
+	TargetInfoTable operands;        ///< TargetInfoOperand, each opcode's operands are a run starting at firstOperand
+	TargetInfoTable registers;       ///< TargetInfoRegister, indexed by register number
+	TargetInfoTable registerClasses; ///< TargetInfoRegisterClass, indexed by class ID
+	TargetInfoTable registerLists;   ///< uint16_t register numbers, for implicit uses/defs and class members
+	TargetInfoTable strings;         ///< chars
+};
+
+struct TargetInfoOpcode {
+	uint32_t name;
+	uint32_t firstOperand;
+	uint64_t flags;   ///< MCInstrDesc::Flags, bits are llvm::MCID::Flag
+	uint64_t tsFlags; ///< MCInstrDesc::TSFlags
+	uint32_t implicitUses; ///< Index into registerLists
+	uint32_t implicitDefs; ///< Index into registerLists
+	uint16_t numOperands;
+	uint16_t numImplicitUses;
+	uint16_t numImplicitDefs;
+	uint16_t schedClass;
+	uint8_t numDefs;
+	uint8_t size;
+	uint16_t reserved;
+	uint32_t reserved2;
+};
+
+struct TargetInfoOperand {
+	int16_t registerClass; ///< -1 if the operand isn't a register
+	uint8_t flags;         ///< llvm::MCOI::OperandFlags bits
+	uint8_t operandType;   ///< llvm::MCOI::OperandType
+	uint32_t constraints;  ///< MCOperandInfo::Constraints, e.g. tied operands
+};
+
+struct TargetInfoRegister {
+	uint32_t name;
+};
+
+struct TargetInfoRegisterClass {
+	uint32_t name;
+	uint32_t members; ///< Index into registerLists
+	uint16_t numMembers;
+	uint16_t physRegSize;
+	int8_t copyCost;
+	uint8_t allocatable;
+	uint16_t reserved;
+};
+
+static_assert(sizeof(TargetInfoHeader) == 64, "Target info header layout is part of the file format");
+static_assert(sizeof(TargetInfoOpcode) == 48, "Target info opcode layout is part of the file format");
+static_assert(sizeof(TargetInfoOperand) == 8, "Target info operand layout is part of the file format");
+static_assert(sizeof(TargetInfoRegister) == 4, "Target info register layout is part of the file format");
+static_assert(sizeof(TargetInfoRegisterClass) == 16, "Target info register class layout is part of the file format");
@@ -1,8 +1,12 @@
+#include "llvm/ADT/Statistic.h"
 #include "llvm/ADT/Triple.h"
 //#include "llvm/CodeGen/CommandFlags.inc"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
 #include "llvm/CodeGen/Passes.h"
 #include "llvm/InitializePasses.h"
 #include "llvm/IR/Function.h"
+#include "llvm/IR/Mangler.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/Module.h"
@@ -11,8 +15,18 @@
 #include "llvm/MC/MCContext.h"
 #include "llvm/MC/MCExpr.h"
 #include "llvm/MC/MCInstrInfo.h"
+#include "llvm/MC/MCSchedule.h"
+#include "llvm/MC/MCSubtargetInfo.h"
+#include "llvm/MC/MCSymbol.h"
 #include "llvm/Pass.h"
+#include "llvm/Support/FileSystem.h"
 #include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/LineIterator.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Program.h"
+#include "llvm/Support/Signals.h"
 #include "llvm/Support/SourceMgr.h"
 #include "llvm/Support/TargetRegistry.h"
 #include "llvm/Support/TargetSelect.h"
@@ -20,12 +34,55 @@
 #include "llvm/Support/ToolOutputFile.h"
 #include "llvm/Target/TargetMachine.h"
 #include "llvm/Target/TargetOptions.h"
-
-
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/SplitModule.h"
+
+#include "common/CompileCache.h"
+#include "common/Instrumentation.h"
+#include "common/WorkerPool.h"
+
+#include "CostEstimate.h"
+#include "EncodingCache.h"
+#include "EncodingRecord.h"
+#include "FieldInference.h"
+#include "FPImmTable.h"
+#include "InstFormatter.h"
+#include "InstStats.h"
+#include "Recording.h"
+#include "RegisterFootprint.h"
+#include "TargetInfo.h"
+#include "SequenceDiff.h"
+#include "Server.h"
+
+#include <dlfcn.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <random>
+#include <unordered_set>
 #include <utility>
+#include <vector>
 
 using namespace llvm;
 
+#define DEBUG_TYPE "asmcheck"
+
+STATISTIC(NumModules, "Modules compiled");
+STATISTIC(NumCompileCacheHits, "Modules loaded from -cache-dir");
+STATISTIC(NumInstsEncoded, "Instructions encoded");
+STATISTIC(NumBytesEncoded, "Bytes of instruction encodings");
+STATISTIC(NumEncodingCacheHits, "Encodings loaded from -encoding-cache");
+STATISTIC(NumTwiddled, "Twiddled instructions encoded");
+STATISTIC(NumBytesWritten, "Bytes of object files produced");
+
 class PassPrinter : public PassRegistrationListener {
 	void passEnumerate(const PassInfo *Info) override {
 		auto cur = outs().tell();
@@ -35,9 +92,30 @@ class PassPrinter : public PassRegistrationListener {
 	}
 };
 
-static cl::opt<std::string> InputFilename(cl::Positional, cl::desc("<input bitcode>"), cl::init("-"));
+static cl::list<std::string> InputFilenames(cl::Positional, cl::ZeroOrMore,
+	cl::desc("<input bitcode>... (directories are searched for .ll and .bc files, @file reads arguments from a response file)"));
+
+static cl::opt<std::string> InputList("input-list",
+	cl::desc("Read additional input filenames from a file, one per line (lines starting with # are ignored)"),
+	cl::value_desc("filename"),
+	cl::init(""));
+
+static cl::opt<unsigned> Jobs("j",
+	cl::desc("Number of inputs to compile in parallel (0 = one per core).  Output is still printed in input order"),
+	cl::Prefix,
+	cl::init(1));
+
+static cl::list<std::string> Functions("functions",
+	cl::desc("Only compile these functions and the functions they call.  Other bodies are dropped before codegen, and for bitcode inputs never loaded"),
+	cl::CommaSeparated,
+	cl::value_desc("name,..."));
 
-static cl::opt<std::string> OutputFilename("o", cl::desc("Output filename"), cl::value_desc("filename"));
+static cl::opt<unsigned> SplitModuleParts("split-module",
+	cl::desc("Split each input into this many partitions by function and compile them in parallel, each with its own context and target machine.  Output is put back in the input's function order.  Partitions are compiled on -j threads, or one per core if -j isn't given"),
+	cl::init(0));
+
+static cl::opt<std::string> OutputFilename("o", cl::desc("Output filename"), cl::value_desc("filename"),
+	cl::init(""));
 
 static cl::opt<char> OptLevel("O",
 	cl::desc("Optimization level. [-O0, -O1, -O2, or -O3] (default = '-O2')"),
@@ -46,21 +124,162 @@ static cl::opt<char> OptLevel("O",
 	cl::init(' '));
 
 static cl::opt<bool> PrintSchedulingInfo("print-scheduling-info",
-	cl::desc("Prints LLVM scheduling info (do not use if you plan to contribute to Asahi Linux)"));
+	cl::desc("Prints LLVM scheduling info (do not use if you plan to contribute to Asahi Linux)"),
+	cl::init(false));
+
+static cl::opt<std::string> DiffInput("diff-input",
+	cl::desc("Also compile this file and print how each function's instructions differ from the input's: inserted, removed and re-encoded instructions and the change in size"),
+	cl::value_desc("filename"),
+	cl::init(""));
+
+static cl::opt<char> DiffOptLevel("diff-O",
+	cl::desc("Print how each function's instructions differ when the input is compiled at this -O level instead"),
+	cl::Prefix,
+	cl::init('\0'));
+
+static cl::opt<std::string> DiffGPU("diff-gpu",
+	cl::desc("Print how each function's instructions differ when the input is compiled for this GPU instead"),
+	cl::value_desc("gpu"),
+	cl::init(""));
 
 static cl::opt<bool> NoRegNames("no-register-names",
-	cl::desc("Prints register numbers instead of names (useful for twiddle input)"));
+	cl::desc("Prints register numbers instead of names (useful for twiddle input)"),
+	cl::init(false));
 
 static cl::opt<std::string> Twiddle("twiddle",
-	cl::desc("Mess with an instruction to see the possible encodings (format: \"opcode,operandidx,low,high\", if any instructions with opcode are seen, show encoding with the operandidx-th operand set to each value between low and high)\nReminder: Just because the assembler emits it doesn't mean it's valid, the assembler assumes valid output from the stages before it"));
+	cl::desc("Mess with an instruction to see the possible encodings (format: \"opcode,operandidx,low,high[,operandidx,low,high...]\", if any instructions with opcode are seen, show encoding with the operandidx-th operand set to each value between low and high, for every combination of the given operands' values)\nReminder: Just because the assembler emits it doesn't mean it's valid, the assembler assumes valid output from the stages before it"),
+	cl::init(""));
+
+static cl::opt<unsigned> TwiddleStride("twiddle-stride",
+	cl::desc("Only try every Nth value of each -twiddle range"),
+	cl::init(1));
+
+static cl::opt<unsigned> TwiddleSampleCount("twiddle-sample",
+	cl::desc("If the -twiddle ranges have more combinations than this, only encode this many randomly chosen ones (0 = encode all, the choice is the same every run)"),
+	cl::init(0));
+
+static cl::opt<unsigned> TwiddleThreads("twiddle-threads",
+	cl::desc("Number of threads to encode -twiddle combinations on (0 = one per core)"),
+	cl::init(1));
+
+static cl::opt<bool> TwiddleInfer("twiddle-infer",
+	cl::desc("After each -twiddle sweep, work out which encoding bits each swept operand controls and print them as a JSON field table"),
+	cl::init(false));
+
+static cl::opt<std::string> FPImmTableOpt("fp-imm-table",
+	cl::desc("Find out which floating point constants an instruction can hold inline (format: \"opcode,operandidx\", the first instruction with opcode in each module is encoded with the operand set to every half and a subset of float bit patterns, then the results are printed as ranges of inline, wide, shared and fixup encodings)"),
+	cl::init(""));
+
+static cl::opt<unsigned> FPImmFloatStride("fp-imm-float-stride",
+	cl::desc("Besides every half widened to float, -fp-imm-table tries every Nth float bit pattern (0 = only the widened halves)"),
+	cl::init(65536));
+
+static cl::opt<std::string> EncodingCachePath("encoding-cache",
+	cl::desc("Cache instruction encodings in this file, so reruns only encode instructions that haven't been seen before"),
+	cl::value_desc("filename"),
+	cl::init(""));
+
+static cl::opt<std::string> CacheDir("cache-dir",
+	cl::desc("Cache whole-module results (object and output) in this directory, keyed on the module contents, options and tool version"),
+	cl::value_desc("directory"),
+	cl::init(""));
+
+static cl::opt<std::string> CachePolicy("cache-policy",
+	cl::desc("Pruning policy for -cache-dir, e.g. \"cache_size_bytes=4g:prune_after=72h\""),
+	cl::init(""));
+
+static cl::opt<bool> TimeStartup("time-startup",
+	cl::desc("Print how long target initialization, option parsing, target machine creation and IR parsing took"),
+	cl::init(false));
+
+static cl::opt<std::string> Serve("serve",
+	cl::desc("Keep the target set up and answer requests on this Unix domain socket (or stdin/stdout for \"-\"), see src/asmcheck/Server.h"),
+	cl::value_desc("socket"),
+	cl::init(""));
+
+enum class EmitFormat { Text, JSONL, Binary };
+
+static cl::opt<EmitFormat> EmitFormatOpt("emit-format",
+	cl::desc("Format of the per-instruction output"),
+	cl::values(
+		clEnumValN(EmitFormat::Text, "text", "Human readable text (default)"),
+		clEnumValN(EmitFormat::JSONL, "jsonl", "One JSON object per input and per encoded instruction"),
+		clEnumValN(EmitFormat::Binary, "binary", "Fixed size records, layout is in src/asmcheck/EncodingRecord.h")),
+	cl::init(EmitFormat::Text));
+
+static cl::opt<std::string> RecordPath("record",
+	cl::desc("Write every instruction the encoder sees (operands, MCInstrDesc fields and encoding) to this file, for analysis with mtl-gpu-asmcheck-replay"),
+	cl::value_desc("filename"),
+	cl::init(""));
+
+static cl::opt<bool> EstimateCost("cost-estimate",
+	cl::desc("After each module, print a static estimate of each function's cost from the GPU's sched model: micro-ops, critical path latency and reciprocal throughput"),
+	cl::init(false));
+
+static cl::opt<bool> RegisterFootprintOpt("register-footprint",
+	cl::desc("After each module, print the registers each function used per register class (how many and the highest index), and a summary of the largest footprints at the end of the run"),
+	cl::init(false));
+
+static cl::opt<bool> Dedup("dedup",
+	cl::desc("Only print the first occurrence of each distinct instruction (opcode and operands) in a module, followed by how often each one was seen"),
+	cl::init(false));
+
+static cl::opt<std::string> ExportTargetInfo("export-target-info",
+	cl::desc("Instead of compiling, write every opcode's MCInstrDesc and every register and register class to <prefix>.bin (layout in src/asmcheck/TargetInfoFile.h), <prefix>-opcodes.csv and <prefix>-registers.csv"),
+	cl::value_desc("prefix"),
+	cl::init(""));
+
+enum class InstStatsFormat { JSON, CSV };
+
+static cl::opt<std::string> InstStatsPath("inst-stats",
+	cl::desc("Instead of printing each instruction, count instructions per opcode, sched class, encoded size, MCID flag, TSFlags value and operand kind across all inputs and write the tables to this file"),
+	cl::value_desc("filename"),
+	cl::init(""));
+
+static cl::opt<InstStatsFormat> InstStatsFormatOpt("inst-stats-format",
+	cl::desc("Format of the -inst-stats file"),
+	cl::values(
+		clEnumValN(InstStatsFormat::JSON, "json", "One JSON object with an array per table (default)"),
+		clEnumValN(InstStatsFormat::CSV, "csv", "One table,key,name,count,bytes row per entry")),
+	cl::init(InstStatsFormat::JSON));
+
+/// The processors in the AGX2 subtarget's table, which libLLVM doesn't expose, for -gpu=all and -help
+static const char* const KnownGPUs[] = {
+	"g10", "g10p-b0", "g11", "g11g-a0", "g11g-b0", "g11m-a0", "g11m-b0", "g11p-a0", "g11p-b0",
+	"g12", "g12g-a0", "g12m-a0", "g12p-a0", "g12p-b0", "g12x",
+	"g13", "g13-fullf32", "g13g-a0", "g13g-b0", "g13g-b0-nofullf32", "g13p-a0", "g13x", "g13x-a0",
+};
+
+static std::string describeGPUOption() {
+	std::string desc = "GPU to target, a comma separated list or \"all\" compiles each input for every listed GPU and lines up the encodings per function.  Available gpus include ";
+	for (size_t i = 0; i < std::size(KnownGPUs); i++) {
+		desc += i ? ", " : "";
+		desc += KnownGPUs[i];
+	}
+	return desc;
+}
+
+static const std::string GPUDescription = describeGPUOption();
 
 static cl::opt<std::string> GPU("gpu",
-	cl::desc("GPU to target, available gpus include g10, g10p-b0, g11, g11g-a0, g11g-b0, g11m-a0, g11m-b0, g11p-a0, g11p-b0, g12, g12g-a0, g12m-a0, g12p-a0, g12p-b0, g12x, g13, g13-fullf32, g13g-a0, g13g-b0, g13g-b0-nofullf32, g13p-a0, g13x, g13x-a0"),
+	cl::desc(GPUDescription),
 	cl::init("g13x"));
 
-static void initialize(PassRegistry& registry);
-static std::pair<const Target*, std::unique_ptr<TargetMachine>> getAGX2TargetMachine();
-static void compileModule(LLVMContext& ctx, const Target& target, TargetMachine& tm);
+static void initializeAGX2();
+static bool needsPassNames(ArrayRef<const char*> args);
+static void initializePassNames(PassRegistry& registry);
+static std::pair<const Target*, std::unique_ptr<TargetMachine>> getAGX2TargetMachine(StringRef gpu, char optLevel, raw_ostream& diag);
+static std::vector<std::string> selectedGPUs();
+static std::vector<std::string> collectInputs(raw_ostream& diag);
+static bool runInputs(raw_ostream& out, raw_ostream& diag);
+static bool runInputsAcrossGPUs(const std::vector<std::string>& inputs, const std::vector<std::string>& gpus, raw_ostream& out, raw_ostream& diag);
+static bool runDiff(const std::vector<std::string>& inputs, StringRef gpu, raw_ostream& out, raw_ostream& diag);
+static ServerResponse handleRequest(const ServerRequest& request);
+static std::string makeCommandFingerprint(ArrayRef<const char*> argv);
+static void compileModule(StringRef inputFilename, uint32_t inputIndex, TargetMachine& tm, raw_ostream& out, raw_ostream& diag, std::string* recording);
+static void compileSplitModule(StringRef inputFilename, uint32_t inputIndex, std::vector<std::unique_ptr<TargetMachine>>& machines, unsigned workers, raw_ostream& out, raw_ostream& diag);
+static void buildRegisterSlots(const MCRegisterInfo& mri);
+static void printRegisterFootprintSummary(raw_ostream& os, const MCRegisterInfo& mri);
 
 static const char* progName;
 
@@ -69,54 +288,636 @@ struct exit_exception : public std::exception {};
 Target::MCCodeEmitterCtorTy actualCodeEmitterConstructor;
 MCCodeEmitter *replacementCodeEmitterConstructor(const MCInstrInfo& II, const MCRegisterInfo& MRI, MCContext& Ctx);
 
-int64_t twiddleParams[4] = {-1};
-double twiddleFloat[4] = {0};
+/// What the code emitter needs to know about the compile it was created for
+struct EmitterContext {
+	raw_ostream& out;
+	uint32_t inputIndex;
+	/// If set, instructions are collected here (for -gpu lists) instead of printed
+	std::vector<struct CapturedInst>* capture = nullptr;
+	/// Mangled names of the module's defined functions in order, so captured instructions know which function they're from
+	const std::vector<std::string>* functionSymbols = nullptr;
+	/// If set, instructions are counted here (for -inst-stats) instead of printed
+	InstStats* stats = nullptr;
+	/// If set, only instructions not already in here are printed (for -dedup)
+	struct DedupTable* dedup = nullptr;
+	/// If set, every instruction is also written here (for -record)
+	RecordingWriter* recording = nullptr;
+	/// If set, every instruction's sched model cost is added here (for -cost-estimate), by function if functionSymbols is set
+	CostEstimator* cost = nullptr;
+	/// If set, every register operand is tracked here (for -register-footprint), by function if functionSymbols is set
+	RegisterFootprint* footprint = nullptr;
+	/// If set, the output offset where each function's instructions start is added here (for -split-module), needs functionSymbols
+	std::vector<std::pair<int, uint64_t>>* functionStarts = nullptr;
+	/// Where -twiddle and -fp-imm-table problems go when they can't be mixed into the output, errs() if not set
+	raw_ostream* diag = nullptr;
+};
+
+struct CapturedInst {
+	int function; ///< Index into EmitterContext::functionSymbols, -1 before the first function
+	std::string desc;
+	std::string bytes;
+};
+
+struct DedupShape {
+	uint64_t count;
+	std::string desc;
+	SmallVector<char, 16> bytes; ///< The first encoding, reused for repeats if it had no fixups
+	bool reusable;
+};
+
+/// Distinct instructions seen in one module, in the order they were first seen
+struct DedupTable {
+	std::unordered_map<std::string, size_t> index;
+	std::vector<DedupShape> shapes;
+	uint64_t total = 0;
+};
+
+/// Context for the emitters created by compiles running on this thread, so parallel compiles don't share outs()
+static thread_local const EmitterContext* emitterContext = nullptr;
+
+struct TwiddleRange {
+	unsigned operand;
+	int64_t low;
+	int64_t high;
+	double lowFloat;
+	double highFloat;
+};
+
+static std::unique_ptr<CompileCache> compileCache;
+static std::string toolIdentity;
+/// The command line's -cache-dir fingerprint, set by main or per -serve request
+static std::string commandFingerprint;
+
+/// -inst-stats totals, each compile counts into its own InstStats and merges it in here when done
+static std::unique_ptr<InstStats> runStats;
+static std::mutex runStatsLock;
+
+/// For -register-footprint, the class and index each register is tracked as, and the largest footprints so far
+static std::vector<RegisterSlot> registerSlots;
+static std::unique_ptr<RegisterFootprintSummary> runFootprint;
+static std::mutex runFootprintLock;
+
+static std::unique_ptr<EncodingCache> encodingCache;
+static uint64_t encodingCacheSeed;
+static uint64_t makeEncodingCacheSeed();
+
+static int64_t twiddleOpcode = -1;
+static std::vector<TwiddleRange> twiddleRanges;
+
+static void parseTwiddle(StringRef str, raw_ostream& diag);
+
+static int64_t fpImmTableOpcode = -1;
+static unsigned fpImmTableOperand = 0;
+
+static void parseFPImmTable(StringRef str, raw_ostream& diag);
+
+/// TargetMachines for every -gpu and -O used so far, so -serve requests don't have to recreate them
+static std::map<std::string, std::vector<std::unique_ptr<TargetMachine>>> machinePool;
+
+static std::string machinePoolKey(StringRef gpu, char optLevel) {
+	return (gpu + ":" + Twine(optLevel)).str();
+}
+
+/// Contents of "-" for the -serve request being handled
+static const std::string* requestStdin = nullptr;
+
+enum class StartupPhase { TargetInit, PassRegistry, OptionParsing, MachineCreation, IRParsing, Count };
+
+/// Time spent in each startup phase for -time-startup, IR parsing and machine creation can happen on several threads at once
+static std::atomic<uint64_t> startupNanos[(size_t)StartupPhase::Count];
+static std::atomic<uint32_t> startupCounts[(size_t)StartupPhase::Count];
+
+class StartupTimer {
+	StartupPhase phase;
+	std::chrono::steady_clock::time_point start;
+public:
+	StartupTimer(StartupPhase phase): phase(phase), start(std::chrono::steady_clock::now()) {}
+	~StartupTimer() {
+		auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+		startupNanos[(size_t)phase] += elapsed.count();
+		startupCounts[(size_t)phase]++;
+	}
+};
+
+static void resetStartupTimes(StartupPhase phase) {
+	startupNanos[(size_t)phase] = 0;
+	startupCounts[(size_t)phase] = 0;
+}
+
+static void printStartupTimes(raw_ostream& os);
 
 int main(int argc, char **argv) {
 	try {
 		progName = argv[0];
 		InitLLVM X(argc, argv);
 
-		LLVMContext context;
-
 		PassRegistry& registry = *PassRegistry::getPassRegistry();
 
-		initialize(registry);
-
-		cl::ParseCommandLineOptions(argc, argv, "Metal GPU ASM Checker");
+		{
+			StartupTimer timer(StartupPhase::TargetInit);
+			initializeAGX2();
+		}
+		if (needsPassNames(makeArrayRef(argv, argc))) {
+			StartupTimer timer(StartupPhase::PassRegistry);
+			initializePassNames(registry);
+		}
 
-		if (!Twiddle.empty()) {
-			StringRef t(Twiddle.getValue());
-			for (int i = 0; i < 4; i++) {
-				auto split = t.split(',');
-				split.first.getAsInteger(0, twiddleParams[i]);
-				split.first.getAsDouble(twiddleFloat[i]);
-				t = split.second;
-			}
+		{
+			StartupTimer timer(StartupPhase::OptionParsing);
+			cl::ParseCommandLineOptions(argc, argv, "Metal GPU ASM Checker");
 		}
 
 		PassPrinter printer;
 		// registry.enumerateWith(&printer);
 
-		auto [target, tm] = getAGX2TargetMachine();
+		std::string firstGPU = selectedGPUs().front();
+		auto targetAndMachine = getAGX2TargetMachine(firstGPU, OptLevel, errs());
+		const Target* target = targetAndMachine.first;
+		machinePool[machinePoolKey(firstGPU, OptLevel)].push_back(std::move(targetAndMachine.second));
 
 		actualCodeEmitterConstructor = target->MCCodeEmitterCtorFn;
 		const_cast<Target*>(target)->MCCodeEmitterCtorFn = replacementCodeEmitterConstructor;
 
-		compileModule(context, *target, *tm);
+		if (!EncodingCachePath.empty()) {
+			std::string error;
+			encodingCache = EncodingCache::open(EncodingCachePath, error);
+			if (!encodingCache) {
+				WithColor::error(errs(), progName) << error << '\n';
+				throw exit_exception();
+			}
+			encodingCacheSeed = makeEncodingCacheSeed();
+		}
+
+		if (!CacheDir.empty()) {
+			std::string error;
+			compileCache = CompileCache::open(CacheDir, CachePolicy, error);
+			if (!compileCache) {
+				WithColor::error(errs(), progName) << error << '\n';
+				throw exit_exception();
+			}
+			toolIdentity = CompileCache::toolIdentity(argv[0], reinterpret_cast<void*>(&collectInputs));
+			commandFingerprint = makeCommandFingerprint(makeArrayRef(argv, argc));
+		}
+
+		if (!Serve.empty()) {
+			std::string socketPath = Serve;
+			auto handler = [&](const ServerRequest& request) { return handleRequest(request); };
+			if (socketPath == "-") {
+				serveStream(0, 1, handler);
+				return 0;
+			}
+			sys::RemoveFileOnSignal(socketPath);
+			std::string error;
+			serveSocket(socketPath, handler, error);
+			WithColor::error(errs(), progName) << error << '\n';
+			throw exit_exception();
+		}
+
+		if (EmitFormatOpt == EmitFormat::Binary) {
+			sys::ChangeStdoutToBinary();
+		}
+		initializeInstrumentation("mtl-gpu-asmcheck");
+		bool ok = runInputs(outs(), errs());
+		if (!finishInstrumentation() || !ok) {
+			return 1;
+		}
 	} catch (exit_exception& e) {
 		return 1;
 	}
 	return 0;
 }
 
+static void printInputHeader(raw_ostream& os, const std::vector<std::string>& inputs, size_t index) {
+	if (EmitFormatOpt == EmitFormat::JSONL) {
+		os << "{\"input\":" << index << ",\"file\":";
+		writeJSONString(os, inputs[index]);
+		os << "}\n";
+	} else if (EmitFormatOpt == EmitFormat::Text && inputs.size() > 1) {
+		os << "==> " << inputs[index] << " <==\n";
+	}
+}
+
+/// Writes the -inst-stats file from runStats
+static bool writeInstStats(const MCInstrInfo& ii, raw_ostream& diag) {
+	std::error_code ec;
+	ToolOutputFile file(InstStatsPath, ec, sys::fs::F_Text);
+	if (ec) {
+		WithColor::error(diag, progName) << InstStatsPath << ": " << ec.message() << '\n';
+		return false;
+	}
+	std::vector<InstStatsOpcodeInfo> info(ii.getNumOpcodes());
+	for (unsigned i = 0; i < ii.getNumOpcodes(); i++) {
+		const MCInstrDesc& desc = ii.get(i);
+		info[i].name = ii.getName(i);
+		info[i].flags = desc.Flags;
+		info[i].tsFlags = desc.TSFlags;
+		info[i].schedClass = desc.getSchedClass();
+	}
+	std::string table;
+	if (InstStatsFormatOpt == InstStatsFormat::CSV) {
+		runStats->writeCSV(table, info);
+	} else {
+		runStats->writeJSON(table, info);
+	}
+	file.os() << table;
+	file.keep();
+	return true;
+}
+
+/// Writes the -export-target-info files for the first -gpu
+static bool exportTargetInfo(raw_ostream& diag) {
+	std::string gpu = selectedGPUs().front();
+	auto& machines = machinePool[machinePoolKey(gpu, OptLevel)];
+	if (machines.empty()) {
+		machines.push_back(getAGX2TargetMachine(gpu, OptLevel, diag).second);
+	}
+	const MCInstrInfo& ii = *machines[0]->getMCInstrInfo();
+	const MCRegisterInfo& mri = *machines[0]->getMCRegisterInfo();
+
+	std::pair<std::string, sys::fs::OpenFlags> files[] = {
+		{ExportTargetInfo + ".bin", sys::fs::F_None},
+		{ExportTargetInfo + "-opcodes.csv", sys::fs::F_Text},
+		{ExportTargetInfo + "-registers.csv", sys::fs::F_Text},
+	};
+	for (size_t i = 0; i < 3; i++) {
+		std::error_code ec;
+		ToolOutputFile file(files[i].first, ec, files[i].second);
+		if (ec) {
+			WithColor::error(diag, progName) << files[i].first << ": " << ec.message() << '\n';
+			return false;
+		}
+		if (i == 0) {
+			writeTargetInfo(file.os(), ii, mri);
+		} else if (i == 1) {
+			writeOpcodeCSV(file.os(), ii, mri);
+		} else {
+			writeRegisterCSV(file.os(), mri);
+		}
+		file.keep();
+	}
+	return true;
+}
+
+/// Compiles everything the current options ask for, returning false if any input failed
+static bool runInputs(raw_ostream& out, raw_ostream& diag) {
+	if (!ExportTargetInfo.empty()) {
+		return exportTargetInfo(diag);
+	}
+
+	twiddleOpcode = -1;
+	twiddleRanges.clear();
+	if (!Twiddle.empty()) {
+		parseTwiddle(Twiddle, diag);
+	}
+	fpImmTableOpcode = -1;
+	if (!FPImmTableOpt.empty()) {
+		parseFPImmTable(FPImmTableOpt, diag);
+	}
+	if (RegisterFootprintOpt && EmitFormatOpt == EmitFormat::Binary) {
+		WithColor::error(diag, progName) << "-register-footprint needs -emit-format=text or jsonl\n";
+		throw exit_exception();
+	}
+	if (EstimateCost && EmitFormatOpt == EmitFormat::Binary) {
+		WithColor::error(diag, progName) << "-cost-estimate needs -emit-format=text or jsonl\n";
+		throw exit_exception();
+	}
+	if (Dedup && EmitFormatOpt == EmitFormat::Binary) {
+		WithColor::error(diag, progName) << "-dedup needs -emit-format=text or jsonl\n";
+		throw exit_exception();
+	}
+	if (TwiddleInfer && EmitFormatOpt == EmitFormat::Binary) {
+		WithColor::error(diag, progName) << "-twiddle-infer needs -emit-format=text or jsonl\n";
+		throw exit_exception();
+	}
+	if (fpImmTableOpcode >= 0 && EmitFormatOpt == EmitFormat::Binary) {
+		WithColor::error(diag, progName) << "-fp-imm-table needs -emit-format=text or jsonl\n";
+		throw exit_exception();
+	}
+
+	std::vector<std::string> inputs = collectInputs(diag);
+	if (inputs.size() > 1 && !OutputFilename.empty()) {
+		WithColor::error(diag, progName) << "-o can't be used with multiple inputs\n";
+		throw exit_exception();
+	}
+
+	std::vector<std::string> gpus = selectedGPUs();
+	if (!DiffInput.empty() || DiffOptLevel || !DiffGPU.empty()) {
+		if (gpus.size() > 1) {
+			WithColor::error(diag, progName) << "-diff-input, -diff-O and -diff-gpu can only be used with a single -gpu\n";
+			throw exit_exception();
+		}
+		// The diff compiles are captured, none of these reports or the cache would see them
+		if (!InstStatsPath.empty() || Dedup || !RecordPath.empty() || EstimateCost || RegisterFootprintOpt || SplitModuleParts || !CacheDir.empty()) {
+			WithColor::error(diag, progName) << "-diff-input, -diff-O and -diff-gpu can't be used with -inst-stats, -dedup, -record, -cost-estimate, -register-footprint, -split-module or -cache-dir\n";
+			throw exit_exception();
+		}
+		return runDiff(inputs, gpus[0], out, diag);
+	}
+	if (gpus.size() > 1) {
+		if (!InstStatsPath.empty()) {
+			WithColor::error(diag, progName) << "-inst-stats can only be used with a single -gpu\n";
+			throw exit_exception();
+		}
+		if (!RecordPath.empty()) {
+			WithColor::error(diag, progName) << "-record can only be used with a single -gpu\n";
+			throw exit_exception();
+		}
+		if (EstimateCost) {
+			WithColor::error(diag, progName) << "-cost-estimate can only be used with a single -gpu\n";
+			throw exit_exception();
+		}
+		if (RegisterFootprintOpt) {
+			WithColor::error(diag, progName) << "-register-footprint can only be used with a single -gpu\n";
+			throw exit_exception();
+		}
+		if (SplitModuleParts) {
+			WithColor::error(diag, progName) << "-split-module can only be used with a single -gpu\n";
+			throw exit_exception();
+		}
+		if (Dedup) {
+			WithColor::error(diag, progName) << "-dedup can only be used with a single -gpu\n";
+			throw exit_exception();
+		}
+		// compileAcrossGPUs doesn't go through the compile cache
+		if (!CacheDir.empty()) {
+			WithColor::error(diag, progName) << "-cache-dir can only be used with a single -gpu\n";
+			throw exit_exception();
+		}
+		return runInputsAcrossGPUs(inputs, gpus, out, diag);
+	}
+
+	// A split input's partitions are compiled in parallel rather than several inputs at once
+	if (SplitModuleParts && (!OutputFilename.empty() || Dedup || !RecordPath.empty() || EstimateCost || RegisterFootprintOpt)) {
+		WithColor::error(diag, progName) << "-split-module can't be used with -o, -dedup, -record, -cost-estimate or -register-footprint\n";
+		throw exit_exception();
+	}
+
+	// Target setup is shared, each input gets its own context so modules don't pile up in memory
+	// TargetMachines aren't safe to share between threads, so every worker gets its own
+	unsigned workers = SplitModuleParts ? resolveWorkerCount(Jobs.getNumOccurrences() ? Jobs : 0, SplitModuleParts) : resolveWorkerCount(Jobs, inputs.size());
+	auto& machines = machinePool[machinePoolKey(gpus[0], OptLevel)];
+	while (machines.size() < workers) {
+		machines.push_back(getAGX2TargetMachine(gpus[0], OptLevel, diag).second);
+	}
+	if (!InstStatsPath.empty()) {
+		runStats = llvm::make_unique<InstStats>(machines[0]->getMCInstrInfo()->getNumOpcodes());
+	}
+	if (RegisterFootprintOpt) {
+		buildRegisterSlots(*machines[0]->getMCRegisterInfo());
+		runFootprint = llvm::make_unique<RegisterFootprintSummary>(machines[0]->getMCRegisterInfo()->getNumRegClasses());
+	}
+
+	std::unique_ptr<ToolOutputFile> recordFile;
+	if (!RecordPath.empty()) {
+		std::error_code ec;
+		recordFile = llvm::make_unique<ToolOutputFile>(RecordPath, ec, sys::fs::F_None);
+		if (ec) {
+			WithColor::error(diag, progName) << RecordPath << ": " << ec.message() << '\n';
+			throw exit_exception();
+		}
+		std::string header;
+		RecordingWriter::writeHeader(header);
+		recordFile->os() << header;
+	}
+
+	bool failed = false;
+
+	if (EmitFormatOpt == EmitFormat::Binary) {
+		BinaryFileHeader header = {};
+		memcpy(header.magic, BinaryRecordMagic, sizeof(header.magic));
+		header.version = BinaryRecordVersion;
+		header.recordSize = sizeof(BinaryRecord);
+		out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	}
+
+	if (SplitModuleParts) {
+		for (size_t i = 0; i < inputs.size(); i++) {
+			printInputHeader(out, inputs, i);
+			try {
+				compileSplitModule(inputs[i], i, machines, workers, out, diag);
+			} catch (exit_exception& e) {
+				failed = true;
+			}
+		}
+	} else if (workers == 1) {
+		for (size_t i = 0; i < inputs.size(); i++) {
+			printInputHeader(out, inputs, i);
+			std::string recording;
+			try {
+				compileModule(inputs[i], i, *machines[0], out, diag, recordFile ? &recording : nullptr);
+			} catch (exit_exception& e) {
+				failed = true;
+			}
+			if (recordFile) {
+				recordFile->os() << recording;
+			}
+		}
+	} else {
+		std::vector<std::string> recordings(recordFile ? inputs.size() : 0);
+		runJobsOrdered(workers, inputs.size(), [&](unsigned worker, size_t index) {
+			JobResult result;
+			raw_string_ostream jobOut(result.output);
+			raw_string_ostream jobDiag(result.errors);
+			printInputHeader(jobOut, inputs, index);
+			try {
+				compileModule(inputs[index], index, *machines[worker], jobOut, jobDiag, recordFile ? &recordings[index] : nullptr);
+			} catch (exit_exception& e) {
+				result.failed = true;
+			}
+			jobOut.flush();
+			jobDiag.flush();
+			return result;
+		}, [&](size_t index, JobResult& result) {
+			out << result.output;
+			diag << result.errors;
+			failed |= result.failed;
+			if (recordFile) {
+				recordFile->os() << recordings[index];
+				std::string().swap(recordings[index]);
+			}
+		});
+	}
+
+	if (recordFile) {
+		recordFile->keep();
+	}
+
+	if (compileCache) {
+		compileCache->prune();
+	}
+
+	if (runStats) {
+		failed |= !writeInstStats(*machines[0]->getMCInstrInfo(), diag);
+		runStats.reset();
+	}
+
+	if (runFootprint) {
+		printRegisterFootprintSummary(out, *machines[0]->getMCRegisterInfo());
+		runFootprint.reset();
+	}
+
+	if (TimeStartup) {
+		printStartupTimes(diag);
+	}
+
+	return !failed;
+}
+
+/// Handles one -serve request like a fresh run of the tool with the request's arguments
+/// Puts every option back to its default, so a -serve request doesn't inherit anything from the ones before it
+/// cl::ResetAllOptionOccurrences only clears the counts, cl::opt::setDefault only works for options with a cl::init
+/// (which is why every option here has one) and cl::list::setDefault does nothing, so the lists are cleared by hand
+static void resetOptions() {
+	for (auto& option : cl::getRegisteredOptions()) {
+		option.second->setDefault();
+	}
+	InputFilenames.erase(InputFilenames.begin(), InputFilenames.end());
+	Functions.erase(Functions.begin(), Functions.end());
+	cl::ResetAllOptionOccurrences();
+}
+
+static ServerResponse handleRequest(const ServerRequest& request) {
+	ServerResponse response;
+	raw_string_ostream out(response.output);
+	raw_string_ostream diag(response.errors);
+	response.status = 1;
+
+	std::vector<const char*> argv = {progName};
+	for (const std::string& arg : request.args) {
+		StringRef name = StringRef(arg).ltrim('-');
+		// These print and exit() instead of returning
+		if (arg.size() > 1 && arg[0] == '-' && (name.startswith("help") || name == "version" || name.startswith("print-options") || name.startswith("print-all-options"))) {
+			WithColor::error(diag, progName) << arg << " isn't available through -serve\n";
+			out.flush();
+			diag.flush();
+			return response;
+		}
+		argv.push_back(arg.c_str());
+	}
+
+	try {
+		if (chdir(request.workingDirectory.c_str()) != 0) {
+			WithColor::error(diag, progName) << request.workingDirectory << ": " << strerror(errno) << '\n';
+			throw exit_exception();
+		}
+		if (needsPassNames(argv)) {
+			initializePassNames(*PassRegistry::getPassRegistry());
+		}
+		// Initialization happened once for the whole server, the rest is timed per request
+		resetStartupTimes(StartupPhase::OptionParsing);
+		resetStartupTimes(StartupPhase::MachineCreation);
+		resetStartupTimes(StartupPhase::IRParsing);
+		resetOptions();
+		bool parsed;
+		{
+			StartupTimer timer(StartupPhase::OptionParsing);
+			parsed = cl::ParseCommandLineOptions((int)argv.size(), argv.data(), "Metal GPU ASM Checker", &diag);
+		}
+		if (!parsed) {
+			throw exit_exception();
+		}
+		// Caches are opened once when the server starts
+		for (cl::Option* opt : {static_cast<cl::Option*>(&Serve), static_cast<cl::Option*>(&CacheDir), static_cast<cl::Option*>(&CachePolicy), static_cast<cl::Option*>(&EncodingCachePath)}) {
+			if (opt->getNumOccurrences()) {
+				WithColor::error(diag, progName) << "-" << opt->ArgStr << " can only be given when starting the server\n";
+				throw exit_exception();
+			}
+		}
+		if (OutputFilename == "-") {
+			WithColor::error(diag, progName) << "-o - can't be used through -serve\n";
+			throw exit_exception();
+		}
+		if (compileCache) {
+			commandFingerprint = makeCommandFingerprint(argv);
+		}
+		requestStdin = &request.input;
+		initializeInstrumentation("mtl-gpu-asmcheck");
+		bool ok = runInputs(out, diag);
+		requestStdin = nullptr;
+		if (finishInstrumentation() && ok) {
+			response.status = 0;
+		}
+	} catch (exit_exception& e) {
+		requestStdin = nullptr;
+		finishInstrumentation();
+	}
+	out.flush();
+	diag.flush();
+	return response;
+}
+
+static void addInput(StringRef path, std::vector<std::string>& inputs, raw_ostream& diag) {
+	if (path == "-" || !sys::fs::is_directory(path)) {
+		inputs.push_back(path);
+		return;
+	}
+	std::vector<std::string> found;
+	std::error_code ec;
+	for (sys::fs::recursive_directory_iterator it(path, ec), end; it != end && !ec; it.increment(ec)) {
+		StringRef ext = sys::path::extension(it->path());
+		if (ext == ".ll" || ext == ".bc") {
+			found.push_back(it->path());
+		}
+	}
+	if (ec) {
+		WithColor::error(diag, progName) << path << ": " << ec.message() << '\n';
+		throw exit_exception();
+	}
+	// Directory iteration order is filesystem dependent, sort so output is reproducible
+	std::sort(found.begin(), found.end());
+	inputs.insert(inputs.end(), found.begin(), found.end());
+}
+
+/// Reads an input file, with "-" meaning requestStdin when it's set (a -serve request's input, or stdin read once for -diff-*)
+static ErrorOr<std::unique_ptr<MemoryBuffer>> readInput(StringRef filename) {
+	if (requestStdin && filename == "-") {
+		return MemoryBuffer::getMemBuffer(*requestStdin, "<stdin>");
+	}
+	return MemoryBuffer::getFileOrSTDIN(filename);
+}
+
+static std::vector<std::string> collectInputs(raw_ostream& diag) {
+	std::vector<std::string> inputs;
+	for (const std::string& input : InputFilenames) {
+		addInput(input, inputs, diag);
+	}
+	if (!InputList.empty()) {
+		auto buffer = readInput(InputList);
+		if (!buffer) {
+			WithColor::error(diag, progName) << InputList << ": " << buffer.getError().message() << '\n';
+			throw exit_exception();
+		}
+		for (line_iterator it(**buffer, true, '#'); !it.is_at_eof(); ++it) {
+			addInput(it->trim(), inputs, diag);
+		}
+	}
+	if (inputs.empty() && InputFilenames.empty() && InputList.empty()) {
+		inputs.push_back("-");
+	}
+	return inputs;
+}
+
+
+/// Only sets up what assembling for AGX2 uses, there's no asm parser or disassembler involved
+static void initializeAGX2() {
+	LLVMInitializeAGX2TargetInfo();
+	LLVMInitializeAGX2Target();
+	LLVMInitializeAGX2TargetMC();
+	LLVMInitializeAGX2AsmPrinter();
+}
 
-static void initialize(PassRegistry& registry)  {
-	InitializeAllTargets();
-	InitializeAllTargetMCs();
-	InitializeAllAsmPrinters();
-	InitializeAllAsmParsers();
+/// Codegen passes register themselves when they're created, the registry only needs filling up front for options that look passes up by name
+static bool needsPassNames(ArrayRef<const char*> args) {
+	for (StringRef arg : args.drop_front()) {
+		arg = arg.ltrim('-');
+		if (arg.startswith("print-after") || arg.startswith("print-before") || arg.startswith("stop-after") || arg.startswith("stop-before") || arg.startswith("start-after") || arg.startswith("start-before") || arg.startswith("run-pass")) {
+			return true;
+		}
+	}
+	return false;
+}
 
+static void initializePassNames(PassRegistry& registry) {
 	initializeCore(registry);
 	initializeScalarOpts(registry);
 	initializeVectorization(registry);
@@ -127,7 +928,24 @@ static void initialize(PassRegistry& registry)  {
 	initializeTarget(registry);
 }
 
-static std::pair<const Target*, std::unique_ptr<TargetMachine>> getAGX2TargetMachine() {
+/// The GPUs named by -gpu, which can be a comma separated list or "all"
+static std::vector<std::string> selectedGPUs() {
+	if (GPU == "all") {
+		return std::vector<std::string>(std::begin(KnownGPUs), std::end(KnownGPUs));
+	}
+	SmallVector<StringRef, 8> parts;
+	StringRef(GPU).split(parts, ',', -1, false);
+	std::vector<std::string> gpus;
+	for (StringRef part : parts) {
+		gpus.push_back(part.trim());
+	}
+	if (gpus.empty()) {
+		gpus.push_back(GPU);
+	}
+	return gpus;
+}
+
+static std::pair<const Target*, std::unique_ptr<TargetMachine>> getAGX2TargetMachine(StringRef gpu, char optLevel, raw_ostream& diag) {
 	std::string error;
 	Triple triple;
 	StringRef features = "";
@@ -141,9 +959,9 @@ static std::pair<const Target*, std::unique_ptr<TargetMachine>> getAGX2TargetMac
 	TargetOptions opts;
 
 	CodeGenOpt::Level OLvl = CodeGenOpt::Default;
-	switch (OptLevel) {
+	switch (optLevel) {
 		default:
-			WithColor::error(errs(), progName) << "invalid optimization level.\n";
+			WithColor::error(diag, progName) << "invalid optimization level.\n";
 			throw exit_exception();
 		case ' ': break;
 		case '0': OLvl = CodeGenOpt::None; break;
@@ -152,12 +970,176 @@ static std::pair<const Target*, std::unique_ptr<TargetMachine>> getAGX2TargetMac
 		case '3': OLvl = CodeGenOpt::Aggressive; break;
 	}
 
-	// Note: Available processors: g10, g10p-b0, g11, g11g-a0, g11g-b0, g11m-a0, g11m-b0, g11p-a0, g11p-b0, g12, g12g-a0, g12m-a0, g12p-a0, g12p-b0, g12x, g13, g13-fullf32, g13g-a0, g13g-b0, g13g-b0-nofullf32, g13p-a0, g13x, g13x-a0
+	// Note: Available processors are listed in KnownGPUs
 
-	std::unique_ptr<TargetMachine> targetMachine(target->createTargetMachine(triple.getTriple(), GPU, features, opts, None, None, OLvl));
+	StartupTimer timer(StartupPhase::MachineCreation);
+	std::unique_ptr<TargetMachine> targetMachine(target->createTargetMachine(triple.getTriple(), gpu, features, opts, None, None, OLvl));
 	return {target, std::move(targetMachine)};
 }
 
+static void parseTwiddle(StringRef str, raw_ostream& diag) {
+	SmallVector<StringRef, 16> parts;
+	str.split(parts, ',');
+	if (parts.size() < 4 || (parts.size() - 1) % 3 != 0 || parts[0].trim().getAsInteger(0, twiddleOpcode)) {
+		WithColor::error(diag, progName) << "-twiddle should be opcode,operandidx,low,high[,operandidx,low,high...]\n";
+		throw exit_exception();
+	}
+	for (size_t i = 1; i < parts.size(); i += 3) {
+		TwiddleRange range;
+		StringRef low = parts[i + 1].trim(), high = parts[i + 2].trim();
+		bool badOperand = parts[i].trim().getAsInteger(0, range.operand);
+		if (badOperand || low.getAsInteger(0, range.low) || high.getAsInteger(0, range.high)) {
+			// Allow non-integer bounds for FPImm operands
+			if (badOperand || low.getAsDouble(range.lowFloat) || high.getAsDouble(range.highFloat)) {
+				WithColor::error(diag, progName) << "invalid -twiddle range \"" << parts[i] << "," << parts[i + 1] << "," << parts[i + 2] << "\"\n";
+				throw exit_exception();
+			}
+			range.low = (int64_t)range.lowFloat;
+			range.high = (int64_t)range.highFloat;
+		} else {
+			range.lowFloat = range.low;
+			range.highFloat = range.high;
+		}
+		twiddleRanges.push_back(range);
+	}
+	if (TwiddleStride == 0) {
+		WithColor::error(diag, progName) << "-twiddle-stride must be at least 1\n";
+		throw exit_exception();
+	}
+}
+
+static void parseFPImmTable(StringRef str, raw_ostream& diag) {
+	std::pair<StringRef, StringRef> parts = str.split(',');
+	if (parts.first.trim().getAsInteger(0, fpImmTableOpcode) || parts.second.trim().getAsInteger(0, fpImmTableOperand)) {
+		WithColor::error(diag, progName) << "-fp-imm-table should be opcode,operandidx\n";
+		throw exit_exception();
+	}
+	// Below this the per-pattern results alone would take gigabytes
+	if (FPImmFloatStride && FPImmFloatStride < 256) {
+		WithColor::error(diag, progName) << "-fp-imm-float-stride must be 0 or at least 256\n";
+		throw exit_exception();
+	}
+}
+
+/// Number of values a twiddle range tries on the given operand
+static uint64_t twiddleCount(const TwiddleRange& range, const MCOperand& operand) {
+	if (operand.isFPImm()) {
+		if (range.highFloat <= range.lowFloat) {
+			return 0;
+		}
+		double count = std::ceil((range.highFloat - range.lowFloat) / TwiddleStride);
+		return count < 0x1p64 ? (uint64_t)count : UINT64_MAX;
+	}
+	if (range.high <= range.low) {
+		return 0;
+	}
+	return ((uint64_t)range.high - (uint64_t)range.low + TwiddleStride - 1) / TwiddleStride;
+}
+
+/// The value of a twiddled operand as recorded for field inference, FPImms are stored as the bits of the double
+static int64_t twiddleValueOf(const MCOperand& operand) {
+	if (operand.isFPImm()) {
+		double fp = operand.getFPImm();
+		int64_t bits;
+		memcpy(&bits, &fp, sizeof(bits));
+		return bits;
+	}
+	return operand.isReg() ? operand.getReg() : operand.getImm();
+}
+
+/// Sets an operand to the n-th value of a twiddle range
+static void setTwiddleValue(MCOperand& operand, const TwiddleRange& range, uint64_t n) {
+	if (operand.isFPImm()) {
+		operand.setFPImm(range.lowFloat + (double)n * TwiddleStride);
+		return;
+	}
+	int64_t value = range.low + (int64_t)(n * TwiddleStride);
+	if (operand.isReg()) {
+		operand.setReg((unsigned)value);
+	} else {
+		operand.setImm(value);
+	}
+}
+
+/// Picks which of the `total` twiddle combinations to encode (in order), an empty result means all of them
+static std::vector<uint64_t> chooseTwiddlePoints(uint64_t total) {
+	if (!TwiddleSampleCount || TwiddleSampleCount >= total) {
+		return {};
+	}
+	// Floyd's algorithm, with a fixed seed so reruns encode the same combinations
+	std::mt19937_64 rng(0);
+	std::unordered_set<uint64_t> chosen;
+	for (uint64_t j = total - TwiddleSampleCount; j < total; j++) {
+		uint64_t t = std::uniform_int_distribution<uint64_t>(0, j)(rng);
+		if (!chosen.insert(t).second) {
+			chosen.insert(j);
+		}
+	}
+	std::vector<uint64_t> points(chosen.begin(), chosen.end());
+	std::sort(points.begin(), points.end());
+	return points;
+}
+
+/// How -record and -inst-stats classify an operand
+static RecordOperandKind operandKindOf(const MCOperand& operand) {
+	if (operand.isReg()) {
+		return RecordOperandKind::Reg;
+	} else if (operand.isImm()) {
+		return RecordOperandKind::Imm;
+	} else if (operand.isFPImm()) {
+		return RecordOperandKind::FPImm;
+	} else if (operand.isExpr()) {
+		return RecordOperandKind::Expr;
+	} else if (operand.isInst()) {
+		return RecordOperandKind::Inst;
+	}
+	return RecordOperandKind::Invalid;
+}
+
+/// Builds the -encoding-cache key for an instruction, returns false if it has operands that can't be part of one
+static bool makeEncodingKey(const MCInst& inst, const MCSubtargetInfo& sti, EncodingKey& key) {
+	EncodingKeyHasher hasher(encodingCacheSeed);
+	// The same instruction can encode differently on other GPUs
+	StringRef cpu = sti.getCPU();
+	hasher.add(cpu.data(), cpu.size());
+	hasher.add(inst.getOpcode());
+	hasher.add(inst.getFlags());
+	hasher.add(inst.getNumOperands());
+	for (const MCOperand& operand : inst) {
+		if (operand.isReg()) {
+			hasher.add(1);
+			hasher.add(operand.getReg());
+		} else if (operand.isImm()) {
+			hasher.add(2);
+			hasher.add(operand.getImm());
+		} else if (operand.isFPImm()) {
+			double fp = operand.getFPImm();
+			uint64_t bits;
+			memcpy(&bits, &fp, sizeof(bits));
+			hasher.add(3);
+			hasher.add(bits);
+		} else {
+			return false;
+		}
+	}
+	key = hasher.finish();
+	return true;
+}
+
+/// Seeds -encoding-cache keys with the libLLVM the encoder came from, so a macOS update doesn't leave stale encodings
+/// The GPU is added per instruction by makeEncodingKey since one run can target several
+static uint64_t makeEncodingCacheSeed() {
+	EncodingKeyHasher hasher;
+	Dl_info info;
+	struct stat st;
+	if (dladdr(reinterpret_cast<void*>(actualCodeEmitterConstructor), &info) && info.dli_fname && stat(info.dli_fname, &st) == 0) {
+		hasher.add(info.dli_fname, strlen(info.dli_fname));
+		hasher.add(st.st_size);
+		hasher.add(st.st_mtime);
+	}
+	return hasher.finish().lo;
+}
+
 static void printHex(raw_ostream& os, uint8_t byte) {
 	const char* hexEnc = "0123456789abcdef";
 	os << hexEnc[byte / 16] << hexEnc[byte % 16];
@@ -168,30 +1150,66 @@ class CodeEmitterWrapper : public MCCodeEmitter {
 	const MCInstrInfo& ii;
 	const MCRegisterInfo& mri;
 	MCContext& ctx;
-public:
-	CodeEmitterWrapper(std::unique_ptr<MCCodeEmitter> actual, const MCInstrInfo& ii, const MCRegisterInfo& mri, MCContext& ctx): actual(std::move(actual)), ii(ii), mri(mri), ctx(ctx) {}
+	raw_ostream& out;
+	uint32_t inputIndex;
+	std::vector<CapturedInst>* capture;
+	const std::vector<std::string>* functionSymbols;
+	mutable size_t nextFunction = 0;
+	mutable bool fpImmTableDone = false;
+	InstStats* stats;
+	DedupTable* dedup;
+	RecordingWriter* recording;
+	CostEstimator* cost;
+	RegisterFootprint* footprint;
+	std::vector<std::pair<int, uint64_t>>* functionStarts;
+	raw_ostream& diag;
+	InstFormatter formatter;
+
+	static std::vector<std::string> registerNames(const MCRegisterInfo& mri) {
+		std::vector<std::string> names;
+		if (!NoRegNames) {
+			for (unsigned reg = 0; reg < mri.getNumRegs(); reg++) {
+				names.push_back(mri.getName(reg));
+			}
+		}
+		return names;
+	}
+
+	/// Lines are built here and written in one go, the buffer is kept around so its allocation is reused
+	static LineBuilder& lineBuffer() {
+		static thread_local LineBuilder line;
+		line.clear();
+		return line;
+	}
+
+public:
+	CodeEmitterWrapper(std::unique_ptr<MCCodeEmitter> actual, const MCInstrInfo& ii, const MCRegisterInfo& mri, MCContext& ctx, const EmitterContext& emitCtx)
+		: actual(std::move(actual)), ii(ii), mri(mri), ctx(ctx), out(emitCtx.out), inputIndex(emitCtx.inputIndex)
+		, capture(emitCtx.capture), functionSymbols(emitCtx.functionSymbols), stats(emitCtx.stats), dedup(emitCtx.dedup), recording(emitCtx.recording), cost(emitCtx.cost), footprint(emitCtx.footprint), functionStarts(emitCtx.functionStarts), diag(emitCtx.diag ? *emitCtx.diag : errs())
+		, formatter(registerNames(mri), ctx.getAsmInfo()) {}
 
 	void reset() override { actual->reset(); }
 
 	class AutoArrayBrackets {
+		raw_ostream& os;
 		const bool needed;
 		bool needsComma = false;
 
 	public:
-		AutoArrayBrackets(size_t count): needed(count > 1) {
+		AutoArrayBrackets(raw_ostream& os, size_t count): os(os), needed(count > 1) {
 			if (needed) {
-				outs() << "[";
+				os << "[";
 			}
 		}
 		~AutoArrayBrackets() {
 			if (needed) {
-				outs() << "]";
+				os << "]";
 			}
 		}
 
 		void comma() {
 			if (needsComma) {
-				outs() << ", ";
+				os << ", ";
 			} else {
 				needsComma = true;
 			}
@@ -206,192 +1224,712 @@ public:
 		}
 	}
 
-	void descMCInst(raw_ostream& os, const MCInst& inst) const {
-		os << "Op #" << inst.getOpcode();
-		for (int i = 0; i < inst.getNumOperands(); i++) {
-			const MCOperand& operand = inst.getOperand(i);
-			if (i == 0) {
-				outs() << " ";
+	/// Writes inst to a -record recording, along with its desc and register names if the module doesn't have them yet
+	void record(RecordingWriter& writer, const MCInst& inst, ArrayRef<char> bytes, uint8_t flags) const {
+		unsigned opcode = inst.getOpcode();
+		if (writer.needsDesc(opcode)) {
+			const MCInstrDesc& info = ii.get(opcode);
+			RecordedDesc desc;
+			desc.name = ii.getName(opcode);
+			desc.flags = info.Flags;
+			desc.tsFlags = info.TSFlags;
+			desc.schedClass = info.getSchedClass();
+			desc.size = info.getSize();
+			desc.numDefs = info.getNumDefs();
+			desc.numOperands = info.getNumOperands();
+			writer.writeDesc(opcode, desc);
+		}
+		for (const MCOperand& operand : inst) {
+			if (operand.isReg() && writer.needsRegister(operand.getReg())) {
+				writer.writeRegister(operand.getReg(), mri.getName(operand.getReg()));
+			}
+		}
+		writer.beginInst(opcode, flags, inst.getFlags(), inst.getNumOperands());
+		for (const MCOperand& operand : inst) {
+			RecordOperandKind kind = operandKindOf(operand);
+			if (kind == RecordOperandKind::Reg) {
+				writer.addReg(operand.getReg());
+			} else if (kind == RecordOperandKind::Imm) {
+				writer.addImm(operand.getImm());
+			} else if (kind == RecordOperandKind::FPImm) {
+				double fp = operand.getFPImm();
+				uint64_t bits;
+				memcpy(&bits, &fp, sizeof(bits));
+				writer.addFPImm(bits);
+			} else if (kind == RecordOperandKind::Expr) {
+				std::string text;
+				raw_string_ostream os(text);
+				operand.getExpr()->print(os, ctx.getAsmInfo());
+				writer.addExpr(os.str());
 			} else {
-				outs() << ", ";
+				writer.addOther(kind);
 			}
-			if (!operand.isValid()) {
-				outs() << "<InvalidOperand>";
-			} else if (operand.isReg()) {
-				printRegister(outs(), operand.getReg());
+		}
+		writer.endInst(bytes.data(), bytes.size());
+	}
+
+	/// Everything that makes two instructions the same for -dedup, exact so distinct instructions never merge
+	void makeShapeKey(const MCInst& inst, std::string& key) const {
+		auto add = [&](uint64_t value) { key.append(reinterpret_cast<const char*>(&value), sizeof(value)); };
+		add(inst.getOpcode());
+		add(inst.getFlags());
+		for (const MCOperand& operand : inst) {
+			if (operand.isReg()) {
+				key += 'r';
+				add(operand.getReg());
 			} else if (operand.isImm()) {
-				if ((int64_t)(int16_t)operand.getImm() != operand.getImm()) {
-					// Display large numbers as hex
-					outs() << "0x";
-					outs().write_hex(operand.getImm());
-				} else {
-					outs() << operand.getImm();
-				}
+				key += 'i';
+				add(operand.getImm());
 			} else if (operand.isFPImm()) {
-				outs() << operand.getFPImm() << "f";
+				double fp = operand.getFPImm();
+				uint64_t bits;
+				memcpy(&bits, &fp, sizeof(bits));
+				key += 'f';
+				add(bits);
 			} else if (operand.isExpr()) {
-				if (operand.getExpr()->getKind() == MCExpr::Target) {
-					outs() << "<Target Specific Expr ";
-					operand.getExpr()->print(outs(), ctx.getAsmInfo());
-					outs() << ">";
-				} else {
-					operand.getExpr()->print(outs(), ctx.getAsmInfo());
-				}
-			} else if (operand.isInst()) {
-				outs() << "<SubInst>";
+				key += 'e';
+				raw_string_ostream os(key);
+				operand.getExpr()->print(os, ctx.getAsmInfo());
+				os.flush();
+				key += '\0';
 			} else {
-				outs() << "<UnrecognizedOperand>";
+				key += '?';
 			}
 		}
 	}
 
-	void twiddle(const MCInst& inst, SmallVectorImpl<MCFixup>& fixups, const MCSubtargetInfo& sti) const {
-		int op = (int)twiddleParams[1];
-		if (op >= inst.getNumOperands()) {
-			outs() << "Opcode #" << inst.getOpcode() << " didn't have " << (op + 1) << " operands\n";
+	void descMCInst(raw_ostream& os, const MCInst& inst) const {
+		LineBuilder& line = lineBuffer();
+		formatter.appendInst(line, inst);
+		os.write(line.data(), line.size());
+	}
+
+	/// Encodes into the (empty) binout, going through the -encoding-cache if there is one
+	/// Only instructions with register and immediate operands that didn't emit fixups are cached, so a hit never needs to recreate fixups
+	void encode(const MCInst& inst, SmallVectorImpl<char>& binout, SmallVectorImpl<MCFixup>& fixups, const MCSubtargetInfo& sti) const {
+		EncodingKey key;
+		bool cacheable = encodingCache && makeEncodingKey(inst, sti, key);
+		if (cacheable) {
+			uint8_t bytes[EncodingCache::MaxBytes];
+			size_t len;
+			if (encodingCache->lookup(key, bytes, len)) {
+				countEvent(NumEncodingCacheHits);
+				binout.append(bytes, bytes + len);
+				return;
+			}
+		}
+		size_t numFixups = fixups.size();
+		raw_svector_ostream bos(binout);
+		actual->encodeInstruction(inst, bos, fixups, sti);
+		if (cacheable && fixups.size() == numFixups) {
+			encodingCache->insert(key, reinterpret_cast<const uint8_t*>(binout.data()), binout.size());
+		}
+	}
+
+	/// Encodes one twiddled instruction and prints it (or writes its record) to os
+	void encodeTwiddled(raw_ostream& os, RecordingWriter* writer, const MCInst& mut, SmallVectorImpl<char>& binout, SmallVectorImpl<MCFixup>& fixups, const MCSubtargetInfo& sti) const {
+		binout.clear();
+		fixups.clear();
+		countEvent(NumTwiddled);
+		encode(mut, binout, fixups, sti);
+		if (writer) {
+			record(*writer, mut, binout, RecordTwiddled | (fixups.empty() ? 0 : RecordHasFixups));
+		}
+		if (EmitFormatOpt != EmitFormat::Text) {
+			writeRecord(os, mut, binout, !fixups.empty(), RecordTwiddled);
 			return;
 		}
-		MCInst mut = inst;
-		SmallVector<char, 32> binout;
+		LineBuilder& line = lineBuffer();
+		formatter.appendInst(line, mut);
+		line.padTo(40);
+		line.append(" => ");
+		line.appendHexBytes(reinterpret_cast<const uint8_t*>(binout.data()), binout.size());
+		line.newline();
+		os.write(line.data(), line.size());
+	}
 
-		auto doPrint = [&]{
-			uint64_t pos = outs().tell();
-			binout.clear();
-			raw_svector_ostream bos(binout);
-			descMCInst(outs(), mut);
-			actual->encodeInstruction(mut, bos, fixups, sti);
-			bos.str(); // flush
+	void twiddle(const MCInst& inst, ArrayRef<char> baseline, const MCSubtargetInfo& sti) const {
+		raw_ostream& msg = EmitFormatOpt == EmitFormat::Text ? out : diag;
+		std::vector<uint64_t> counts;
+		uint64_t total = 1;
+		for (const TwiddleRange& range : twiddleRanges) {
+			if (range.operand >= inst.getNumOperands()) {
+				msg << "Opcode #" << inst.getOpcode() << " didn't have " << (range.operand + 1) << " operands\n";
+				return;
+			}
+			const MCOperand& operand = inst.getOperand(range.operand);
+			if (!operand.isReg() && !operand.isImm() && !operand.isFPImm()) {
+				msg << "Opcode #" << inst.getOpcode() << " operand " << range.operand << "'s type isn't supported for twiddling\n";
+				return;
+			}
+			uint64_t count = twiddleCount(range, operand);
+			if (count && total > UINT64_MAX / count) {
+				msg << "Opcode #" << inst.getOpcode() << " has too many twiddle combinations, use -twiddle-stride or -twiddle-sample\n";
+				return;
+			}
+			counts.push_back(count);
+			total *= count;
+		}
+
+		std::vector<uint64_t> points = chooseTwiddlePoints(total);
+		uint64_t numPoints = points.empty() ? total : points.size();
+		const uint64_t chunkSize = 4096;
+		size_t numChunks = (numPoints + chunkSize - 1) / chunkSize;
+
+		std::vector<unsigned> operands;
+		for (const TwiddleRange& range : twiddleRanges) {
+			operands.push_back(range.operand);
+		}
+		if (recording) {
+			recording->writeSweep(inst.getOpcode(), operands);
+		}
 
-			for (uint64_t i = outs().tell(); i < pos + 40; i++) {
-				outs().write(' ');
+		// Every chunk gets its own copy of the instruction and scratch buffers, so chunks can be encoded on any thread
+		std::vector<std::vector<TwiddleSample>> chunkSamples(TwiddleInfer ? numChunks : 0);
+		std::vector<std::string> chunkRecordings(recording ? numChunks : 0);
+		runJobsOrdered(resolveWorkerCount(TwiddleThreads, numChunks), numChunks, [&](unsigned, size_t chunk) {
+			JobResult result;
+			raw_string_ostream os(result.output);
+			std::unique_ptr<RecordingWriter> writer;
+			if (recording) {
+				writer = llvm::make_unique<RecordingWriter>(recording->fork(chunkRecordings[chunk]));
 			}
+			MCInst mut = inst;
+			SmallVector<char, 32> binout;
+			SmallVector<MCFixup, 4> fixups;
+			uint64_t end = std::min(numPoints, (chunk + 1) * chunkSize);
+			for (uint64_t i = chunk * chunkSize; i < end; i++) {
+				// Mixed radix, the last range changes fastest
+				uint64_t index = points.empty() ? i : points[i];
+				for (size_t d = twiddleRanges.size(); d-- > 0;) {
+					setTwiddleValue(mut.getOperand(twiddleRanges[d].operand), twiddleRanges[d], index % counts[d]);
+					index /= counts[d];
+				}
+				encodeTwiddled(os, writer.get(), mut, binout, fixups, sti);
+				if (TwiddleInfer) {
+					chunkSamples[chunk].push_back(makeTwiddleSample(mut, binout));
+				}
+			}
+			os.flush();
+			return result;
+		}, [&](size_t chunk, JobResult& result) {
+			out << result.output;
+			if (recording) {
+				recording->append(chunkRecordings[chunk]);
+				chunkRecordings[chunk].clear();
+			}
+		});
 
-			outs() << " => ";
-			for (uint8_t c : binout) {
-				printHex(outs(), c);
-				outs() << " ";
+		if (TwiddleInfer) {
+			std::vector<TwiddleSample> samples;
+			samples.push_back(makeTwiddleSample(inst, baseline));
+			for (std::vector<TwiddleSample>& chunk : chunkSamples) {
+				std::move(chunk.begin(), chunk.end(), std::back_inserter(samples));
 			}
-			outs() << "\n";
-		};
+			std::string table;
+			appendFieldTableJSON(table, inst.getOpcode(), samples[0].bytes, inferFields(operands, samples));
+			if (EmitFormatOpt == EmitFormat::JSONL) {
+				out << "{\"input\":" << inputIndex << ",\"fieldTable\":" << table << "}\n";
+			} else {
+				out << "Inferred fields: " << table << "\n";
+			}
+		}
+	}
 
-		if (mut.getOperand(op).isFPImm()) {
-			mut.getOperand(op).setFPImm(twiddleParams[2]);
-			doPrint();
-			mut.getOperand(op).setFPImm(twiddleParams[3]);
-			doPrint();
+	/// -fp-imm-table: encodes the operand as every half and the chosen float bit patterns and prints which ones stayed inline
+	/// FPImm operands are set to the pattern's value, Imm operands to the raw bits
+	void sweepFPImms(const MCInst& inst, const MCSubtargetInfo& sti) const {
+		raw_ostream& msg = EmitFormatOpt == EmitFormat::Text ? out : diag;
+		if (fpImmTableOperand >= inst.getNumOperands()) {
+			msg << "Opcode #" << inst.getOpcode() << " didn't have " << (fpImmTableOperand + 1) << " operands\n";
+			return;
 		}
-		for (int64_t i = twiddleParams[2]; i < twiddleParams[3]; i++) {
-			MCOperand& operand = mut.getOperand(op);
-			if (operand.isReg()) {
-				operand.setReg((int)i);
-			} else if (operand.isImm()) {
-				operand.setImm(i);
+		if (!inst.getOperand(fpImmTableOperand).isFPImm() && !inst.getOperand(fpImmTableOperand).isImm()) {
+			msg << "Opcode #" << inst.getOpcode() << " operand " << fpImmTableOperand << " isn't an immediate\n";
+			return;
+		}
+
+		for (FPImmFormat format : {FPImmFormat::Half, FPImmFormat::Float}) {
+			std::vector<uint32_t> patterns = fpImmPatterns(format, FPImmFloatStride);
+			std::vector<FPImmResult> results(patterns.size());
+			const size_t chunkSize = 4096;
+			size_t numChunks = (patterns.size() + chunkSize - 1) / chunkSize;
+			runJobsOrdered(resolveWorkerCount(TwiddleThreads, numChunks), numChunks, [&](unsigned, size_t chunk) {
+				MCInst mut = inst;
+				MCOperand& operand = mut.getOperand(fpImmTableOperand);
+				SmallVector<char, 32> binout;
+				SmallVector<MCFixup, 4> fixups;
+				size_t end = std::min(patterns.size(), (chunk + 1) * chunkSize);
+				for (size_t i = chunk * chunkSize; i < end; i++) {
+					if (operand.isFPImm()) {
+						operand.setFPImm(fpImmToDouble(format, patterns[i]));
+					} else {
+						operand.setImm(patterns[i]);
+					}
+					binout.clear();
+					fixups.clear();
+					countEvent(NumTwiddled);
+					// Skips -encoding-cache, these would just crowd out real instructions
+					raw_svector_ostream bos(binout);
+					actual->encodeInstruction(mut, bos, fixups, sti);
+					results[i].hash = hashFPImmEncoding(reinterpret_cast<const uint8_t*>(binout.data()), binout.size());
+					results[i].size = binout.size();
+					results[i].fixup = !fixups.empty();
+				}
+				return JobResult();
+			}, [](size_t, JobResult&) {});
+
+			FPImmTable table = buildFPImmTable(format, patterns, results);
+			std::string str;
+			if (EmitFormatOpt == EmitFormat::JSONL) {
+				str = "{\"input\":" + std::to_string(inputIndex) + ",\"opcode\":" + std::to_string(inst.getOpcode());
+				str += ",\"operand\":" + std::to_string(fpImmTableOperand) + ",\"fpImmTable\":";
+				appendFPImmTableJSON(str, table);
+				str += "}\n";
 			} else {
-				outs() << "Opcode #" << inst.getOpcode() << " operand " << op << "'s type isn't supported for twiddling\n";
-				return;
+				str = "FP immediates for opcode #" + std::to_string(inst.getOpcode()) + " operand " + std::to_string(fpImmTableOperand);
+				str += ", " + std::to_string(patterns.size()) + " " + fpImmFormatName(format) + " patterns:";
+				for (size_t c = 0; c < 4; c++) {
+					str += (c ? ", " : " ") + std::to_string(table.counts[c]) + " " + fpImmClassName((FPImmClass)c);
+				}
+				str += "\n";
+				appendFPImmTableText(str, table);
 			}
-			doPrint();
+			out << str;
 		}
 	}
 
-	void encodeInstruction(const MCInst& inst, raw_ostream& os, SmallVectorImpl<MCFixup>& fixups, const MCSubtargetInfo& sti) const override {
-		uint64_t pos = outs().tell();
-		outs() << "Encoding ";
-		descMCInst(outs(), inst);
-		const MCInstrDesc& info = ii.get(inst.getOpcode());
+	static TwiddleSample makeTwiddleSample(const MCInst& inst, ArrayRef<char> bytes) {
+		TwiddleSample sample;
+		for (const TwiddleRange& range : twiddleRanges) {
+			sample.values.push_back(twiddleValueOf(inst.getOperand(range.operand)));
+		}
+		sample.bytes.assign(bytes.begin(), bytes.end());
+		return sample;
+	}
+
+	/// The "Encoding ..." line, ending in a newline
+	void appendEncodingLine(LineBuilder& line, const MCInst& inst, const MCSubtargetInfo& sti) const {
+		line.append("Encoding ");
+		formatter.appendInst(line, inst);
 		if (PrintSchedulingInfo) {
-			for (uint64_t i = outs().tell(); i < pos + 60; i++) {
-				outs().write(' ');
-			}
-			outs() << " ; Size: " << info.getSize() << ", Defs: " << info.getNumDefs();
-			if (info.getNumOperands() != inst.getNumOperands()) {
-				outs() << ", NumOperands: " << info.getNumOperands();
-			}
-			if (info.getSchedClass()) {
-				outs() << ", SchedClass: " << info.getSchedClass();
-			}
-			if (info.TSFlags) {
-				outs() << ", TSFlags: ";
-				outs().write_hex(info.TSFlags);
-			}
-			uint64_t flagsMinusAllocReq = info.Flags;
-			// All AGX2 insts I've seen have these, so invert these flags
-			flagsMinusAllocReq ^= 1ULL << MCID::ExtraSrcRegAllocReq;
-			flagsMinusAllocReq ^= 1ULL << MCID::ExtraDefRegAllocReq;
-			if (flagsMinusAllocReq) {
-				outs() << ", Flags: ";
-				AutoArrayBrackets brackets(__builtin_popcountl(flagsMinusAllocReq));
-#define TEST(x) if (flagsMinusAllocReq & (1ULL << MCID::x)) { brackets.comma(); outs() << #x;  }
-				TEST(Variadic)
-				TEST(HasOptionalDef)
-				TEST(Pseudo)
-				TEST(Return)
-				TEST(Call)
-				TEST(Barrier)
-				TEST(Terminator)
-				TEST(Branch)
-				TEST(IndirectBranch)
-				TEST(Compare)
-				TEST(MoveImm)
-				TEST(MoveReg)
-				TEST(Bitcast)
-				TEST(Select)
-				TEST(DelaySlot)
-				TEST(FoldableAsLoad)
-				TEST(MayLoad)
-				TEST(MayStore)
-				TEST(Predicable)
-				TEST(NotDuplicable)
-				TEST(UnmodeledSideEffects)
-				TEST(Commutable)
-				TEST(ConvertibleTo3Addr)
-				TEST(UsesCustomInserter)
-				TEST(HasPostISelHook)
-				TEST(Rematerializable)
-				TEST(CheapAsAMove)
-				if (flagsMinusAllocReq & (1ULL << MCID::ExtraSrcRegAllocReq)) { brackets.comma(); outs() << "!ExtraSrcRegAllocReq"; }
-				if (flagsMinusAllocReq & (1ULL << MCID::ExtraDefRegAllocReq)) { brackets.comma(); outs() << "!ExtraDefRegAllocReq"; }
-				TEST(RegSequence)
-				TEST(ExtractSubreg)
-				TEST(InsertSubreg)
-				TEST(Convergent)
-				TEST(Add)
-				TEST(Trap)
+			line.padTo(60);
+			// Only printed on request, so it's fine to go through raw_ostream
+			std::string info;
+			raw_string_ostream os(info);
+			printSchedulingInfo(os, inst, sti);
+			line.append(os.str());
+		}
+		line.newline();
+	}
+
+	/// Looks up inst's sched class in the subtarget's sched model, resolving variant classes
+	/// Returns null if the model has no instruction level info for it
+	const MCSchedClassDesc* resolveSchedClass(const MCInst& inst, const MCSubtargetInfo& sti) const {
+		const MCSchedModel& model = sti.getSchedModel();
+		if (!model.hasInstrSchedModel()) {
+			return nullptr;
+		}
+		unsigned schedClass = ii.get(inst.getOpcode()).getSchedClass();
+		const MCSchedClassDesc* desc = model.getSchedClassDesc(schedClass);
+		while (desc->isVariant()) {
+			schedClass = sti.resolveVariantSchedClass(schedClass, &inst, model.getProcessorID());
+			desc = model.getSchedClassDesc(schedClass);
+		}
+		return desc->isValid() ? desc : nullptr;
+	}
+
+	void printSchedulingInfo(raw_ostream& out, const MCInst& inst, const MCSubtargetInfo& sti) const {
+		const MCInstrDesc& info = ii.get(inst.getOpcode());
+		out << " ; Size: " << info.getSize() << ", Defs: " << info.getNumDefs();
+		if (info.getNumOperands() != inst.getNumOperands()) {
+			out << ", NumOperands: " << info.getNumOperands();
+		}
+		if (info.getSchedClass()) {
+			out << ", SchedClass: " << info.getSchedClass();
+		}
+		if (const MCSchedClassDesc* desc = resolveSchedClass(inst, sti)) {
+			out << ", Latency: " << MCSchedModel::computeInstrLatency(sti, *desc) << ", MicroOps: " << desc->NumMicroOps;
+			if (desc->NumWriteProcResEntries) {
+				out << ", Resources: ";
+				AutoArrayBrackets brackets(out, desc->NumWriteProcResEntries);
+				for (const MCWriteProcResEntry* res = sti.getWriteProcResBegin(desc); res != sti.getWriteProcResEnd(desc); ++res) {
+					brackets.comma();
+					out << sti.getSchedModel().getProcResource(res->ProcResourceIdx)->Name << " x" << res->Cycles;
+				}
+			}
+		}
+		if (info.TSFlags) {
+			out << ", TSFlags: ";
+			out.write_hex(info.TSFlags);
+		}
+		uint64_t flagsMinusAllocReq = info.Flags;
+		// All AGX2 insts I've seen have these, so invert these flags
+		flagsMinusAllocReq ^= 1ULL << MCID::ExtraSrcRegAllocReq;
+		flagsMinusAllocReq ^= 1ULL << MCID::ExtraDefRegAllocReq;
+		if (flagsMinusAllocReq) {
+			out << ", Flags: ";
+			AutoArrayBrackets brackets(out, __builtin_popcountl(flagsMinusAllocReq));
+#define TEST(x) if (flagsMinusAllocReq & (1ULL << MCID::x)) { brackets.comma(); out << #x;  }
+			TEST(Variadic)
+			TEST(HasOptionalDef)
+			TEST(Pseudo)
+			TEST(Return)
+			TEST(Call)
+			TEST(Barrier)
+			TEST(Terminator)
+			TEST(Branch)
+			TEST(IndirectBranch)
+			TEST(Compare)
+			TEST(MoveImm)
+			TEST(MoveReg)
+			TEST(Bitcast)
+			TEST(Select)
+			TEST(DelaySlot)
+			TEST(FoldableAsLoad)
+			TEST(MayLoad)
+			TEST(MayStore)
+			TEST(Predicable)
+			TEST(NotDuplicable)
+			TEST(UnmodeledSideEffects)
+			TEST(Commutable)
+			TEST(ConvertibleTo3Addr)
+			TEST(UsesCustomInserter)
+			TEST(HasPostISelHook)
+			TEST(Rematerializable)
+			TEST(CheapAsAMove)
+			if (flagsMinusAllocReq & (1ULL << MCID::ExtraSrcRegAllocReq)) { brackets.comma(); out << "!ExtraSrcRegAllocReq"; }
+			if (flagsMinusAllocReq & (1ULL << MCID::ExtraDefRegAllocReq)) { brackets.comma(); out << "!ExtraDefRegAllocReq"; }
+			TEST(RegSequence)
+			TEST(ExtractSubreg)
+			TEST(InsertSubreg)
+			TEST(Convergent)
+			TEST(Add)
+			TEST(Trap)
 #undef TEST
+		}
+		if (info.getNumImplicitUses()) {
+			out << ", ImplicitUses: ";
+			AutoArrayBrackets brackets(out, info.getNumImplicitUses());
+			for (unsigned i = 0; i < info.getNumImplicitUses(); i++) {
+				brackets.comma();
+				printRegister(out, info.getImplicitUses()[i]);
 			}
-			if (info.getNumImplicitUses()) {
-				outs() << ", ImplicitUses: ";
-				AutoArrayBrackets brackets(info.getNumImplicitUses());
-				for (unsigned i = 0; i < info.getNumImplicitUses(); i++) {
-					brackets.comma();
-					printRegister(outs(), info.getImplicitUses()[i]);
+		}
+		if (info.getNumImplicitDefs()) {
+			out << ", ImplicitDefs: ";
+			AutoArrayBrackets brackets(out, info.getNumImplicitDefs());
+			for (unsigned i = 0; i < info.getNumImplicitDefs(); i++) {
+				brackets.comma();
+				printRegister(out, info.getImplicitDefs()[i]);
+			}
+		}
+	}
+
+	void writeRecord(raw_ostream& os, const MCInst& inst, ArrayRef<char> bytes, bool hasFixups, uint8_t flags) const {
+		const MCInstrDesc& info = ii.get(inst.getOpcode());
+		if (hasFixups) {
+			flags |= RecordHasFixups;
+		}
+
+		if (EmitFormatOpt == EmitFormat::Binary) {
+			BinaryRecord record = {};
+			record.input = inputIndex;
+			record.opcode = inst.getOpcode();
+			record.descFlags = info.Flags;
+			record.tsFlags = info.TSFlags;
+			record.schedClass = info.getSchedClass();
+			record.descSize = info.getSize();
+			record.numDefs = info.getNumDefs();
+			record.numOperands = std::min<unsigned>(inst.getNumOperands(), UINT8_MAX);
+			record.numBytes = std::min<size_t>(bytes.size(), MaxRecordBytes);
+			if (inst.getNumOperands() > MaxRecordOperands) {
+				flags |= RecordOperandsTruncated;
+			}
+			if (bytes.size() > MaxRecordBytes) {
+				flags |= RecordBytesTruncated;
+			}
+			record.flags = flags;
+			for (unsigned i = 0; i < std::min<size_t>(inst.getNumOperands(), MaxRecordOperands); i++) {
+				const MCOperand& operand = inst.getOperand(i);
+				RecordOperandKind kind = RecordOperandKind::Invalid;
+				int64_t value = 0;
+				if (!operand.isValid()) {
+				} else if (operand.isReg()) {
+					kind = RecordOperandKind::Reg;
+					value = operand.getReg();
+				} else if (operand.isImm()) {
+					kind = RecordOperandKind::Imm;
+					value = operand.getImm();
+				} else if (operand.isFPImm()) {
+					kind = RecordOperandKind::FPImm;
+					double fp = operand.getFPImm();
+					memcpy(&value, &fp, sizeof(value));
+				} else if (operand.isExpr()) {
+					kind = RecordOperandKind::Expr;
+				} else if (operand.isInst()) {
+					kind = RecordOperandKind::Inst;
 				}
+				record.operandKinds[i] = static_cast<uint8_t>(kind);
+				record.operandValues[i] = value;
 			}
-			if (info.getNumImplicitDefs()) {
-				outs() << ", ImplicitDefs: ";
-				AutoArrayBrackets brackets(info.getNumImplicitDefs());
-				for (unsigned i = 0; i < info.getNumImplicitDefs(); i++) {
-					brackets.comma();
-					printRegister(outs(), info.getImplicitDefs()[i]);
+			memcpy(record.bytes, bytes.data(), record.numBytes);
+			os.write(reinterpret_cast<const char*>(&record), sizeof(record));
+			return;
+		}
+
+		os << "{\"input\":" << inputIndex << ",\"opcode\":" << inst.getOpcode() << ",\"operands\":[";
+		for (unsigned i = 0; i < inst.getNumOperands(); i++) {
+			const MCOperand& operand = inst.getOperand(i);
+			if (i) {
+				os << ',';
+			}
+			if (!operand.isValid()) {
+				os << "[\"invalid\"]";
+			} else if (operand.isReg()) {
+				os << "[\"reg\"," << operand.getReg() << ']';
+			} else if (operand.isImm()) {
+				os << "[\"imm\"," << operand.getImm() << ']';
+			} else if (operand.isFPImm()) {
+				double fp = operand.getFPImm();
+				os << "[\"fpimm\",";
+				if (std::isfinite(fp)) {
+					os << format("%.17g", fp);
+				} else {
+					// JSON has no representation for these
+					os << (std::isnan(fp) ? "\"nan\"" : fp < 0 ? "\"-inf\"" : "\"inf\"");
+				}
+				os << ']';
+			} else if (operand.isExpr()) {
+				std::string str;
+				raw_string_ostream exprOS(str);
+				operand.getExpr()->print(exprOS, ctx.getAsmInfo());
+				os << "[\"expr\",";
+				writeJSONString(os, exprOS.str());
+				os << ']';
+			} else if (operand.isInst()) {
+				os << "[\"inst\"]";
+			} else {
+				os << "[\"unknown\"]";
+			}
+		}
+		os << "],\"size\":" << info.getSize() << ",\"defs\":" << info.getNumDefs();
+		os << ",\"schedClass\":" << info.getSchedClass() << ",\"flags\":" << info.Flags << ",\"tsFlags\":" << info.TSFlags;
+		os << ",\"bytes\":\"";
+		for (uint8_t c : bytes) {
+			printHex(os, c);
+		}
+		os << '"';
+		if (flags & RecordHasFixups) {
+			os << ",\"fixups\":true";
+		}
+		if (flags & RecordTwiddled) {
+			os << ",\"twiddled\":true";
+		}
+		os << "}\n";
+	}
+
+	/// Works out which function an instruction is from by which function labels the streamer has placed so far
+	/// Functions are emitted in module order, so this only ever moves forward
+	int currentFunction() const {
+		while (nextFunction < functionSymbols->size()) {
+			MCSymbol* sym = ctx.lookupSymbol((*functionSymbols)[nextFunction]);
+			if (!sym || sym->isUndefined(false)) {
+				break;
+			}
+			nextFunction++;
+		}
+		return (int)nextFunction - 1;
+	}
+
+	/// Adds inst to the -cost-estimate of the function it's in
+	/// Registers are tracked by unit, and implicit uses and defs count, so flags and sub-registers make dependencies too
+	void estimateCost(const MCInst& inst, const MCSubtargetInfo& sti) const {
+		cost->setFunction(functionSymbols ? currentFunction() : -1);
+		const MCInstrDesc& info = ii.get(inst.getOpcode());
+		SmallVector<unsigned, 16> inputs;
+		SmallVector<unsigned, 16> outputs;
+		auto addUnits = [&](SmallVectorImpl<unsigned>& units, unsigned reg) {
+			if (reg) {
+				for (MCRegUnitIterator unit(reg, &mri); unit.isValid(); ++unit) {
+					units.push_back(*unit);
+				}
+			}
+		};
+		for (unsigned i = 0; i < inst.getNumOperands(); i++) {
+			const MCOperand& operand = inst.getOperand(i);
+			if (operand.isReg()) {
+				addUnits(i < info.getNumDefs() ? outputs : inputs, operand.getReg());
+			}
+		}
+		for (unsigned i = 0; i < info.getNumImplicitUses(); i++) {
+			addUnits(inputs, info.getImplicitUses()[i]);
+		}
+		for (unsigned i = 0; i < info.getNumImplicitDefs(); i++) {
+			addUnits(outputs, info.getImplicitDefs()[i]);
+		}
+
+		int latency = -1;
+		unsigned microOps = 0;
+		SmallVector<CostResourceUse, 4> uses;
+		if (const MCSchedClassDesc* desc = resolveSchedClass(inst, sti)) {
+			latency = std::max(MCSchedModel::computeInstrLatency(sti, *desc), 0);
+			microOps = desc->NumMicroOps;
+			for (const MCWriteProcResEntry* res = sti.getWriteProcResBegin(desc); res != sti.getWriteProcResEnd(desc); ++res) {
+				if (res->Cycles) {
+					uses.push_back({res->ProcResourceIdx, res->Cycles});
 				}
 			}
 		}
-		outs() << "\n";
+		cost->addInst(latency, microOps, uses.data(), uses.size(), inputs.data(), inputs.size(), outputs.data(), outputs.size());
+	}
 
+	void trackRegisters(const MCInst& inst) const {
+		footprint->setFunction(functionSymbols ? currentFunction() : -1);
+		for (const MCOperand& operand : inst) {
+			if (operand.isReg()) {
+				footprint->addRegister(operand.getReg());
+			}
+		}
+		const MCInstrDesc& info = ii.get(inst.getOpcode());
+		for (unsigned i = 0; i < info.getNumImplicitUses(); i++) {
+			footprint->addRegister(info.getImplicitUses()[i]);
+		}
+		for (unsigned i = 0; i < info.getNumImplicitDefs(); i++) {
+			footprint->addRegister(info.getImplicitDefs()[i]);
+		}
+	}
+
+	void captureInstruction(const MCInst& inst, raw_ostream& os, SmallVectorImpl<MCFixup>& fixups, const MCSubtargetInfo& sti) const {
 		SmallVector<char, 32> binout;
-		raw_svector_ostream bos(binout);
-		actual->encodeInstruction(inst, bos, fixups, sti);
-		bos.str(); // flush
+		encode(inst, binout, fixups, sti);
+		countEvent(NumInstsEncoded);
+		countEvent(NumBytesEncoded, binout.size());
+		CapturedInst captured;
+		captured.function = functionSymbols ? currentFunction() : -1;
+		raw_string_ostream desc(captured.desc);
+		descMCInst(desc, inst);
+		desc.flush();
+		captured.bytes.assign(binout.begin(), binout.end());
+		capture->push_back(std::move(captured));
+		os << binout;
+	}
 
-		outs() << "\tResult: ";
-		for (uint8_t c : binout) {
-			printHex(outs(), c);
-			outs() << " ";
+	/// Counts inst for -inst-stats, which replaces its encoding line
+	void addStats(const MCInst& inst, size_t size) const {
+		if (stats->add(inst.getOpcode(), size)) {
+			for (const MCOperand& operand : inst) {
+				stats->addOperand(inst.getOpcode(), operandKindOf(operand));
+			}
 		}
-		outs() << "\n";
+	}
 
-		if (twiddleParams[0] == inst.getOpcode()) {
-			twiddle(inst, fixups, sti);
+	void encodeInstruction(const MCInst& inst, raw_ostream& os, SmallVectorImpl<MCFixup>& fixups, const MCSubtargetInfo& sti) const override {
+		PhaseTimer emissionTimer(Phase::MCEmission);
+		if (cost) {
+			estimateCost(inst, sti);
+		}
+		if (footprint) {
+			trackRegisters(inst);
+		}
+		if (functionStarts) {
+			int function = currentFunction();
+			if (functionStarts->empty() || functionStarts->back().first != function) {
+				functionStarts->push_back({function, out.tell()});
+			}
+		}
+		if (capture) {
+			captureInstruction(inst, os, fixups, sti);
+			return;
+		}
+		DedupShape* shape = nullptr;
+		if (dedup) {
+			dedup->total++;
+			std::string key;
+			makeShapeKey(inst, key);
+			auto inserted = dedup->index.emplace(std::move(key), dedup->shapes.size());
+			if (!inserted.second) {
+				DedupShape& seen = dedup->shapes[inserted.first->second];
+				seen.count++;
+				countEvent(NumInstsEncoded);
+				if (seen.reusable) {
+					countEvent(NumBytesEncoded, seen.bytes.size());
+					if (stats) {
+						addStats(inst, seen.bytes.size());
+					}
+					if (recording) {
+						record(*recording, inst, seen.bytes, 0);
+					}
+					os << seen.bytes;
+					return;
+				}
+				size_t numFixups = fixups.size();
+				SmallVector<char, 32> binout;
+				encode(inst, binout, fixups, sti);
+				countEvent(NumBytesEncoded, binout.size());
+				if (stats) {
+					addStats(inst, binout.size());
+				}
+				if (recording) {
+					record(*recording, inst, binout, fixups.size() != numFixups ? RecordHasFixups : 0);
+				}
+				os << binout;
+				return;
+			}
+			dedup->shapes.push_back({1, {}, {}, false});
+			shape = &dedup->shapes.back();
+			if (EmitFormatOpt == EmitFormat::Text) {
+				// For the summary
+				raw_string_ostream desc(shape->desc);
+				descMCInst(desc, inst);
+				desc.flush();
+			}
+		}
+
+		bool text = EmitFormatOpt == EmitFormat::Text;
+		LineBuilder* line = nullptr;
+		if (text && !stats) {
+			PhaseTimer formatTimer(Phase::OutputFormatting);
+			line = &lineBuffer();
+			appendEncodingLine(*line, inst, sti);
+		}
+
+		size_t numFixups = fixups.size();
+		SmallVector<char, 32> binout;
+		encode(inst, binout, fixups, sti);
+		countEvent(NumInstsEncoded);
+		countEvent(NumBytesEncoded, binout.size());
+
+		if (stats) {
+			addStats(inst, binout.size());
+		} else {
+			PhaseTimer formatTimer(Phase::OutputFormatting);
+			if (text) {
+				line->append("\tResult: ");
+				line->appendHexBytes(reinterpret_cast<const uint8_t*>(binout.data()), binout.size());
+				line->newline();
+				out.write(line->data(), line->size());
+			} else {
+				writeRecord(out, inst, binout, fixups.size() != numFixups, 0);
+			}
+		}
+
+		if (shape) {
+			shape->bytes.assign(binout.begin(), binout.end());
+			shape->reusable = fixups.size() == numFixups;
+		}
+
+		if (recording) {
+			record(*recording, inst, binout, fixups.size() != numFixups ? RecordHasFixups : 0);
+		}
+
+		if (twiddleOpcode == inst.getOpcode()) {
+			twiddle(inst, binout, sti);
+		}
+
+		if (fpImmTableOpcode == inst.getOpcode() && !fpImmTableDone) {
+			fpImmTableDone = true;
+			sweepFPImms(inst, sti);
 		}
 
 		os << binout;
@@ -400,9 +1938,37 @@ public:
 
 MCCodeEmitter *replacementCodeEmitterConstructor(const MCInstrInfo& II, const MCRegisterInfo& MRI, MCContext& Ctx) {
 	std::unique_ptr<MCCodeEmitter> ptr(actualCodeEmitterConstructor(II, MRI, Ctx));
-	return new CodeEmitterWrapper(std::move(ptr), II, MRI, Ctx);
+	EmitterContext fallback = {outs(), 0};
+	return new CodeEmitterWrapper(std::move(ptr), II, MRI, Ctx, emitterContext ? *emitterContext : fallback);
+}
+
+static void printStartupTimes(raw_ostream& os) {
+	static const char* const names[] = {"target initialization", "pass registry", "option parsing", "target machine creation", "IR parsing"};
+	os << "Startup times:\n";
+	for (size_t i = 0; i < (size_t)StartupPhase::Count; i++) {
+		os << "  " << left_justify(names[i], 24) << format("%9.3f ms", startupNanos[i] / 1e6);
+		if (startupCounts[i] == 0) {
+			os << " (skipped)";
+		} else if (startupCounts[i] > 1) {
+			os << " (total of " << startupCounts[i] << ")";
+		}
+		os << '\n';
+	}
 }
 
+/// Object stream for when there's no -o, counts what the object writer emits without keeping any of it
+/// pwrites only patch bytes that were already counted, so they can be dropped too
+class CountingObjectStream : public raw_pwrite_stream {
+	uint64_t pos = 0;
+
+	void write_impl(const char*, size_t size) override { pos += size; }
+	void pwrite_impl(const char*, size_t, uint64_t) override {}
+	uint64_t current_pos() const override { return pos; }
+
+public:
+	CountingObjectStream(): raw_pwrite_stream(true) {}
+};
+
 static std::unique_ptr<ToolOutputFile> GetOutputStream() {
 	// Open the file.
 	std::error_code EC;
@@ -415,39 +1981,1138 @@ static std::unique_ptr<ToolOutputFile> GetOutputStream() {
 	return FDOut;
 }
 
-static void compileModule(LLVMContext& ctx, const Target& target, TargetMachine& tm) {
-	SMDiagnostic err;
-	std::unique_ptr<Module> m = parseIRFile(InputFilename, err, ctx);
+/// Adds f's direct references to other functions (calls, and functions passed around as values) to worklist
+static void addReferencedFunctions(Function& f, std::vector<Function*>& worklist) {
+	for (BasicBlock& bb : f) {
+		for (Instruction& inst : bb) {
+			for (Value* operand : inst.operands()) {
+				if (Function* callee = dyn_cast<Function>(operand->stripPointerCasts())) {
+					worklist.push_back(callee);
+				}
+			}
+		}
+	}
+}
+
+/// Materializes (if needed) the -functions and everything they reference, and drops every other body
+static bool selectFunctions(Module& m, StringRef inputFilename, raw_ostream& diag) {
+	std::vector<Function*> worklist;
+	for (const std::string& name : Functions) {
+		Function* f = m.getFunction(name);
+		if (!f) {
+			WithColor::error(diag, progName) << inputFilename << ": no function named " << name << '\n';
+			return false;
+		}
+		worklist.push_back(f);
+	}
+	std::unordered_set<Function*> keep;
+	while (!worklist.empty()) {
+		Function* f = worklist.back();
+		worklist.pop_back();
+		if (!keep.insert(f).second) {
+			continue;
+		}
+		if (Error e = f->materialize()) {
+			WithColor::error(diag, progName) << inputFilename << ": " << toString(std::move(e)) << '\n';
+			return false;
+		}
+		addReferencedFunctions(*f, worklist);
+	}
+	// Dropping a body that was never loaded also stops it from being materialized
+	for (Function& f : m) {
+		if (!keep.count(&f) && !f.isDeclaration()) {
+			f.deleteBody();
+		}
+	}
+	return true;
+}
+
+/// Parses an input, bitcode is loaded lazily so -functions only reads the bodies it needs
+static std::unique_ptr<Module> loadModule(MemoryBufferRef buffer, StringRef inputFilename, LLVMContext& ctx, raw_ostream& diag) {
+	StartupTimer timer(StartupPhase::IRParsing);
+	PhaseTimer parseTimer(Phase::IRParse, inputFilename);
+	const unsigned char* start = reinterpret_cast<const unsigned char*>(buffer.getBufferStart());
+	const unsigned char* end = reinterpret_cast<const unsigned char*>(buffer.getBufferEnd());
+	std::unique_ptr<Module> m;
+	if (!Functions.empty() && isBitcode(start, end)) {
+		Expected<std::unique_ptr<Module>> lazy = getLazyBitcodeModule(buffer, ctx);
+		if (!lazy) {
+			WithColor::error(diag, progName) << inputFilename << ": " << toString(lazy.takeError()) << '\n';
+			throw exit_exception();
+		}
+		m = std::move(*lazy);
+	} else {
+		SMDiagnostic err;
+		m = parseIR(buffer, err, ctx);
+		if (!m) {
+			err.print(progName, WithColor::error(diag, progName));
+			throw exit_exception();
+		}
+	}
+
+	if (!Functions.empty()) {
+		if (!selectFunctions(*m, inputFilename, diag)) {
+			throw exit_exception();
+		}
+		// Global initializers, metadata and bitcode upgrades still need loading
+		if (Error e = m->materializeAll()) {
+			WithColor::error(diag, progName) << inputFilename << ": " << toString(std::move(e)) << '\n';
+			throw exit_exception();
+		}
+	}
+	return m;
+}
+
+/// Everything on the command line changes what a compile outputs except the inputs, where the object goes, how many threads run,
+/// the caches and the reports, so -cache-dir keys are built from the rest of it rather than a list of options that could fall behind
+static std::string makeCommandFingerprint(ArrayRef<const char*> argv) {
+	// Options left out of the key, all but -time-startup take a value
+	static const StringRef ignored[] = {"input-list", "j", "twiddle-threads", "cache-dir", "cache-policy", "encoding-cache", "serve", "time-startup", "time-report", "time-trace", "mem-report"};
+	BumpPtrAllocator alloc;
+	StringSaver saver(alloc);
+	SmallVector<const char*, 32> args(argv.begin() + 1, argv.end());
+	cl::ExpandResponseFiles(saver, cl::TokenizeGNUCommandLine, args);
+
+	std::string fingerprint;
+	for (size_t i = 0; i < args.size(); i++) {
+		StringRef arg = args[i] ? args[i] : "";
+		if (std::find(InputFilenames.begin(), InputFilenames.end(), arg) != InputFilenames.end()) {
+			continue;
+		}
+		if (arg.size() > 1 && arg[0] == '-') {
+			StringRef name = arg.ltrim('-').split('=').first;
+			bool separateValue = !arg.contains('=');
+			if (name == "o") {
+				// Whether there's an object file changes the output, its path doesn't
+				fingerprint += "-o";
+				fingerprint += '\0';
+				i += separateValue;
+				continue;
+			}
+			if (std::find(std::begin(ignored), std::end(ignored), name) != std::end(ignored)) {
+				i += separateValue && name != "time-startup";
+				continue;
+			}
+		}
+		fingerprint += arg;
+		fingerprint += '\0';
+	}
+	return fingerprint;
+}
+
+/// Everything besides the module and tool that changes what a compile outputs, for -cache-dir keys
+static std::string cacheOptionsFingerprint(uint32_t inputIndex) {
+	if (EmitFormatOpt == EmitFormat::Text) {
+		return commandFingerprint;
+	}
+	// Structured records include the input index
+	return commandFingerprint + "input=" + std::to_string(inputIndex);
+}
+
+/// How often each -dedup instruction was seen, printed after the module's instructions
+static void printDedupSummary(raw_ostream& os, uint32_t inputIndex, const DedupTable& dedup) {
+	if (EmitFormatOpt == EmitFormat::JSONL) {
+		// Counts are in the order the instructions were printed
+		os << "{\"input\":" << inputIndex << ",\"instructions\":" << dedup.total << ",\"unique\":" << dedup.shapes.size() << ",\"counts\":[";
+		for (size_t i = 0; i < dedup.shapes.size(); i++) {
+			os << (i ? "," : "") << dedup.shapes[i].count;
+		}
+		os << "]}\n";
+		return;
+	}
+	os << "Deduplicated " << dedup.total << " instructions to " << dedup.shapes.size() << " unique\n";
+	std::vector<const DedupShape*> repeated;
+	for (const DedupShape& shape : dedup.shapes) {
+		if (shape.count > 1) {
+			repeated.push_back(&shape);
+		}
+	}
+	std::stable_sort(repeated.begin(), repeated.end(), [](const DedupShape* a, const DedupShape* b) { return a->count > b->count; });
+	for (const DedupShape* shape : repeated) {
+		os << "\t" << shape->count << "x " << shape->desc << "\n";
+	}
+}
+
+/// Mangled symbols of the module's defined functions in order, for EmitterContext::functionSymbols, and optionally their IR names
+static void collectFunctionSymbols(const Module& m, std::vector<std::string>& symbols, std::vector<std::string>* names) {
+	Mangler mangler;
+	for (const Function& f : m) {
+		if (f.isDeclaration()) {
+			continue;
+		}
+		SmallString<64> symbol;
+		mangler.getNameWithPrefix(symbol, &f, false);
+		symbols.push_back(symbol.str());
+		if (names) {
+			names->push_back(f.getName());
+		}
+	}
+}
+
+static std::unique_ptr<CostEstimator> makeCostEstimator(const MCSubtargetInfo& sti) {
+	const MCSchedModel& model = sti.getSchedModel();
+	std::vector<CostResource> resources;
+	if (model.hasInstrSchedModel()) {
+		for (unsigned i = 0; i < model.getNumProcResourceKinds(); i++) {
+			const MCProcResourceDesc* res = model.getProcResource(i);
+			resources.push_back({res->Name ? res->Name : "", res->NumUnits});
+		}
+	}
+	return llvm::make_unique<CostEstimator>(std::move(resources), model.IssueWidth);
+}
+
+static void printCostEstimate(raw_ostream& os, uint32_t inputIndex, const std::vector<std::string>& functions, CostEstimator& estimator) {
+	const std::vector<CostResource>& resources = estimator.getResources();
+	for (const FunctionCost& cost : estimator.finish()) {
+		StringRef name = cost.function < 0 ? StringRef("<before first function>") : StringRef(functions[cost.function]);
+		StringRef bottleneck = cost.bottleneck < 0 ? StringRef("issue width") : StringRef(resources[cost.bottleneck].name);
+		if (EmitFormatOpt == EmitFormat::JSONL) {
+			os << "{\"input\":" << inputIndex << ",\"function\":";
+			writeJSONString(os, name);
+			os << ",\"instructions\":" << cost.instructions << ",\"unmodeled\":" << cost.unmodeled << ",\"microOps\":" << cost.microOps;
+			os << ",\"criticalPath\":" << cost.criticalPath << ",\"reciprocalThroughput\":" << format("%.2f", cost.reciprocalThroughput) << ",\"bottleneck\":";
+			writeJSONString(os, bottleneck);
+			os << ",\"resources\":{";
+			bool comma = false;
+			for (size_t i = 0; i < cost.resourceCycles.size(); i++) {
+				if (cost.resourceCycles[i]) {
+					os << (comma ? "," : "");
+					writeJSONString(os, resources[i].name);
+					os << ":" << cost.resourceCycles[i];
+					comma = true;
+				}
+			}
+			os << "}}\n";
+			continue;
+		}
+		os << "Cost of " << name << ": " << cost.instructions << " instructions, " << cost.microOps << " micro-ops, critical path "
+		   << cost.criticalPath << " cycles, reciprocal throughput " << format("%.2f", cost.reciprocalThroughput) << " cycles (bound by " << bottleneck << ")";
+		if (cost.unmodeled) {
+			os << ", " << cost.unmodeled << " not in the sched model";
+		}
+		os << "\n";
+	}
+}
+
+/// Tracks each register as the largest class it's in, so e.g. a 32-bit register is counted in the 32-bit class rather than a class of pairs or halves
+static void buildRegisterSlots(const MCRegisterInfo& mri) {
+	registerSlots.assign(mri.getNumRegs(), RegisterSlot());
+	std::vector<unsigned> classSize(mri.getNumRegs());
+	for (unsigned c = 0; c < mri.getNumRegClasses(); c++) {
+		const MCRegisterClass& rc = mri.getRegClass(c);
+		for (unsigned i = 0; i < rc.getNumRegs(); i++) {
+			unsigned reg = rc.getRegister(i);
+			if (reg < registerSlots.size() && rc.getNumRegs() > classSize[reg]) {
+				registerSlots[reg].regClass = c;
+				registerSlots[reg].index = i;
+				classSize[reg] = rc.getNumRegs();
+			}
+		}
+	}
+}
+
+static StringRef registerInSlot(const MCRegisterInfo& mri, uint32_t regClass, uint32_t index) {
+	return mri.getName(mri.getRegClass(regClass).getRegister(index));
+}
 
-	if (!m) {
-		err.print(progName, WithColor::error(errs(), progName));
+/// Prints each function's footprint and adds it to runFootprint
+static void printRegisterFootprint(raw_ostream& os, uint32_t inputIndex, StringRef inputFilename, const std::vector<std::string>& functions, const RegisterFootprint& footprint, const MCRegisterInfo& mri) {
+	for (const FunctionFootprint& function : footprint.getFunctions()) {
+		StringRef name = function.function < 0 ? StringRef("<before first function>") : StringRef(functions[function.function]);
+		std::vector<RegisterClassUsage> usage = RegisterFootprint::usage(function);
+		if (EmitFormatOpt == EmitFormat::JSONL) {
+			os << "{\"input\":" << inputIndex << ",\"function\":";
+			writeJSONString(os, name);
+			os << ",\"registers\":[";
+			for (size_t i = 0; i < usage.size(); i++) {
+				os << (i ? "," : "") << "{\"class\":";
+				writeJSONString(os, mri.getRegClassName(&mri.getRegClass(usage[i].regClass)));
+				os << ",\"distinct\":" << usage[i].distinct << ",\"highest\":" << usage[i].highest << ",\"highestName\":";
+				writeJSONString(os, registerInSlot(mri, usage[i].regClass, usage[i].highest));
+				os << "}";
+			}
+			os << "]}\n";
+		} else {
+			os << "Registers in " << name << ":";
+			for (size_t i = 0; i < usage.size(); i++) {
+				os << (i ? ";" : "") << " " << mri.getRegClassName(&mri.getRegClass(usage[i].regClass)) << " " << usage[i].distinct
+				   << " used, highest " << registerInSlot(mri, usage[i].regClass, usage[i].highest);
+			}
+			os << (usage.empty() ? " none\n" : "\n");
+		}
+		std::string where = (name + " (" + inputFilename + ")").str();
+		std::lock_guard<std::mutex> guard(runFootprintLock);
+		runFootprint->add(usage, where, (uint64_t)inputIndex << 32 | (uint32_t)(function.function + 1));
+	}
+}
+
+static void printRegisterFootprintSummary(raw_ostream& os, const MCRegisterInfo& mri) {
+	const std::vector<RegisterFootprintSummary::Peak>& peaks = runFootprint->getPeaks();
+	if (EmitFormatOpt == EmitFormat::JSONL) {
+		os << "{\"registerFootprint\":{\"functions\":" << runFootprint->numFunctions() << ",\"classes\":[";
+		bool comma = false;
+		for (unsigned c = 0; c < peaks.size(); c++) {
+			if (!peaks[c].seen) {
+				continue;
+			}
+			os << (comma ? "," : "") << "{\"class\":";
+			writeJSONString(os, mri.getRegClassName(&mri.getRegClass(c)));
+			os << ",\"highest\":" << peaks[c].highest << ",\"highestName\":";
+			writeJSONString(os, registerInSlot(mri, c, peaks[c].highest));
+			os << ",\"highestIn\":";
+			writeJSONString(os, peaks[c].highestWhere);
+			os << ",\"distinct\":" << peaks[c].distinct << ",\"distinctIn\":";
+			writeJSONString(os, peaks[c].distinctWhere);
+			os << "}";
+			comma = true;
+		}
+		os << "]}}\n";
+		return;
+	}
+	os << "Register footprint over " << runFootprint->numFunctions() << " functions:\n";
+	for (unsigned c = 0; c < peaks.size(); c++) {
+		if (peaks[c].seen) {
+			os << "\t" << mri.getRegClassName(&mri.getRegClass(c)) << ": highest " << registerInSlot(mri, c, peaks[c].highest) << " in " << peaks[c].highestWhere
+			   << ", most used " << peaks[c].distinct << " in " << peaks[c].distinctWhere << "\n";
+		}
+	}
+}
+
+static void compileModule(StringRef inputFilename, uint32_t inputIndex, TargetMachine& tm, raw_ostream& out, raw_ostream& diag, std::string* recording) {
+	// Workers report to their own diag, so the lines stay in input order
+	ModuleMemReport memReport(diag, inputFilename);
+	auto buffer = readInput(inputFilename);
+	if (!buffer) {
+		WithColor::error(diag, progName) << inputFilename << ": " << buffer.getError().message() << '\n';
 		throw exit_exception();
 	}
 
+	// -inst-stats, -record and -register-footprint need every module compiled, a cached result doesn't have their data
+	std::string cacheKey;
+	bool useCache = compileCache && !runStats && !recording && !runFootprint;
+	if (useCache) {
+		cacheKey = CompileCache::makeKey({"mtl-gpu-asmcheck", toolIdentity, cacheOptionsFingerprint(inputIndex), (*buffer)->getBuffer()});
+		std::vector<std::string> blobs;
+		if (compileCache->lookup(cacheKey, blobs) && blobs.size() == 2) {
+			countEvent(NumCompileCacheHits);
+			if (!OutputFilename.empty()) {
+				PhaseTimer writeTimer(Phase::OutputWrite, inputFilename);
+				std::unique_ptr<ToolOutputFile> ofile = GetOutputStream();
+				ofile->os() << blobs[0];
+				ofile->keep();
+			}
+			out << blobs[1];
+			return;
+		}
+	}
+
+	LLVMContext ctx;
+	std::unique_ptr<Module> m = loadModule((*buffer)->getMemBufferRef(), inputFilename, ctx, diag);
+
 	StringRef triple = tm.getTargetTriple().getTriple();
 
 	m->setTargetTriple(triple);
 	m->setDataLayout(tm.createDataLayout());
 
+	// With a cache, the object and log are collected so they can be stored as well as output
+	std::string log;
+	raw_string_ostream logStream(log);
+	raw_ostream& logOut = useCache ? logStream : out;
+
+	// Without -o the object is only needed for its size, so it goes to a sink that just counts it
+	// With -o and a cache, it's collected so it can be stored too
+	CountingObjectStream counter;
 	SmallVector<char, 0> binary_out;
 	raw_svector_ostream bos(binary_out);
 	std::unique_ptr<ToolOutputFile> ofile;
-	raw_pwrite_stream* os = &bos;
+	raw_pwrite_stream* os = &counter;
 
 	if (!OutputFilename.empty()) {
 		ofile = GetOutputStream();
-		os = &ofile->os();
+		os = useCache ? static_cast<raw_pwrite_stream*>(&bos) : &ofile->os();
 	}
 
 	legacy::PassManager pm;
 
+	// The code emitter is created inside addPassesToEmitFile and picks up its output stream from here
+	std::unique_ptr<InstStats> stats;
+	if (runStats) {
+		stats = llvm::make_unique<InstStats>(tm.getMCInstrInfo()->getNumOpcodes());
+		stats->addModule();
+	}
+	std::unique_ptr<DedupTable> dedup;
+	if (Dedup) {
+		dedup = llvm::make_unique<DedupTable>();
+	}
+	std::unique_ptr<RecordingWriter> recorder;
+	if (recording) {
+		recorder = llvm::make_unique<RecordingWriter>(*recording);
+		recorder->beginModule(inputIndex, std::string_view(inputFilename.data(), inputFilename.size()));
+	}
+	std::unique_ptr<CostEstimator> cost;
+	if (EstimateCost) {
+		cost = makeCostEstimator(*tm.getMCSubtargetInfo());
+	}
+	std::unique_ptr<RegisterFootprint> footprint;
+	if (runFootprint) {
+		footprint = llvm::make_unique<RegisterFootprint>(registerSlots, tm.getMCRegisterInfo()->getNumRegClasses());
+	}
+	std::vector<std::string> functionSymbols;
+	std::vector<std::string> functionNames;
+	if (cost || footprint) {
+		collectFunctionSymbols(*m, functionSymbols, &functionNames);
+	}
+	EmitterContext emitCtx = {logOut, inputIndex};
+	emitCtx.diag = &diag;
+	emitCtx.stats = stats.get();
+	emitCtx.dedup = dedup.get();
+	emitCtx.recording = recorder.get();
+	emitCtx.cost = cost.get();
+	emitCtx.footprint = footprint.get();
+	if (cost || footprint) {
+		emitCtx.functionSymbols = &functionSymbols;
+	}
+	emitterContext = &emitCtx;
 	tm.addPassesToEmitFile(pm, *os, nullptr, TargetMachine::CodeGenFileType::CGFT_ObjectFile);
+	emitterContext = nullptr;
 
-	pm.run(*m);
+	{
+		PhaseTimer codegenTimer(Phase::Codegen, inputFilename);
+		pm.run(*m);
+	}
+	countEvent(NumModules);
+	countEvent(NumBytesWritten, os->tell());
+
+	if (stats) {
+		std::lock_guard<std::mutex> guard(runStatsLock);
+		runStats->merge(*stats);
+	}
 
 	if (ofile) {
+		PhaseTimer writeTimer(Phase::OutputWrite, inputFilename);
+		if (os != &ofile->os()) {
+			ofile->os() << binary_out;
+		}
 		ofile->keep();
 	}
 
-	outs() << "Assembled " << os->tell() << " bytes" << (ofile ? "" : " (use -o to save)") << "\n";
+	if (dedup) {
+		printDedupSummary(logOut, inputIndex, *dedup);
+	}
+
+	if (cost) {
+		printCostEstimate(logOut, inputIndex, functionNames, *cost);
+	}
+
+	if (footprint) {
+		printRegisterFootprint(logOut, inputIndex, inputFilename, functionNames, *footprint, *tm.getMCRegisterInfo());
+	}
+
+	if (EmitFormatOpt == EmitFormat::Text) {
+		logOut << "Assembled " << os->tell() << " bytes" << (ofile ? "" : " (use -o to save)") << "\n";
+	} else if (EmitFormatOpt == EmitFormat::JSONL) {
+		logOut << "{\"input\":" << inputIndex << ",\"assembled\":" << os->tell() << "}\n";
+	}
+
+	if (useCache) {
+		compileCache->store(cacheKey, {StringRef(binary_out.data(), binary_out.size()), logStream.str()});
+		out << log;
+	}
+}
+
+/// What one -split-module partition printed
+struct SplitPart {
+	std::vector<std::string> functions; ///< Functions defined in the partition
+	std::vector<std::pair<int, uint64_t>> functionStarts; ///< Index into functions and offset into log where its output starts
+	std::string log;
+	uint64_t objectSize = 0;
+};
+
+/// Compiles one input as -split-module partitions on `workers` threads (using the first `workers` machines), then prints each function's output in the input's function order
+static void compileSplitModule(StringRef inputFilename, uint32_t inputIndex, std::vector<std::unique_ptr<TargetMachine>>& machines, unsigned workers, raw_ostream& out, raw_ostream& diag) {
+	auto buffer = readInput(inputFilename);
+	if (!buffer) {
+		WithColor::error(diag, progName) << inputFilename << ": " << buffer.getError().message() << '\n';
+		throw exit_exception();
+	}
+
+	// The partitions share the input's context, which can't be used from several threads, so they're handed to the workers as bitcode
+	std::vector<std::string> functions;
+	std::vector<SmallString<0>> bitcode;
+	{
+		LLVMContext ctx;
+		std::unique_ptr<Module> m = loadModule((*buffer)->getMemBufferRef(), inputFilename, ctx, diag);
+		m->setTargetTriple(machines[0]->getTargetTriple().getTriple());
+		m->setDataLayout(machines[0]->createDataLayout());
+		std::vector<std::string> symbols;
+		collectFunctionSymbols(*m, symbols, &functions);
+		SplitModule(std::move(m), SplitModuleParts, [&](std::unique_ptr<Module> part) {
+			bitcode.emplace_back();
+			raw_svector_ostream os(bitcode.back());
+			WriteBitcodeToFile(*part, os);
+		});
+	}
+
+	std::vector<SplitPart> parts(bitcode.size());
+	bool failed = false;
+	runJobsOrdered(std::min<size_t>(workers, bitcode.size()), bitcode.size(), [&](unsigned worker, size_t index) {
+		JobResult result;
+		raw_string_ostream jobDiag(result.errors);
+		SplitPart& part = parts[index];
+		LLVMContext ctx;
+		Expected<std::unique_ptr<Module>> m = parseBitcodeFile(MemoryBufferRef(StringRef(bitcode[index].data(), bitcode[index].size()), inputFilename), ctx);
+		SmallString<0>().swap(bitcode[index]);
+		if (!m) {
+			WithColor::error(jobDiag, progName) << inputFilename << ": partition " << index << ": " << toString(m.takeError()) << '\n';
+			jobDiag.flush();
+			result.failed = true;
+			return result;
+		}
+
+		std::vector<std::string> symbols;
+		collectFunctionSymbols(**m, symbols, &part.functions);
+		std::unique_ptr<InstStats> stats;
+		if (runStats) {
+			stats = llvm::make_unique<InstStats>(machines[worker]->getMCInstrInfo()->getNumOpcodes());
+		}
+		raw_string_ostream log(part.log);
+		CountingObjectStream os;
+		legacy::PassManager pm;
+		EmitterContext emitCtx = {log, inputIndex};
+		emitCtx.diag = &jobDiag;
+		emitCtx.functionSymbols = &symbols;
+		emitCtx.functionStarts = &part.functionStarts;
+		emitCtx.stats = stats.get();
+		emitterContext = &emitCtx;
+		machines[worker]->addPassesToEmitFile(pm, os, nullptr, TargetMachine::CodeGenFileType::CGFT_ObjectFile);
+		emitterContext = nullptr;
+		{
+			PhaseTimer codegenTimer(Phase::Codegen, inputFilename);
+			pm.run(**m);
+		}
+		countEvent(NumBytesWritten, os.tell());
+		log.flush();
+		part.objectSize = os.tell();
+		if (stats) {
+			std::lock_guard<std::mutex> guard(runStatsLock);
+			runStats->merge(*stats);
+		}
+		return result;
+	}, [&](size_t, JobResult& result) {
+		diag << result.errors;
+		failed |= result.failed;
+	});
+	countEvent(NumModules);
+	if (failed) {
+		throw exit_exception();
+	}
+	if (runStats) {
+		// The partitions' stats were merged in above, but they're all one module
+		std::lock_guard<std::mutex> guard(runStatsLock);
+		runStats->addModule();
+	}
+
+	// Anything before a partition's first function goes first, then every function in input order
+	struct Segment {
+		const SplitPart* part;
+		uint64_t begin;
+		uint64_t end;
+	};
+	StringMap<Segment> byFunction;
+	uint64_t objectSize = 0;
+	for (const SplitPart& part : parts) {
+		objectSize += part.objectSize;
+		uint64_t firstStart = part.functionStarts.empty() ? part.log.size() : part.functionStarts[0].second;
+		out << StringRef(part.log).substr(0, firstStart);
+		for (size_t i = 0; i < part.functionStarts.size(); i++) {
+			const auto& start = part.functionStarts[i];
+			uint64_t end = i + 1 < part.functionStarts.size() ? part.functionStarts[i + 1].second : part.log.size();
+			if (start.first < 0) {
+				out << StringRef(part.log).slice(start.second, end);
+			} else {
+				byFunction[part.functions[start.first]] = {&part, start.second, end};
+			}
+		}
+	}
+	for (const std::string& function : functions) {
+		auto found = byFunction.find(function);
+		if (found != byFunction.end()) {
+			const Segment& segment = found->second;
+			out << StringRef(segment.part->log).slice(segment.begin, segment.end);
+		}
+	}
+
+	if (EmitFormatOpt == EmitFormat::Text) {
+		out << "Assembled " << objectSize << " bytes in " << parts.size() << " partitions\n";
+	} else if (EmitFormatOpt == EmitFormat::JSONL) {
+		out << "{\"input\":" << inputIndex << ",\"assembled\":" << objectSize << ",\"partitions\":" << parts.size() << "}\n";
+	}
+}
+
+static void printCaptured(raw_ostream& os, const CapturedInst* inst) {
+	if (!inst) {
+		os << "(nothing)";
+		return;
+	}
+	os << inst->desc << " => ";
+	for (uint8_t c : inst->bytes) {
+		printHex(os, c);
+		os << " ";
+	}
+	os << "(" << inst->bytes.size() << " bytes)";
+}
+
+/// Lines up one function's instructions on every GPU, each row has an instruction (or null) per GPU
+/// Every GPU is aligned against the first one by opcode and operands, so an instruction only some GPUs have gets its own row
+/// instead of shifting every row after it.  Instructions a GPU has in addition to the first one go before the next shared row.
+static std::vector<std::vector<const CapturedInst*>> alignAcrossGPUs(const std::vector<std::vector<const CapturedInst*>>& perGPU) {
+	const std::vector<const CapturedInst*>& first = perGPU[0];
+	StringMap<uint32_t> ids;
+	auto intern = [&](const std::vector<const CapturedInst*>& insts) {
+		std::vector<uint32_t> result;
+		result.reserve(insts.size());
+		for (const CapturedInst* inst : insts) {
+			result.push_back(ids.insert({inst->desc, (uint32_t)ids.size()}).first->second);
+		}
+		return result;
+	};
+	std::vector<uint32_t> firstIds = intern(first);
+
+	// matched[g][i] is GPU g's instruction lined up with first[i], extra[g][i] the ones it has before first[i]
+	std::vector<std::vector<const CapturedInst*>> matched(perGPU.size(), std::vector<const CapturedInst*>(first.size()));
+	std::vector<std::vector<std::vector<const CapturedInst*>>> extra(perGPU.size(), std::vector<std::vector<const CapturedInst*>>(first.size() + 1));
+	matched[0] = first;
+	for (size_t g = 1; g < perGPU.size(); g++) {
+		std::vector<uint32_t> gpuIds = intern(perGPU[g]);
+		size_t i = 0, j = 0;
+		for (DiffOp op : diffSequences(firstIds.data(), firstIds.size(), gpuIds.data(), gpuIds.size())) {
+			if (op == DiffOp::Equal) {
+				matched[g][i++] = perGPU[g][j++];
+			} else if (op == DiffOp::Delete) {
+				i++;
+			} else {
+				extra[g][i].push_back(perGPU[g][j++]);
+			}
+		}
+	}
+
+	std::vector<std::vector<const CapturedInst*>> rows;
+	for (size_t i = 0; i <= first.size(); i++) {
+		size_t numExtra = 0;
+		for (size_t g = 1; g < perGPU.size(); g++) {
+			numExtra = std::max(numExtra, extra[g][i].size());
+		}
+		for (size_t k = 0; k < numExtra; k++) {
+			std::vector<const CapturedInst*> row(perGPU.size());
+			for (size_t g = 1; g < perGPU.size(); g++) {
+				row[g] = k < extra[g][i].size() ? extra[g][i][k] : nullptr;
+			}
+			rows.push_back(std::move(row));
+		}
+		if (i < first.size()) {
+			std::vector<const CapturedInst*> row(perGPU.size());
+			for (size_t g = 0; g < perGPU.size(); g++) {
+				row[g] = matched[g][i];
+			}
+			rows.push_back(std::move(row));
+		}
+	}
+	return rows;
+}
+
+/// Prints what each GPU emitted, lined up by function and by instruction within the function
+/// GPUs that agree on an instruction are grouped together, so differences in encoding or size stand out
+static void printAcrossGPUs(raw_ostream& os, uint32_t inputIndex, const std::vector<std::string>& gpus, const std::vector<std::string>& functions, const std::vector<std::vector<CapturedInst>>& captured) {
+	// Slot 0 is for anything emitted before the first function
+	std::vector<std::vector<std::vector<const CapturedInst*>>> byFunction(functions.size() + 1, std::vector<std::vector<const CapturedInst*>>(gpus.size()));
+	for (size_t g = 0; g < gpus.size(); g++) {
+		for (const CapturedInst& inst : captured[g]) {
+			byFunction[inst.function + 1][g].push_back(&inst);
+		}
+	}
+
+	for (size_t slot = 0; slot < byFunction.size(); slot++) {
+		const auto& perGPU = byFunction[slot];
+		std::vector<std::vector<const CapturedInst*>> rows = alignAcrossGPUs(perGPU);
+		if (rows.empty()) {
+			continue;
+		}
+		StringRef name = slot == 0 ? StringRef("<before first function>") : StringRef(functions[slot - 1]);
+
+		if (EmitFormatOpt == EmitFormat::Text) {
+			os << name << ":\n";
+			std::vector<size_t> sizes(gpus.size());
+			for (size_t g = 0; g < gpus.size(); g++) {
+				for (const CapturedInst* inst : perGPU[g]) {
+					sizes[g] += inst->bytes.size();
+				}
+			}
+			bool sameShape = true;
+			for (size_t g = 1; g < gpus.size(); g++) {
+				sameShape &= perGPU[g].size() == perGPU[0].size() && sizes[g] == sizes[0];
+			}
+			if (!sameShape) {
+				for (size_t g = 0; g < gpus.size(); g++) {
+					os << "\t" << gpus[g] << ": " << perGPU[g].size() << " instructions, " << sizes[g] << " bytes\n";
+				}
+			}
+		}
+
+		for (size_t row = 0; row < rows.size(); row++) {
+			// Each variant is an encoding and the GPUs that produced it
+			std::vector<std::pair<const CapturedInst*, std::vector<size_t>>> variants;
+			for (size_t g = 0; g < gpus.size(); g++) {
+				const CapturedInst* inst = rows[row][g];
+				auto same = [&](const std::pair<const CapturedInst*, std::vector<size_t>>& variant) {
+					const CapturedInst* other = variant.first;
+					return inst == other || (inst && other && inst->desc == other->desc && inst->bytes == other->bytes);
+				};
+				auto it = std::find_if(variants.begin(), variants.end(), same);
+				if (it == variants.end()) {
+					variants.push_back({inst, {g}});
+				} else {
+					it->second.push_back(g);
+				}
+			}
+
+			if (EmitFormatOpt == EmitFormat::JSONL) {
+				os << "{\"input\":" << inputIndex << ",\"function\":";
+				if (slot == 0) {
+					os << "null";
+				} else {
+					writeJSONString(os, name);
+				}
+				os << ",\"index\":" << row << ",\"variants\":[";
+				for (size_t v = 0; v < variants.size(); v++) {
+					const CapturedInst* inst = variants[v].first;
+					os << (v ? ",{\"gpus\":[" : "{\"gpus\":[");
+					for (size_t i = 0; i < variants[v].second.size(); i++) {
+						os << (i ? "," : "");
+						writeJSONString(os, gpus[variants[v].second[i]]);
+					}
+					os << "],\"inst\":";
+					if (inst) {
+						writeJSONString(os, inst->desc);
+						os << ",\"bytes\":\"";
+						for (uint8_t c : inst->bytes) {
+							printHex(os, c);
+						}
+						os << "\"}";
+					} else {
+						os << "null,\"bytes\":null}";
+					}
+				}
+				os << "]}\n";
+			} else if (variants.size() == 1) {
+				os << "\t#" << row << " ";
+				printCaptured(os, variants[0].first);
+				os << "\n";
+			} else {
+				os << "\t#" << row << " differs:\n";
+				for (const auto& variant : variants) {
+					os << "\t\t";
+					for (size_t i = 0; i < variant.second.size(); i++) {
+						os << (i ? " " : "") << gpus[variant.second[i]];
+					}
+					os << ": ";
+					printCaptured(os, variant.first);
+					os << "\n";
+				}
+			}
+		}
+	}
+}
+
+/// Compiles one input for every GPU in gpus, spreading the GPUs over the given number of workers
+static void compileAcrossGPUs(StringRef inputFilename, uint32_t inputIndex, const std::vector<std::string>& gpus, const std::vector<TargetMachine*>& machines, unsigned workers, raw_ostream& out, raw_ostream& diag) {
+	auto buffer = readInput(inputFilename);
+	if (!buffer) {
+		WithColor::error(diag, progName) << inputFilename << ": " << buffer.getError().message() << '\n';
+		throw exit_exception();
+	}
+
+	std::vector<std::vector<CapturedInst>> captured(gpus.size());
+	std::vector<std::string> functions;
+	bool failed = false;
+	runJobsOrdered(workers, workers, [&](unsigned, size_t index) {
+		JobResult result;
+		raw_string_ostream jobDiag(result.errors);
+		try {
+			// LLVMContexts can't be used from several threads at once, so each worker parses its own copy
+			// and clones that for each of its GPUs, instead of reparsing per GPU
+			LLVMContext ctx;
+			std::unique_ptr<Module> parsed = loadModule((*buffer)->getMemBufferRef(), inputFilename, ctx, jobDiag);
+
+			for (size_t g = index; g < gpus.size(); g += workers) {
+				TargetMachine& tm = *machines[g];
+				// The worker's last GPU can have the parsed module itself
+				std::unique_ptr<Module> m = g + workers < gpus.size() ? CloneModule(*parsed) : std::move(parsed);
+				m->setTargetTriple(tm.getTargetTriple().getTriple());
+				m->setDataLayout(tm.createDataLayout());
+
+				std::vector<std::string> symbols;
+				collectFunctionSymbols(*m, symbols, g == 0 ? &functions : nullptr);
+
+				CountingObjectStream os;
+				legacy::PassManager pm;
+				EmitterContext emitCtx = {nulls(), inputIndex, &captured[g], &symbols};
+				emitterContext = &emitCtx;
+				tm.addPassesToEmitFile(pm, os, nullptr, TargetMachine::CodeGenFileType::CGFT_ObjectFile);
+				emitterContext = nullptr;
+
+				PhaseTimer codegenTimer(Phase::Codegen, inputFilename);
+				pm.run(*m);
+				countEvent(NumModules);
+				countEvent(NumBytesWritten, os.tell());
+			}
+		} catch (exit_exception& e) {
+			result.failed = true;
+		}
+		jobDiag.flush();
+		return result;
+	}, [&](size_t, JobResult& result) {
+		diag << result.errors;
+		failed |= result.failed;
+	});
+	if (failed) {
+		throw exit_exception();
+	}
+
+	printAcrossGPUs(out, inputIndex, gpus, functions, captured);
+}
+
+/// -gpu with more than one GPU: compiles every input once per GPU and prints the encodings side by side
+static bool runInputsAcrossGPUs(const std::vector<std::string>& inputs, const std::vector<std::string>& gpus, raw_ostream& out, raw_ostream& diag) {
+	if (!OutputFilename.empty() || !Twiddle.empty() || !FPImmTableOpt.empty() || EmitFormatOpt == EmitFormat::Binary) {
+		WithColor::error(diag, progName) << "-o, -twiddle, -fp-imm-table and -emit-format=binary can only be used with a single -gpu\n";
+		throw exit_exception();
+	}
+
+	// Each GPU is compiled by one worker at a time, so one TargetMachine per GPU is enough
+	std::vector<TargetMachine*> machines;
+	for (const std::string& gpu : gpus) {
+		auto& pool = machinePool[machinePoolKey(gpu, OptLevel)];
+		if (pool.empty()) {
+			pool.push_back(getAGX2TargetMachine(gpu, OptLevel, diag).second);
+		}
+		machines.push_back(pool[0].get());
+	}
+
+	// Here -j spreads the GPUs of one input over workers, inputs go one after the other
+	unsigned workers = resolveWorkerCount(Jobs, gpus.size());
+	bool failed = false;
+	for (size_t i = 0; i < inputs.size(); i++) {
+		printInputHeader(out, inputs, i);
+		try {
+			compileAcrossGPUs(inputs[i], i, gpus, machines, workers, out, diag);
+		} catch (exit_exception& e) {
+			failed = true;
+		}
+	}
+
+	if (TimeStartup) {
+		printStartupTimes(diag);
+	}
+
+	return !failed;
+}
+
+/// One side of a -diff-* comparison
+struct DiffSide {
+	std::string label;
+	std::vector<std::string> functions;
+	std::vector<CapturedInst> insts;
+};
+
+/// Compiles an input and captures every instruction along with the function it's from
+static void captureCompile(StringRef inputFilename, uint32_t inputIndex, TargetMachine& tm, DiffSide& side, raw_ostream& diag) {
+	auto buffer = readInput(inputFilename);
+	if (!buffer) {
+		WithColor::error(diag, progName) << inputFilename << ": " << buffer.getError().message() << '\n';
+		throw exit_exception();
+	}
+	LLVMContext ctx;
+	std::unique_ptr<Module> m = loadModule((*buffer)->getMemBufferRef(), inputFilename, ctx, diag);
+	m->setTargetTriple(tm.getTargetTriple().getTriple());
+	m->setDataLayout(tm.createDataLayout());
+
+	std::vector<std::string> symbols;
+	collectFunctionSymbols(*m, symbols, &side.functions);
+
+	CountingObjectStream os;
+	legacy::PassManager pm;
+	EmitterContext emitCtx = {nulls(), inputIndex, &side.insts, &symbols};
+	emitterContext = &emitCtx;
+	tm.addPassesToEmitFile(pm, os, nullptr, TargetMachine::CodeGenFileType::CGFT_ObjectFile);
+	emitterContext = nullptr;
+
+	PhaseTimer codegenTimer(Phase::Codegen, inputFilename);
+	pm.run(*m);
+	countEvent(NumModules);
+	countEvent(NumBytesWritten, os.tell());
+}
+
+struct DiffCounts {
+	uint64_t inserted = 0;
+	uint64_t removed = 0;
+	uint64_t reencoded = 0;
+	uint64_t unchanged = 0;
+	uint64_t sizeA = 0;
+	uint64_t sizeB = 0;
+
+	void add(const DiffCounts& other) {
+		inserted += other.inserted;
+		removed += other.removed;
+		reencoded += other.reencoded;
+		unchanged += other.unchanged;
+		sizeA += other.sizeA;
+		sizeB += other.sizeB;
+	}
+};
+
+static void printDiffCounts(raw_ostream& os, uint32_t inputIndex, StringRef name, bool isFunction, const DiffCounts& counts) {
+	if (EmitFormatOpt == EmitFormat::JSONL) {
+		os << "{\"input\":" << inputIndex << (isFunction ? ",\"function\":" : ",\"total\":");
+		writeJSONString(os, name);
+		os << ",\"inserted\":" << counts.inserted << ",\"removed\":" << counts.removed << ",\"reencoded\":" << counts.reencoded
+		   << ",\"unchanged\":" << counts.unchanged << ",\"sizeA\":" << counts.sizeA << ",\"sizeB\":" << counts.sizeB << "}\n";
+		return;
+	}
+	int64_t delta = (int64_t)counts.sizeB - (int64_t)counts.sizeA;
+	os << name << ": " << counts.inserted << " inserted, " << counts.removed << " removed, " << counts.reencoded << " re-encoded, "
+	   << counts.unchanged << " unchanged, " << counts.sizeA << " -> " << counts.sizeB << " bytes (" << (delta >= 0 ? "+" : "") << delta << ")\n";
+}
+
+static void printDiffChange(raw_ostream& os, uint32_t inputIndex, StringRef function, char change, size_t indexA, const CapturedInst* a, size_t indexB, const CapturedInst* b) {
+	if (EmitFormatOpt == EmitFormat::JSONL) {
+		const char* kind = change == '+' ? "insert" : change == '-' ? "remove" : "reencode";
+		os << "{\"input\":" << inputIndex << ",\"function\":";
+		writeJSONString(os, function);
+		os << ",\"change\":\"" << kind << "\",\"a\":";
+		if (a) {
+			os << indexA;
+		} else {
+			os << "null";
+		}
+		os << ",\"b\":";
+		if (b) {
+			os << indexB;
+		} else {
+			os << "null";
+		}
+		os << ",\"inst\":";
+		writeJSONString(os, (a ? a : b)->desc);
+		if (a) {
+			os << ",\"bytesA\":\"";
+			for (uint8_t c : a->bytes) {
+				printHex(os, c);
+			}
+			os << '"';
+		}
+		if (b) {
+			os << ",\"bytesB\":\"";
+			for (uint8_t c : b->bytes) {
+				printHex(os, c);
+			}
+			os << '"';
+		}
+		os << "}\n";
+		return;
+	}
+	os << "\t" << change << " ";
+	if (change == '~') {
+		os << "#" << indexA << "/#" << indexB << " ";
+		printCaptured(os, a);
+		os << " -> ";
+		for (uint8_t c : b->bytes) {
+			printHex(os, c);
+			os << " ";
+		}
+		os << "(" << b->bytes.size() << " bytes)";
+	} else {
+		os << "#" << (a ? indexA : indexB) << " ";
+		printCaptured(os, a ? a : b);
+	}
+	os << "\n";
+}
+
+/// Lines up each function's instructions on both sides by opcode and operands and prints what changed
+static void printDiff(raw_ostream& os, uint32_t inputIndex, const DiffSide& a, const DiffSide& b) {
+	// Functions are matched by name, in a's order followed by any that are only in b
+	std::vector<std::string> names;
+	StringMap<std::pair<int, int>> functionSlots;
+	functionSlots["<before first function>"] = {-1, -1};
+	names.push_back("<before first function>");
+	for (size_t i = 0; i < a.functions.size(); i++) {
+		if (functionSlots.insert({a.functions[i], {(int)i, -2}}).second) {
+			names.push_back(a.functions[i]);
+		}
+	}
+	for (size_t i = 0; i < b.functions.size(); i++) {
+		auto inserted = functionSlots.insert({b.functions[i], {-2, (int)i}});
+		if (inserted.second) {
+			names.push_back(b.functions[i]);
+		} else {
+			inserted.first->second.second = i;
+		}
+	}
+
+	auto byFunction = [](const DiffSide& side) {
+		std::vector<std::vector<const CapturedInst*>> grouped(side.functions.size() + 1);
+		for (const CapturedInst& inst : side.insts) {
+			grouped[inst.function + 1].push_back(&inst);
+		}
+		return grouped;
+	};
+	std::vector<std::vector<const CapturedInst*>> instsA = byFunction(a);
+	std::vector<std::vector<const CapturedInst*>> instsB = byFunction(b);
+
+	// Instructions are compared as interned ids, so the alignment only compares integers
+	StringMap<uint32_t> ids;
+	auto intern = [&](const std::vector<const CapturedInst*>& insts) {
+		std::vector<uint32_t> result;
+		result.reserve(insts.size());
+		for (const CapturedInst* inst : insts) {
+			result.push_back(ids.insert({inst->desc, (uint32_t)ids.size()}).first->second);
+		}
+		return result;
+	};
+
+	static const std::vector<const CapturedInst*> none;
+	DiffCounts total;
+	for (const std::string& name : names) {
+		std::pair<int, int> slots = functionSlots[name];
+		const std::vector<const CapturedInst*>& fa = slots.first >= -1 ? instsA[slots.first + 1] : none;
+		const std::vector<const CapturedInst*>& fb = slots.second >= -1 ? instsB[slots.second + 1] : none;
+		if (fa.empty() && fb.empty()) {
+			continue;
+		}
+		if (EmitFormatOpt == EmitFormat::Text) {
+			if (slots.first < -1) {
+				os << "==> " << name << " (only in " << b.label << ") <==\n";
+			} else if (slots.second < -1) {
+				os << "==> " << name << " (only in " << a.label << ") <==\n";
+			} else {
+				os << "==> " << name << " <==\n";
+			}
+		}
+
+		std::vector<uint32_t> idsA = intern(fa);
+		std::vector<uint32_t> idsB = intern(fb);
+		DiffCounts counts;
+		size_t i = 0, j = 0;
+		for (DiffOp op : diffSequences(idsA.data(), idsA.size(), idsB.data(), idsB.size())) {
+			if (op == DiffOp::Delete) {
+				counts.removed++;
+				counts.sizeA += fa[i]->bytes.size();
+				printDiffChange(os, inputIndex, name, '-', i, fa[i], 0, nullptr);
+				i++;
+			} else if (op == DiffOp::Insert) {
+				counts.inserted++;
+				counts.sizeB += fb[j]->bytes.size();
+				printDiffChange(os, inputIndex, name, '+', 0, nullptr, j, fb[j]);
+				j++;
+			} else {
+				counts.sizeA += fa[i]->bytes.size();
+				counts.sizeB += fb[j]->bytes.size();
+				if (fa[i]->bytes != fb[j]->bytes) {
+					counts.reencoded++;
+					printDiffChange(os, inputIndex, name, '~', i, fa[i], j, fb[j]);
+				} else {
+					counts.unchanged++;
+				}
+				i++;
+				j++;
+			}
+		}
+		printDiffCounts(os, inputIndex, name, true, counts);
+		total.add(counts);
+	}
+	printDiffCounts(os, inputIndex, a.label + " vs " + b.label, false, total);
+}
+
+/// -diff-input, -diff-O and -diff-gpu: compiles each input and what it's compared against (in parallel with -j), then prints the differences
+static bool runDiff(const std::vector<std::string>& inputs, StringRef gpu, raw_ostream& out, raw_ostream& diag) {
+	if (!OutputFilename.empty() || !Twiddle.empty() || !FPImmTableOpt.empty() || EmitFormatOpt == EmitFormat::Binary) {
+		WithColor::error(diag, progName) << "-o, -twiddle, -fp-imm-table and -emit-format=binary can't be used with -diff-input, -diff-O or -diff-gpu\n";
+		throw exit_exception();
+	}
+	if (!DiffInput.empty() && inputs.size() != 1) {
+		WithColor::error(diag, progName) << "-diff-input can only be used with a single input\n";
+		throw exit_exception();
+	}
+
+	// Each side needs its own TargetMachine since they may be compiled at the same time, even if both use the same GPU and -O
+	char optB = DiffOptLevel ? DiffOptLevel : OptLevel;
+	std::string gpuB = DiffGPU.empty() ? gpu.str() : DiffGPU.getValue();
+	auto& poolA = machinePool[machinePoolKey(gpu, OptLevel)];
+	if (poolA.empty()) {
+		poolA.push_back(getAGX2TargetMachine(gpu, OptLevel, diag).second);
+	}
+	auto& poolB = machinePool[machinePoolKey(gpuB, optB)];
+	size_t indexB = &poolA == &poolB ? 1 : 0;
+	while (poolB.size() <= indexB) {
+		poolB.push_back(getAGX2TargetMachine(gpuB, optB, diag).second);
+	}
+	TargetMachine* machines[2] = {poolA[0].get(), poolB[indexB].get()};
+
+	auto describe = [](StringRef input, StringRef gpu, char optLevel) {
+		std::string label = input;
+		label += " (" + gpu.str();
+		if (optLevel != ' ') {
+			label += std::string(" -O") + optLevel;
+		}
+		return label + ")";
+	};
+
+	// Both sides can read "-", so outside of -serve stdin is read once and handed to both like a request's input
+	static std::string diffStdin;
+	bool readsStdin = DiffInput == "-" || std::find(inputs.begin(), inputs.end(), "-") != inputs.end();
+	if (readsStdin && !requestStdin) {
+		ErrorOr<std::unique_ptr<MemoryBuffer>> buffer = MemoryBuffer::getSTDIN();
+		if (!buffer) {
+			WithColor::error(diag, progName) << "<stdin>: " << buffer.getError().message() << '\n';
+			throw exit_exception();
+		}
+		diffStdin = (*buffer)->getBuffer();
+		requestStdin = &diffStdin;
+	}
+
+	bool failed = false;
+	for (size_t i = 0; i < inputs.size(); i++) {
+		printInputHeader(out, inputs, i);
+		StringRef inputB = DiffInput.empty() ? StringRef(inputs[i]) : StringRef(DiffInput);
+		DiffSide sides[2];
+		sides[0].label = describe(inputs[i], gpu, OptLevel);
+		sides[1].label = describe(inputB, gpuB, optB);
+		bool inputFailed = false;
+		runJobsOrdered(resolveWorkerCount(Jobs.getNumOccurrences() ? Jobs : 0, 2), 2, [&](unsigned, size_t side) {
+			JobResult result;
+			raw_string_ostream jobDiag(result.errors);
+			try {
+				captureCompile(side ? inputB : StringRef(inputs[i]), i, *machines[side], sides[side], jobDiag);
+			} catch (exit_exception& e) {
+				result.failed = true;
+			}
+			jobDiag.flush();
+			return result;
+		}, [&](size_t, JobResult& result) {
+			diag << result.errors;
+			inputFailed |= result.failed;
+		});
+		if (inputFailed) {
+			failed = true;
+			continue;
+		}
+		printDiff(out, i, sides[0], sides[1]);
+	}
+	if (requestStdin == &diffStdin) {
+		requestStdin = nullptr;
+	}
+
+	if (TimeStartup) {
+		printStartupTimes(diag);
+	}
+
+	return !failed;
 }
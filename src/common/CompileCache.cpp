@@ -0,0 +1,129 @@
+#include "CompileCache.h"
+
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/SHA1.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <dlfcn.h>
+
+using namespace llvm;
+
+static const char EntryMagic[8] = {'M', 'T', 'L', 'C', 'C', 'E', '0', '1'};
+
+std::unique_ptr<CompileCache> CompileCache::open(StringRef dir, StringRef policyStr, std::string& error) {
+	Expected<CachePruningPolicy> policy = parseCachePruningPolicy(policyStr);
+	if (!policy) {
+		error = toString(policy.takeError());
+		return nullptr;
+	}
+	if (std::error_code ec = sys::fs::create_directories(dir)) {
+		error = (dir + ": " + ec.message()).str();
+		return nullptr;
+	}
+	return std::unique_ptr<CompileCache>(new CompileCache(dir, *policy));
+}
+
+std::string CompileCache::makeKey(ArrayRef<StringRef> parts) {
+	SHA1 hasher;
+	for (StringRef part : parts) {
+		// Length prefix so ("ab", "c") and ("a", "bc") don't collide
+		uint8_t len[8];
+		support::endian::write64le(len, part.size());
+		hasher.update(len);
+		hasher.update(part);
+	}
+	return toHex(hasher.final());
+}
+
+static std::string fileIdentity(StringRef path) {
+	sys::fs::file_status status;
+	if (path.empty() || sys::fs::status(path, status)) {
+		return "unknown";
+	}
+	return (path + ":" + Twine(status.getSize()) + ":" + Twine(status.getLastModificationTime().time_since_epoch().count())).str();
+}
+
+std::string CompileCache::toolIdentity(const char* argv0, void* mainAddr) {
+	std::string identity = fileIdentity(sys::fs::getMainExecutable(argv0, mainAddr));
+	Dl_info info;
+	if (dladdr(reinterpret_cast<void*>(&parseCachePruningPolicy), &info) && info.dli_fname) {
+		identity += ";" + fileIdentity(info.dli_fname);
+	}
+	return identity;
+}
+
+std::string CompileCache::entryPath(StringRef key) const {
+	SmallString<128> path(dir);
+	sys::path::append(path, "llvmcache-" + key);
+	return path.str();
+}
+
+bool CompileCache::lookup(StringRef key, std::vector<std::string>& blobs) const {
+	auto buffer = MemoryBuffer::getFile(entryPath(key), -1, false);
+	if (!buffer) {
+		return false;
+	}
+	StringRef data = (*buffer)->getBuffer();
+	if (data.size() < sizeof(EntryMagic) + 8 || !data.startswith(StringRef(EntryMagic, sizeof(EntryMagic)))) {
+		return false;
+	}
+	data = data.drop_front(sizeof(EntryMagic));
+	uint64_t count = support::endian::read64le(data.data());
+	data = data.drop_front(8);
+	blobs.clear();
+	for (uint64_t i = 0; i < count; i++) {
+		if (data.size() < 8) {
+			return false;
+		}
+		uint64_t size = support::endian::read64le(data.data());
+		data = data.drop_front(8);
+		if (data.size() < size) {
+			return false;
+		}
+		blobs.push_back(data.take_front(size));
+		data = data.drop_front(size);
+	}
+	return true;
+}
+
+void CompileCache::store(StringRef key, ArrayRef<StringRef> blobs) const {
+	// Write somewhere else and rename into place, so readers never see a partial entry
+	// The temporary doesn't start with llvmcache- so pruning won't count it
+	SmallString<128> model(dir);
+	sys::path::append(model, "tmp-%%%%%%%%%%%%");
+	int fd;
+	SmallString<128> tmpPath;
+	if (sys::fs::createUniqueFile(model, fd, tmpPath)) {
+		return;
+	}
+	{
+		raw_fd_ostream os(fd, true);
+		uint8_t len[8];
+		os.write(EntryMagic, sizeof(EntryMagic));
+		support::endian::write64le(len, blobs.size());
+		os.write(reinterpret_cast<const char*>(len), sizeof(len));
+		for (StringRef blob : blobs) {
+			support::endian::write64le(len, blob.size());
+			os.write(reinterpret_cast<const char*>(len), sizeof(len));
+			os << blob;
+		}
+		os.close();
+		if (os.has_error()) {
+			os.clear_error();
+			sys::fs::remove(tmpPath);
+			return;
+		}
+	}
+	if (sys::fs::rename(tmpPath, entryPath(key))) {
+		sys::fs::remove(tmpPath);
+	}
+}
+
+void CompileCache::prune() const {
+	pruneCache(dir, policy);
+}
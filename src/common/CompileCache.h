@@ -0,0 +1,41 @@
+#pragma once
+
+// Content addressed cache of whole-module compile results, shared by mtl-gpu-asmcheck and mtl-gpu-llc
+// Entries are llvmcache-<key> files in a directory, so size limits and eviction can use llvm::pruneCache
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/CachePruning.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+class CompileCache {
+	std::string dir;
+	llvm::CachePruningPolicy policy;
+
+	CompileCache(llvm::StringRef dir, llvm::CachePruningPolicy policy): dir(dir), policy(policy) {}
+	std::string entryPath(llvm::StringRef key) const;
+
+public:
+	/// Opens (creating if needed) a cache directory, policy uses the llvm::parseCachePruningPolicy syntax
+	/// Returns nullptr and sets error on failure
+	static std::unique_ptr<CompileCache> open(llvm::StringRef dir, llvm::StringRef policy, std::string& error);
+
+	/// Hashes together everything that affects a compile result into a key
+	static std::string makeKey(llvm::ArrayRef<llvm::StringRef> parts);
+
+	/// Identifies the running tool binary and the libLLVM it loaded, for including in keys
+	/// so entries made by a different build (or after a macOS update) aren't reused
+	static std::string toolIdentity(const char* argv0, void* mainAddr);
+
+	/// Loads the blobs stored under key, returns false on a miss
+	bool lookup(llvm::StringRef key, std::vector<std::string>& blobs) const;
+
+	/// Stores blobs under key, safe to call from several threads or processes at once
+	void store(llvm::StringRef key, llvm::ArrayRef<llvm::StringRef> blobs) const;
+
+	/// Evicts entries according to the pruning policy
+	void prune() const;
+};
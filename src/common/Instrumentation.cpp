@@ -0,0 +1,393 @@
+#include "Instrumentation.h"
+#include "JSON.h"
+
+#include "llvm/Pass.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/WithColor.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <sys/resource.h>
+#include <time.h>
+
+#ifndef MTL_ALLOC_HOOKS
+#define MTL_ALLOC_HOOKS 1
+#endif
+
+using namespace llvm;
+
+static cl::opt<std::string> TimeReport("time-report",
+	cl::desc("Write per-phase wall and CPU times, per-pass timings and counters to this JSON file"),
+	cl::value_desc("filename"),
+	cl::init(""));
+
+static cl::opt<std::string> TimeTrace("time-trace",
+	cl::desc("Write a Chrome trace-event file (for chrome://tracing or Perfetto) of each phase to this file"),
+	cl::value_desc("filename"),
+	cl::init(""));
+
+static cl::opt<std::string> MemReport("mem-report",
+	cl::desc("Write allocations and peak RSS growth per phase, malloc usage per pass and a line per module to this JSON file, and print the module lines to stderr as they finish"),
+	cl::value_desc("filename"),
+	cl::init(""));
+
+bool instrumentationEnabled = false;
+bool memReportEnabled = false;
+
+static const char* const PhaseNames[] = {"ir-parse", "verify", "codegen", "mc-emission", "output-formatting", "output-write", "object-load", "disassembly"};
+static_assert(sizeof(PhaseNames) / sizeof(*PhaseNames) == (size_t)Phase::Count, "Every phase needs a name");
+
+// Phases run on several worker threads at once, so these are plain atomics instead of llvm::Timers (which can't be started on two threads at once)
+struct PhaseTotals {
+	std::atomic<uint64_t> count{0};
+	std::atomic<uint64_t> wallNanos{0};
+	std::atomic<uint64_t> cpuNanos{0};
+	std::atomic<uint64_t> allocs{0};
+	std::atomic<uint64_t> allocBytes{0};
+	std::atomic<uint64_t> maxRSSGrowth{0}; ///< Largest growth of the process' peak RSS during one run of the phase
+};
+
+struct ModuleMem {
+	std::string input;
+	AllocationCount allocs;
+	uint64_t peakRSS;
+};
+
+struct TraceEvent {
+	Phase phase;
+	uint32_t thread;
+	int64_t start;
+	int64_t duration;
+	std::string detail;
+};
+
+static std::string instrumentedTool;
+static bool tracing = false;
+static bool userTimePasses = false;
+static int64_t traceEpoch;
+static PhaseTotals phaseTotals[(size_t)Phase::Count];
+static std::mutex traceLock;
+static std::vector<TraceEvent> traceEvents;
+static bool userTrackMemory = false;
+static std::mutex moduleMemLock;
+static std::vector<ModuleMem> moduleMems;
+
+// Read on every allocation, so it's separate from memReportEnabled and only ever loaded relaxed
+static std::atomic<bool> countingAllocations{false};
+static thread_local AllocationCount threadAllocs;
+
+#if MTL_ALLOC_HOOKS
+/// Allocates like the standard operator new does: retries through the installed new_handler, and throws bad_alloc once there isn't one
+static void* countedAlloc(size_t size, size_t alignment = alignof(std::max_align_t)) {
+	if (countingAllocations.load(std::memory_order_relaxed)) {
+		threadAllocs.count++;
+		threadAllocs.bytes += size;
+	}
+	size = size ? size : 1;
+	while (true) {
+		void* ptr = nullptr;
+		if (alignment <= alignof(std::max_align_t)) {
+			ptr = malloc(size);
+		} else if (posix_memalign(&ptr, alignment, size) != 0) {
+			ptr = nullptr;
+		}
+		if (ptr) {
+			return ptr;
+		}
+		std::new_handler handler = std::get_new_handler();
+		if (!handler) {
+			throw std::bad_alloc();
+		}
+		handler();
+	}
+}
+
+static void* countedAllocNothrow(size_t size, size_t alignment = alignof(std::max_align_t)) noexcept {
+	try {
+		return countedAlloc(size, alignment);
+	} catch (const std::bad_alloc&) {
+		return nullptr;
+	}
+}
+
+void* operator new(size_t size) { return countedAlloc(size); }
+void* operator new[](size_t size) { return countedAlloc(size); }
+void* operator new(size_t size, const std::nothrow_t&) noexcept { return countedAllocNothrow(size); }
+void* operator new[](size_t size, const std::nothrow_t&) noexcept { return countedAllocNothrow(size); }
+void* operator new(size_t size, std::align_val_t alignment) { return countedAlloc(size, (size_t)alignment); }
+void* operator new[](size_t size, std::align_val_t alignment) { return countedAlloc(size, (size_t)alignment); }
+void* operator new(size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept { return countedAllocNothrow(size, (size_t)alignment); }
+void* operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept { return countedAllocNothrow(size, (size_t)alignment); }
+// posix_memalign memory is freed with free() too, so every delete is the same
+void operator delete(void* ptr) noexcept { free(ptr); }
+void operator delete[](void* ptr) noexcept { free(ptr); }
+void operator delete(void* ptr, size_t) noexcept { free(ptr); }
+void operator delete[](void* ptr, size_t) noexcept { free(ptr); }
+void operator delete(void* ptr, const std::nothrow_t&) noexcept { free(ptr); }
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept { free(ptr); }
+void operator delete(void* ptr, std::align_val_t) noexcept { free(ptr); }
+void operator delete[](void* ptr, std::align_val_t) noexcept { free(ptr); }
+void operator delete(void* ptr, size_t, std::align_val_t) noexcept { free(ptr); }
+void operator delete[](void* ptr, size_t, std::align_val_t) noexcept { free(ptr); }
+void operator delete(void* ptr, std::align_val_t, const std::nothrow_t&) noexcept { free(ptr); }
+void operator delete[](void* ptr, std::align_val_t, const std::nothrow_t&) noexcept { free(ptr); }
+#endif
+
+AllocationCount threadAllocations() {
+	return threadAllocs;
+}
+
+uint64_t peakRSSBytes() {
+	rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0) {
+		return 0;
+	}
+#ifdef __APPLE__
+	return usage.ru_maxrss;
+#else
+	return (uint64_t)usage.ru_maxrss * 1024;
+#endif
+}
+
+static int64_t wallNanos() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static int64_t threadCPUNanos() {
+	timespec ts;
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0) {
+		return 0;
+	}
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/// Small sequential thread ids, so the trace viewer shows one row per worker
+static uint32_t traceThreadID() {
+	static std::atomic<uint32_t> next{1};
+	thread_local uint32_t id = next++;
+	return id;
+}
+
+void PhaseTimer::start() {
+	startWall = wallNanos();
+	startCPU = isPerInstructionPhase(phase) ? 0 : threadCPUNanos();
+	if (memReportEnabled) {
+		startAllocs = threadAllocs;
+		startPeakRSS = isPerInstructionPhase(phase) ? 0 : peakRSSBytes();
+	}
+}
+
+void PhaseTimer::finish() {
+	int64_t wall = wallNanos() - startWall;
+	PhaseTotals& totals = phaseTotals[(size_t)phase];
+	totals.count++;
+	totals.wallNanos += wall;
+	if (memReportEnabled) {
+		totals.allocs += threadAllocs.count - startAllocs.count;
+		totals.allocBytes += threadAllocs.bytes - startAllocs.bytes;
+	}
+	if (isPerInstructionPhase(phase)) {
+		return;
+	}
+	totals.cpuNanos += threadCPUNanos() - startCPU;
+	if (memReportEnabled) {
+		uint64_t growth = peakRSSBytes() - startPeakRSS;
+		uint64_t seen = totals.maxRSSGrowth;
+		while (growth > seen && !totals.maxRSSGrowth.compare_exchange_weak(seen, growth)) {}
+	}
+	if (tracing) {
+		TraceEvent event = {phase, traceThreadID(), startWall - traceEpoch, wall, detail};
+		std::lock_guard<std::mutex> guard(traceLock);
+		traceEvents.push_back(std::move(event));
+	}
+}
+
+/// LLVM's -track-memory, which makes the pass timers record malloc usage too
+static cl::opt<bool>* trackMemoryOption() {
+	StringMap<cl::Option*>& options = cl::getRegisteredOptions();
+	auto it = options.find("track-memory");
+	return it == options.end() ? nullptr : static_cast<cl::opt<bool>*>(it->second);
+}
+
+void ModuleMemReport::finish() {
+	AllocationCount now = threadAllocs;
+	ModuleMem mem = {input, {now.count - start.count, now.bytes - start.bytes}, peakRSSBytes()};
+	os << "Memory for " << input << ": " << mem.allocs.count << " allocations, " << format("%.1f MiB", mem.allocs.bytes / 1048576.0)
+	   << " allocated, peak RSS " << format("%.1f MiB", mem.peakRSS / 1048576.0) << "\n";
+	std::lock_guard<std::mutex> guard(moduleMemLock);
+	moduleMems.push_back(std::move(mem));
+}
+
+void initializeInstrumentation(StringRef toolName) {
+	instrumentationEnabled = !TimeReport.empty() || !TimeTrace.empty() || !MemReport.empty();
+	if (!instrumentationEnabled) {
+		return;
+	}
+	instrumentedTool = toolName;
+	tracing = !TimeTrace.empty();
+	traceEpoch = wallNanos();
+	memReportEnabled = !MemReport.empty();
+	if (!TimeReport.empty() || memReportEnabled) {
+		// STATISTICs only register (and show up in the report) once statistics are enabled
+		EnableStatistics(false);
+		userTimePasses = TimePassesIsEnabled;
+		TimePassesIsEnabled = true;
+	}
+	if (memReportEnabled) {
+		countingAllocations = true;
+		if (cl::opt<bool>* trackMemory = trackMemoryOption()) {
+			userTrackMemory = trackMemory->getValue();
+			trackMemory->setValue(true);
+		}
+	}
+}
+
+void writeJSONString(raw_ostream& os, StringRef str) {
+	static thread_local std::string quoted;
+	quoted.clear();
+	appendJSONString(quoted, std::string_view(str.data(), str.size()));
+	os << quoted;
+}
+
+static bool writeReport(StringRef path) {
+	std::error_code ec;
+	raw_fd_ostream os(path, ec, sys::fs::F_Text);
+	if (ec) {
+		WithColor::error(errs(), instrumentedTool) << path << ": " << ec.message() << '\n';
+		return false;
+	}
+	os << "{\n\t\"tool\": ";
+	writeJSONString(os, instrumentedTool);
+	os << ",\n\t\"phases\": {";
+	const char* delim = "\n";
+	for (size_t i = 0; i < (size_t)Phase::Count; i++) {
+		const PhaseTotals& totals = phaseTotals[i];
+		if (!totals.count) {
+			continue;
+		}
+		os << delim << "\t\t\"" << PhaseNames[i] << "\": {\"count\": " << totals.count.load();
+		os << format(", \"wall_ms\": %.3f", totals.wallNanos / 1e6);
+		if (!isPerInstructionPhase((Phase)i)) {
+			os << format(", \"cpu_ms\": %.3f", totals.cpuNanos / 1e6);
+		}
+		os << "}";
+		delim = ",\n";
+	}
+	// Statistics, plus the per-pass timers collected because of TimePassesIsEnabled
+	os << "\n\t},\n\t\"llvm\": ";
+	PrintStatisticsJSON(os);
+	os << "}\n";
+	return true;
+}
+
+static bool writeMemReport(StringRef path) {
+	std::error_code ec;
+	raw_fd_ostream os(path, ec, sys::fs::F_Text);
+	if (ec) {
+		WithColor::error(errs(), instrumentedTool) << path << ": " << ec.message() << '\n';
+		return false;
+	}
+	os << "{\n\t\"tool\": ";
+	writeJSONString(os, instrumentedTool);
+	os << ",\n\t\"peak_rss_bytes\": " << peakRSSBytes() << ",\n\t\"phases\": {";
+	const char* delim = "\n";
+	for (size_t i = 0; i < (size_t)Phase::Count; i++) {
+		const PhaseTotals& totals = phaseTotals[i];
+		if (!totals.count) {
+			continue;
+		}
+		os << delim << "\t\t\"" << PhaseNames[i] << "\": {\"count\": " << totals.count.load();
+		os << ", \"allocations\": " << totals.allocs.load() << ", \"allocated_bytes\": " << totals.allocBytes.load();
+		if (!isPerInstructionPhase((Phase)i)) {
+			os << ", \"max_peak_rss_growth_bytes\": " << totals.maxRSSGrowth.load();
+		}
+		os << "}";
+		delim = ",\n";
+	}
+	os << "\n\t},\n\t\"modules\": [";
+	delim = "\n";
+	for (const ModuleMem& mem : moduleMems) {
+		os << delim << "\t\t{\"input\": ";
+		writeJSONString(os, mem.input);
+		os << ", \"allocations\": " << mem.allocs.count << ", \"allocated_bytes\": " << mem.allocs.bytes << ", \"peak_rss_bytes\": " << mem.peakRSS << "}";
+		delim = ",\n";
+	}
+	// The pass timers' .mem entries are the change in malloc usage over each pass, from -track-memory
+	os << "\n\t],\n\t\"llvm\": ";
+	PrintStatisticsJSON(os);
+	os << "}\n";
+	return true;
+}
+
+static bool writeTrace(StringRef path) {
+	std::error_code ec;
+	raw_fd_ostream os(path, ec, sys::fs::F_Text);
+	if (ec) {
+		WithColor::error(errs(), instrumentedTool) << path << ": " << ec.message() << '\n';
+		return false;
+	}
+	os << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+	os << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":";
+	writeJSONString(os, instrumentedTool);
+	os << "}}";
+	for (const TraceEvent& event : traceEvents) {
+		os << ",\n{\"name\":\"" << PhaseNames[(size_t)event.phase] << "\",\"cat\":\"phase\",\"ph\":\"X\",\"pid\":1,\"tid\":" << event.thread;
+		os << format(",\"ts\":%.3f,\"dur\":%.3f", event.start / 1e3, event.duration / 1e3);
+		if (!event.detail.empty()) {
+			os << ",\"args\":{\"detail\":";
+			writeJSONString(os, event.detail);
+			os << "}";
+		}
+		os << "}";
+	}
+	os << "\n]}\n";
+	return true;
+}
+
+bool finishInstrumentation() {
+	if (!instrumentationEnabled) {
+		return true;
+	}
+	bool ok = true;
+	if (!TimeReport.empty()) {
+		ok &= writeReport(TimeReport);
+	}
+	if (memReportEnabled) {
+		ok &= writeMemReport(MemReport);
+		countingAllocations = false;
+		if (cl::opt<bool>* trackMemory = trackMemoryOption()) {
+			trackMemory->setValue(userTrackMemory);
+		}
+	}
+	if (!TimeReport.empty() || memReportEnabled) {
+		ResetStatistics();
+		TimePassesIsEnabled = userTimePasses;
+	}
+	if (tracing) {
+		ok &= writeTrace(TimeTrace);
+	}
+	for (PhaseTotals& totals : phaseTotals) {
+		totals.count = 0;
+		totals.wallNanos = 0;
+		totals.cpuNanos = 0;
+		totals.allocs = 0;
+		totals.allocBytes = 0;
+		totals.maxRSSGrowth = 0;
+	}
+	traceEvents.clear();
+	moduleMems.clear();
+	instrumentationEnabled = false;
+	memReportEnabled = false;
+	tracing = false;
+	return ok;
+}
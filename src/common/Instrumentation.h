@@ -0,0 +1,120 @@
+#pragma once
+
+// Phase timing, memory use, counters and a Chrome trace shared by mtl-gpu-asmcheck, mtl-gpu-llc and mtl-gpu-objdump
+// Everything is off until -time-report=file, -time-trace=file or -mem-report=file is given, and until then every hook is one branch on instrumentationEnabled
+// Allocations are counted by replacing operator new, build with -DMTL_ALLOC_HOOKS=0 to leave it alone
+
+#include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <cstdint>
+
+enum class Phase {
+	IRParse,
+	Verify,
+	Codegen,
+	MCEmission,       ///< Per instruction, part of Codegen
+	OutputFormatting, ///< Per instruction, part of MCEmission
+	OutputWrite,
+	ObjectLoad,
+	Disassembly,
+	Count
+};
+
+/// Phases that are timed once per instruction only take wall time and don't add trace events, so they stay cheap when enabled
+constexpr bool isPerInstructionPhase(Phase phase) {
+	return phase == Phase::MCEmission || phase == Phase::OutputFormatting;
+}
+
+extern bool instrumentationEnabled;
+extern bool memReportEnabled;
+
+/// Starts collecting if -time-report, -time-trace or -mem-report was given, call after parsing options
+/// Per-pass timings (and with -mem-report, per-pass malloc usage) from the legacy PassManager and llvm::Statistic counters are included in the reports
+void initializeInstrumentation(llvm::StringRef toolName);
+
+/// Writes the report and trace files and resets everything for the next initializeInstrumentation
+/// Returns false (after printing an error) if a file couldn't be written
+bool finishInstrumentation();
+
+/// appendJSONString for raw_ostreams, used by the reports and the tools' own JSON output
+void writeJSONString(llvm::raw_ostream& os, llvm::StringRef str);
+
+/// Bumps a STATISTIC only while instrumentation is on, so disabled runs don't pay for the atomic add
+inline void countEvent(llvm::Statistic& stat, unsigned amount = 1) {
+	if (instrumentationEnabled) {
+		stat += amount;
+	}
+}
+
+/// Allocations made through operator new on one thread, only counted while -mem-report is on
+struct AllocationCount {
+	uint64_t count = 0;
+	uint64_t bytes = 0;
+};
+
+/// Totals for the calling thread since it started
+AllocationCount threadAllocations();
+
+/// The process' peak resident set size so far
+uint64_t peakRSSBytes();
+
+/// Times a phase from construction until stop() or destruction
+/// Phases can nest, time spent (and memory allocated) in an inner phase also counts towards the outer one
+class PhaseTimer {
+	Phase phase;
+	bool running;
+	int64_t startWall;
+	int64_t startCPU;
+	AllocationCount startAllocs;
+	uint64_t startPeakRSS;
+	llvm::StringRef detail;
+
+	void start();
+	void finish();
+
+public:
+	/// detail is shown on the trace event (usually the input file) and has to outlive the timer
+	explicit PhaseTimer(Phase phase, llvm::StringRef detail = ""): phase(phase), running(instrumentationEnabled), detail(detail) {
+		if (running) {
+			start();
+		}
+	}
+	~PhaseTimer() { stop(); }
+	PhaseTimer(const PhaseTimer&) = delete;
+	PhaseTimer& operator=(const PhaseTimer&) = delete;
+
+	void stop() {
+		if (running) {
+			finish();
+			running = false;
+		}
+	}
+};
+
+/// For -mem-report, measures a module from construction to destruction: allocations on this thread and the peak RSS after it
+/// Adds it to the report and prints a one line summary to os, so batch runs show what each module needed
+class ModuleMemReport {
+	llvm::raw_ostream& os;
+	llvm::StringRef input;
+	bool running;
+	AllocationCount start;
+
+	void finish();
+
+public:
+	/// input has to outlive the report
+	ModuleMemReport(llvm::raw_ostream& os, llvm::StringRef input): os(os), input(input), running(memReportEnabled) {
+		if (running) {
+			start = threadAllocations();
+		}
+	}
+	~ModuleMemReport() {
+		if (running) {
+			finish();
+		}
+	}
+	ModuleMemReport(const ModuleMemReport&) = delete;
+	ModuleMemReport& operator=(const ModuleMemReport&) = delete;
+};
@@ -0,0 +1,19 @@
+#include "JSON.h"
+
+void appendJSONString(std::string& out, std::string_view str) {
+	static const char hex[] = "0123456789abcdef";
+	out += '"';
+	for (char c : str) {
+		if (c == '"' || c == '\\') {
+			out += '\\';
+			out += c;
+		} else if ((unsigned char)c < 0x20) {
+			out += "\\u00";
+			out += hex[(unsigned char)c >> 4];
+			out += hex[c & 15];
+		} else {
+			out += c;
+		}
+	}
+	out += '"';
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+// Quoting for the JSON that mtl-gpu-asmcheck, its replay tool and the instrumentation reports write
+// Only uses the standard library so the tools that don't link libLLVM can share it
+
+#include <string>
+#include <string_view>
+
+/// Appends str to out as a quoted JSON string, escaping quotes, backslashes and control characters
+void appendJSONString(std::string& out, std::string_view str);
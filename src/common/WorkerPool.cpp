@@ -0,0 +1,74 @@
+#include "WorkerPool.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+unsigned resolveWorkerCount(unsigned requested, size_t numJobs) {
+	unsigned workers = requested;
+	if (workers == 0) {
+		workers = std::max(1u, std::thread::hardware_concurrency());
+	}
+	return (unsigned)std::max<size_t>(1, std::min<size_t>(workers, numJobs));
+}
+
+void runJobsOrdered(unsigned numWorkers, size_t numJobs,
+	const std::function<JobResult(unsigned worker, size_t index)>& job,
+	const std::function<void(size_t index, JobResult& result)>& consume)
+{
+	if (numWorkers <= 1) {
+		for (size_t i = 0; i < numJobs; i++) {
+			JobResult result = job(0, i);
+			consume(i, result);
+		}
+		return;
+	}
+
+	std::mutex lock;
+	std::condition_variable cond;
+	std::vector<std::unique_ptr<JobResult>> results(numJobs);
+	size_t nextJob = 0;
+	size_t nextConsume = 0;
+	const size_t window = numWorkers * 4;
+
+	auto work = [&](unsigned worker) {
+		std::unique_lock<std::mutex> guard(lock);
+		while (true) {
+			cond.wait(guard, [&]{ return nextJob >= numJobs || nextJob < nextConsume + window; });
+			if (nextJob >= numJobs) {
+				return;
+			}
+			size_t index = nextJob++;
+			guard.unlock();
+			auto result = std::make_unique<JobResult>(job(worker, index));
+			guard.lock();
+			results[index] = std::move(result);
+			cond.notify_all();
+		}
+	};
+
+	std::vector<std::thread> threads;
+	threads.reserve(numWorkers);
+	for (unsigned i = 0; i < numWorkers; i++) {
+		threads.emplace_back(work, i);
+	}
+
+	for (size_t i = 0; i < numJobs; i++) {
+		std::unique_ptr<JobResult> result;
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			cond.wait(guard, [&]{ return results[i] != nullptr; });
+			result = std::move(results[i]);
+			nextConsume = i + 1;
+		}
+		cond.notify_all();
+		consume(i, *result);
+	}
+
+	for (std::thread& thread : threads) {
+		thread.join();
+	}
+}
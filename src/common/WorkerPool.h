@@ -0,0 +1,23 @@
+#pragma once
+
+// The -j worker pool shared by mtl-gpu-asmcheck and mtl-gpu-llc
+// Only uses the standard library so it can be built (and benchmarked) without Apple's libLLVM
+
+#include <functional>
+#include <string>
+
+struct JobResult {
+	std::string output;
+	std::string errors;
+	bool failed = false;
+};
+
+/// Resolves a -j style worker count, 0 meaning one worker per core
+unsigned resolveWorkerCount(unsigned requested, size_t numJobs);
+
+/// Runs `job(worker, index)` for every index in [0, numJobs) on numWorkers threads
+/// Results are handed to `consume` on the calling thread in index order, no matter which job finishes first
+/// Workers are only allowed to run a few jobs ahead of the consumer so a slow early job doesn't cause every later result to pile up in memory
+void runJobsOrdered(unsigned numWorkers, size_t numJobs,
+	const std::function<JobResult(unsigned worker, size_t index)>& job,
+	const std::function<void(size_t index, JobResult& result)>& consume);
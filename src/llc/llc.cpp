@@ -17,6 +17,7 @@
 static bool resetCommandLineParser = (static_cast<void>(llvm::cl::ResetCommandLineParser()), true);
 
 #include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/Statistic.h"
 #include "llvm/ADT/Triple.h"
 #include "llvm/Analysis/TargetLibraryInfo.h"
 #include "llvm/CodeGen/CommandFlags.inc"
@@ -45,17 +46,28 @@ static bool resetCommandLineParser = (static_cast<void>(llvm::cl::ResetCommandLi
 #include "llvm/Support/Host.h"
 #include "llvm/Support/InitLLVM.h"
 #include "llvm/Support/ManagedStatic.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/PluginLoader.h"
 #include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/StringSaver.h"
 #include "llvm/Support/TargetRegistry.h"
 #include "llvm/Support/TargetSelect.h"
 #include "llvm/Support/ToolOutputFile.h"
 #include "llvm/Support/WithColor.h"
 #include "llvm/Target/TargetMachine.h"
 #include "llvm/Transforms/Utils/Cloning.h"
+#include "common/CompileCache.h"
+#include "common/Instrumentation.h"
+#include "common/WorkerPool.h"
 #include <memory>
 using namespace llvm;
 
+#define DEBUG_TYPE "llc"
+
+STATISTIC(NumModulesCompiled, "Modules compiled");
+STATISTIC(NumCacheHits, "Modules loaded from -cache-dir");
+STATISTIC(NumBytesWritten, "Bytes of output written");
+
 // General options for llc.  Other pass-specific options are specified
 // within the corresponding llc passes, and target-specific options
 // and back-end code generation options are specified with the target machine.
@@ -150,6 +162,48 @@ static cl::opt<std::string>
                     cl::desc("YAML output filename for pass remarks"),
                     cl::value_desc("filename"));
 
+static cl::opt<std::string>
+    CacheDir("cache-dir",
+             cl::desc("Cache compiled outputs in this directory, keyed on the "
+                      "input contents, command line and tool version"),
+             cl::value_desc("directory"));
+
+static cl::opt<std::string>
+    CachePolicy("cache-policy",
+                cl::desc("Pruning policy for -cache-dir, e.g. "
+                         "\"cache_size_bytes=4g:prune_after=72h\""),
+                cl::init(""));
+
+static cl::opt<std::string>
+    BatchFile("batch",
+              cl::desc("Compile every input listed in this file (- for "
+                       "stdin), one \"input [output]\" per line, keeping "
+                       "the target machine alive between inputs"),
+              cl::value_desc("filename"));
+
+static cl::opt<unsigned>
+    Jobs("j",
+         cl::desc("With -batch, compile this many inputs at once "
+                  "(0 = one per core)"),
+         cl::init(1));
+
+static std::unique_ptr<CompileCache> Cache;
+static std::string CacheToolIdentity;
+static std::string CacheFingerprint;
+
+/// What a compile keeps between inputs with -batch: the target, its machine
+/// and the TargetLibraryInfoImpl the pass managers copy theirs from.  Each
+/// -batch worker has its own, a TargetMachine can't be shared by pass
+/// managers running at the same time.
+struct TargetState {
+  std::string TripleStr;
+  Triple TheTriple;
+  const Target *TheTarget = nullptr;
+  std::unique_ptr<TargetMachine> Machine;
+  std::string TLIITripleStr;
+  std::unique_ptr<TargetLibraryInfoImpl> TLII;
+};
+
 namespace {
 static ManagedStatic<std::vector<std::string>> RunPassNames;
 
@@ -172,11 +226,45 @@ static cl::opt<RunPassOption, true, cl::parser<std::string>> RunPass(
     cl::desc("Run compiler only for specified passes (comma separated list)"),
     cl::value_desc("pass-name"), cl::ZeroOrMore, cl::location(RunPassOpt));
 
-static int compileModule(char **, LLVMContext &);
+static int compileModule(char **, LLVMContext &, StringRef, std::string,
+                         raw_ostream &, TargetState &);
+
+// Everything on the command line affects the output except where the input
+// comes from, where the output goes, the cache options themselves, the
+// instrumentation files and how a -batch is run.
+static std::string getCacheFingerprint(int argc, char **argv) {
+  BumpPtrAllocator A;
+  StringSaver Saver(A);
+  SmallVector<const char *, 32> Args(argv + 1, argv + argc);
+  cl::ExpandResponseFiles(Saver, cl::TokenizeGNUCommandLine, Args);
+
+  std::string Fingerprint;
+  for (size_t I = 0; I < Args.size(); ++I) {
+    StringRef Arg = Args[I] ? Args[I] : "";
+    if (Arg == InputFilename || Arg.startswith("-cache-") ||
+        Arg.startswith("--cache-") || Arg.startswith("-time-report") ||
+        Arg.startswith("--time-report") || Arg.startswith("-time-trace") ||
+        Arg.startswith("--time-trace") || Arg.startswith("-mem-report") ||
+        Arg.startswith("--mem-report") || Arg.startswith("-batch") ||
+        Arg.startswith("--batch") || Arg.startswith("-j=") ||
+        Arg.startswith("--j="))
+      continue;
+    if (Arg == "-o" || Arg == "-j" || Arg == "--j") {
+      ++I;
+      continue;
+    }
+    if (Arg.startswith("-o") && Arg.drop_front(2).ltrim('=') == OutputFilename)
+      continue;
+    Fingerprint += Arg;
+    Fingerprint += '\0';
+  }
+  return Fingerprint;
+}
 
-static std::unique_ptr<ToolOutputFile> GetOutputStream(const char *TargetName,
-                                                       Triple::OSType OS,
-                                                       const char *ProgName) {
+static std::unique_ptr<ToolOutputFile>
+GetOutputStream(const char *TargetName, Triple::OSType OS,
+                const char *ProgName, StringRef InputFilename,
+                std::string &OutputFilename, raw_ostream &Diag) {
   // If we don't yet have an output filename, make one.
   if (OutputFilename.empty()) {
     if (InputFilename == "-")
@@ -234,7 +322,7 @@ static std::unique_ptr<ToolOutputFile> GetOutputStream(const char *TargetName,
     OpenFlags |= sys::fs::F_Text;
   auto FDOut = llvm::make_unique<ToolOutputFile>(OutputFilename, EC, OpenFlags);
   if (EC) {
-    WithColor::error() << EC.message() << '\n';
+    WithColor::error(Diag) << OutputFilename << ": " << EC.message() << '\n';
     return nullptr;
   }
 
@@ -243,7 +331,9 @@ static std::unique_ptr<ToolOutputFile> GetOutputStream(const char *TargetName,
 
 struct LLCDiagnosticHandler : public DiagnosticHandler {
   bool *HasError;
-  LLCDiagnosticHandler(bool *HasErrorPtr) : HasError(HasErrorPtr) {}
+  raw_ostream &OS;
+  LLCDiagnosticHandler(bool *HasErrorPtr, raw_ostream &OS)
+      : HasError(HasErrorPtr), OS(OS) {}
   bool handleDiagnostics(const DiagnosticInfo &DI) override {
     if (DI.getSeverity() == DS_Error)
       *HasError = true;
@@ -252,25 +342,107 @@ struct LLCDiagnosticHandler : public DiagnosticHandler {
       if (!Remark->isEnabled())
         return true;
 
-    DiagnosticPrinterRawOStream DP(errs());
-    errs() << LLVMContext::getDiagnosticMessagePrefix(DI.getSeverity()) << ": ";
+    DiagnosticPrinterRawOStream DP(OS);
+    OS << LLVMContext::getDiagnosticMessagePrefix(DI.getSeverity()) << ": ";
     DI.print(DP);
-    errs() << "\n";
+    OS << "\n";
     return true;
   }
 };
 
 static void InlineAsmDiagHandler(const SMDiagnostic &SMD, void *Context,
                                  unsigned LocCookie) {
-  bool *HasError = static_cast<bool *>(Context);
+  auto *Handler = static_cast<LLCDiagnosticHandler *>(Context);
   if (SMD.getKind() == SourceMgr::DK_Error)
-    *HasError = true;
+    *Handler->HasError = true;
 
-  SMD.print(nullptr, errs());
+  SMD.print(nullptr, Handler->OS);
 
   // For testing purposes, we print the LocCookie here.
   if (LocCookie)
-    WithColor::note() << "!srcloc = " << LocCookie << "\n";
+    WithColor::note(Handler->OS) << "!srcloc = " << LocCookie << "\n";
+}
+
+/// Sends a context's diagnostics to OS, HasError has to outlive the context
+static void setUpContext(LLVMContext &Context, bool *HasError,
+                         raw_ostream &OS) {
+  Context.setDiscardValueNames(DiscardValueNames);
+
+  // Set a diagnostic handler that doesn't exit on the first error
+  auto Handler = llvm::make_unique<LLCDiagnosticHandler>(HasError, OS);
+  Context.setInlineAsmDiagnosticHandler(InlineAsmDiagHandler, Handler.get());
+  Context.setDiagnosticHandler(std::move(Handler));
+
+  if (PassRemarksWithHotness)
+    Context.setDiagnosticsHotnessRequested(true);
+
+  if (PassRemarksHotnessThreshold)
+    Context.setDiagnosticsHotnessThreshold(PassRemarksHotnessThreshold);
+}
+
+struct BatchEntry {
+  std::string Input;
+  std::string Output; ///< Empty to derive it from Input like without -batch
+};
+
+/// Reads a -batch list: one input and optionally its output per line, quoted
+/// like a response file, with empty lines and lines starting with # ignored
+static bool readBatchFile(StringRef Path, std::vector<BatchEntry> &Entries,
+                          const char *ProgName) {
+  auto BufferOrErr = MemoryBuffer::getFileOrSTDIN(Path);
+  if (!BufferOrErr) {
+    WithColor::error(errs(), ProgName)
+        << Path << ": " << BufferOrErr.getError().message() << '\n';
+    return false;
+  }
+  SmallVector<StringRef, 0> Lines;
+  (*BufferOrErr)->getBuffer().split(Lines, '\n');
+  BumpPtrAllocator A;
+  StringSaver Saver(A);
+  for (size_t I = 0; I < Lines.size(); ++I) {
+    StringRef Line = Lines[I].trim();
+    if (Line.empty() || Line.startswith("#"))
+      continue;
+    SmallVector<const char *, 2> Args;
+    cl::TokenizeGNUCommandLine(Line, Saver, Args);
+    if (Args.empty() || Args.size() > 2) {
+      WithColor::error(errs(), ProgName)
+          << Path << ":" << (I + 1)
+          << ": expected an input and optionally an output\n";
+      return false;
+    }
+    Entries.push_back({Args[0], Args.size() > 1 ? Args[1] : ""});
+  }
+  return true;
+}
+
+/// -batch: compiles every listed input on -j workers, each of which keeps its
+/// target state between inputs.  Modules get a fresh context each, so nothing
+/// one leaves behind grows over the run.  Failed inputs don't stop the rest.
+static int compileBatch(char **argv) {
+  std::vector<BatchEntry> Entries;
+  if (!readBatchFile(BatchFile, Entries, argv[0]))
+    return 1;
+
+  unsigned Workers = resolveWorkerCount(Jobs, Entries.size());
+  std::vector<TargetState> Targets(Workers);
+  bool Failed = false;
+  runJobsOrdered(Workers, Entries.size(), [&](unsigned Worker, size_t Index) {
+    JobResult Result;
+    raw_string_ostream Diag(Result.errors);
+    LLVMContext Context;
+    bool HasError = false;
+    setUpContext(Context, &HasError, Diag);
+    Result.failed = compileModule(argv, Context, Entries[Index].Input,
+                                  Entries[Index].Output, Diag,
+                                  Targets[Worker]) != 0;
+    Diag.flush();
+    return Result;
+  }, [&](size_t, JobResult &Result) {
+    errs() << Result.errors;
+    Failed |= Result.failed;
+  });
+  return Failed ? 1 : 0;
 }
 
 // main - Entry point for the llc compiler.
@@ -312,20 +484,21 @@ int main(int argc, char **argv) {
   cl::AddExtraVersionPrinter(TargetRegistry::printRegisteredTargetsForVersion);
 
   cl::ParseCommandLineOptions(argc, argv, "llvm system compiler\n");
+  initializeInstrumentation("mtl-gpu-llc");
 
-  Context.setDiscardValueNames(DiscardValueNames);
-
-  // Set a diagnostic handler that doesn't exit on the first error
   bool HasError = false;
-  Context.setDiagnosticHandler(
-      llvm::make_unique<LLCDiagnosticHandler>(&HasError));
-  Context.setInlineAsmDiagnosticHandler(InlineAsmDiagHandler, &HasError);
+  setUpContext(Context, &HasError, errs());
 
-  if (PassRemarksWithHotness)
-    Context.setDiagnosticsHotnessRequested(true);
-
-  if (PassRemarksHotnessThreshold)
-    Context.setDiagnosticsHotnessThreshold(PassRemarksHotnessThreshold);
+  if (!BatchFile.empty() &&
+      (InputFilename.getNumOccurrences() || !OutputFilename.empty() ||
+       !SplitDwarfOutputFile.empty() || RemarksFilename != "" ||
+       TimeCompilations != 1)) {
+    WithColor::error(errs(), argv[0])
+        << "-batch takes its inputs and outputs from the list, and can't be "
+           "used with -split-dwarf-output, -pass-remarks-output or "
+           "-time-compilations\n";
+    return 1;
+  }
 
   std::unique_ptr<ToolOutputFile> YamlFile;
   if (RemarksFilename != "") {
@@ -347,15 +520,42 @@ int main(int argc, char **argv) {
     return 1;
   }
 
+  if (!CacheDir.empty()) {
+    std::string Error;
+    Cache = CompileCache::open(CacheDir, CachePolicy, Error);
+    if (!Cache) {
+      WithColor::error(errs(), argv[0]) << Error << '\n';
+      return 1;
+    }
+    CacheToolIdentity = CompileCache::toolIdentity(
+        argv[0], reinterpret_cast<void *>(&getCacheFingerprint));
+    CacheFingerprint = getCacheFingerprint(argc, argv);
+  }
+
+  if (!BatchFile.empty()) {
+    int RetVal = compileBatch(argv);
+    if (Cache)
+      Cache->prune();
+    return finishInstrumentation() && RetVal == 0 ? 0 : 1;
+  }
+
   // Compile the module TimeCompilations times to give better compile time
   // metrics.
-  for (unsigned I = TimeCompilations; I; --I)
-    if (int RetVal = compileModule(argv, Context))
+  for (unsigned I = TimeCompilations; I; --I) {
+    TargetState Target;
+    if (int RetVal = compileModule(argv, Context, InputFilename,
+                                   OutputFilename, errs(), Target)) {
+      finishInstrumentation();
       return RetVal;
+    }
+  }
+
+  if (Cache)
+    Cache->prune();
 
   if (YamlFile)
     YamlFile->keep();
-  return 0;
+  return finishInstrumentation() ? 0 : 1;
 }
 
 static bool addPass(PassManagerBase &PM, const char *argv0,
@@ -386,7 +586,13 @@ static bool addPass(PassManagerBase &PM, const char *argv0,
   return false;
 }
 
-static int compileModule(char **argv, LLVMContext &Context) {
+/// Compiles one input, creating or reusing the target state in Target.
+/// Diagnostics go to Diag, except for the ones from the context's handler.
+static int compileModule(char **argv, LLVMContext &Context,
+                         StringRef InputFilename, std::string OutputFilename,
+                         raw_ostream &Diag, TargetState &Target) {
+  ModuleMemReport MemReport(Diag, InputFilename);
+
   // Load the module to be compiled...
   SMDiagnostic Err;
   std::unique_ptr<Module> M;
@@ -396,6 +602,37 @@ static int compileModule(char **argv, LLVMContext &Context) {
   bool SkipModule = MCPU == "help" ||
                     (!MAttrs.empty() && MAttrs.front() == "help");
 
+  // With -cache-dir, a previous result for the same input and command line
+  // is reused without parsing the module at all.
+  std::unique_ptr<MemoryBuffer> InputBuffer;
+  std::string CacheKey;
+  if (Cache && !SkipModule && SplitDwarfOutputFile.empty()) {
+    auto BufferOrErr = MemoryBuffer::getFileOrSTDIN(InputFilename);
+    if (!BufferOrErr) {
+      WithColor::error(Diag, argv[0])
+          << InputFilename << ": " << BufferOrErr.getError().message() << '\n';
+      return 1;
+    }
+    InputBuffer = std::move(*BufferOrErr);
+    CacheKey = CompileCache::makeKey({"mtl-gpu-llc", CacheToolIdentity,
+                                      CacheFingerprint,
+                                      InputBuffer->getBuffer()});
+    std::vector<std::string> Blobs;
+    unsigned OS;
+    if (Cache->lookup(CacheKey, Blobs) && Blobs.size() == 2 &&
+        !StringRef(Blobs[1]).getAsInteger(10, OS)) {
+      countEvent(NumCacheHits);
+      std::unique_ptr<ToolOutputFile> Out =
+          GetOutputStream("", Triple::OSType(OS), argv[0], InputFilename,
+                          OutputFilename, Diag);
+      if (!Out) return 1;
+      PhaseTimer WriteTimer(Phase::OutputWrite, InputFilename);
+      Out->os() << Blobs[0];
+      Out->keep();
+      return 0;
+    }
+  }
+
   // If user just wants to list available options, skip module loading
   if (!SkipModule) {
 //    if (InputLanguage == "mir" ||
@@ -404,9 +641,14 @@ static int compileModule(char **argv, LLVMContext &Context) {
 //      if (MIR)
 //        M = MIR->parseIRModule();
 //    } else
+    PhaseTimer ParseTimer(Phase::IRParse, InputFilename);
+    if (InputBuffer)
+      M = parseIR(InputBuffer->getMemBufferRef(), Err, Context, false);
+    else
       M = parseIRFile(InputFilename, Err, Context, false);
+    ParseTimer.stop();
     if (!M) {
-      Err.print(argv[0], WithColor::error(errs(), argv[0]));
+      Err.print(argv[0], WithColor::error(Diag, argv[0]));
       return 1;
     }
 
@@ -421,43 +663,53 @@ static int compileModule(char **argv, LLVMContext &Context) {
   if (TheTriple.getTriple().empty())
     TheTriple.setTriple(sys::getDefaultTargetTriple());
 
-  // Get the target specific parser.
-  std::string Error;
-  const Target *TheTarget = TargetRegistry::lookupTarget(MArch, TheTriple,
-                                                         Error);
-  if (!TheTarget) {
-    WithColor::error(errs(), argv[0]) << Error;
-    return 1;
-  }
-
   std::string CPUStr = getCPUStr(), FeaturesStr = getFeaturesStr();
 
-  CodeGenOpt::Level OLvl = CodeGenOpt::Default;
-  switch (OptLevel) {
-  default:
-    WithColor::error(errs(), argv[0]) << "invalid optimization level.\n";
-    return 1;
-  case ' ': break;
-  case '0': OLvl = CodeGenOpt::None; break;
-  case '1': OLvl = CodeGenOpt::Less; break;
-  case '2': OLvl = CodeGenOpt::Default; break;
-  case '3': OLvl = CodeGenOpt::Aggressive; break;
-  }
+  // Everything the target machine is created from except the triple comes
+  // from the command line, so it only has to be recreated when that changes
+  if (!Target.Machine || Target.TripleStr != TheTriple.getTriple()) {
+    Target.Machine.reset();
+    Target.TripleStr = TheTriple.getTriple();
+
+    // Get the target specific parser.
+    std::string Error;
+    Target.TheTarget = TargetRegistry::lookupTarget(MArch, TheTriple, Error);
+    if (!Target.TheTarget) {
+      WithColor::error(Diag, argv[0]) << Error;
+      return 1;
+    }
+    Target.TheTriple = TheTriple;
 
-  TargetOptions Options = InitTargetOptionsFromCodeGenFlags();
-  Options.DisableIntegratedAS = NoIntegratedAssembler;
-  Options.MCOptions.ShowMCEncoding = ShowMCEncoding;
-  Options.MCOptions.MCUseDwarfDirectory = EnableDwarfDirectory;
-  Options.MCOptions.AsmVerbose = AsmVerbose;
-  Options.MCOptions.PreserveAsmComments = PreserveComments;
-  Options.MCOptions.IASSearchPaths = IncludeDirs;
-  Options.MCOptions.SplitDwarfFile = SplitDwarfFile;
+    CodeGenOpt::Level OLvl = CodeGenOpt::Default;
+    switch (OptLevel) {
+    default:
+      WithColor::error(Diag, argv[0]) << "invalid optimization level.\n";
+      return 1;
+    case ' ': break;
+    case '0': OLvl = CodeGenOpt::None; break;
+    case '1': OLvl = CodeGenOpt::Less; break;
+    case '2': OLvl = CodeGenOpt::Default; break;
+    case '3': OLvl = CodeGenOpt::Aggressive; break;
+    }
 
-  std::unique_ptr<TargetMachine> Target(TheTarget->createTargetMachine(
-      TheTriple.getTriple(), CPUStr, FeaturesStr, Options, getRelocModel(),
-      getCodeModel(), OLvl));
+    TargetOptions Options = InitTargetOptionsFromCodeGenFlags();
+    Options.DisableIntegratedAS = NoIntegratedAssembler;
+    Options.MCOptions.ShowMCEncoding = ShowMCEncoding;
+    Options.MCOptions.MCUseDwarfDirectory = EnableDwarfDirectory;
+    Options.MCOptions.AsmVerbose = AsmVerbose;
+    Options.MCOptions.PreserveAsmComments = PreserveComments;
+    Options.MCOptions.IASSearchPaths = IncludeDirs;
+    Options.MCOptions.SplitDwarfFile = SplitDwarfFile;
 
-  assert(Target && "Could not allocate target machine!");
+    Target.Machine.reset(Target.TheTarget->createTargetMachine(
+        TheTriple.getTriple(), CPUStr, FeaturesStr, Options, getRelocModel(),
+        getCodeModel(), OLvl));
+
+    assert(Target.Machine && "Could not allocate target machine!");
+  }
+  // lookupTarget can change the triple, use the one the machine was made for
+  TheTriple = Target.TheTriple;
+  const llvm::Target *TheTarget = Target.TheTarget;
 
   // If we don't have a module then just exit now. We do this down
   // here since the CPU/Feature help is underneath the target machine
@@ -466,12 +718,11 @@ static int compileModule(char **argv, LLVMContext &Context) {
     return 0;
 
   assert(M && "Should have exited if we didn't have a module!");
-  if (FloatABIForCalls != FloatABI::Default)
-    Options.FloatABIType = FloatABIForCalls;
 
   // Figure out where we are going to send the output.
   std::unique_ptr<ToolOutputFile> Out =
-      GetOutputStream(TheTarget->getName(), TheTriple.getOS(), argv[0]);
+      GetOutputStream(TheTarget->getName(), TheTriple.getOS(), argv[0],
+                      InputFilename, OutputFilename, Diag);
   if (!Out) return 1;
 
   std::unique_ptr<ToolOutputFile> DwoOut;
@@ -480,7 +731,7 @@ static int compileModule(char **argv, LLVMContext &Context) {
     DwoOut = llvm::make_unique<ToolOutputFile>(SplitDwarfOutputFile, EC,
                                                sys::fs::F_None);
     if (EC) {
-      WithColor::error(errs(), argv[0]) << EC.message() << '\n';
+      WithColor::error(Diag, argv[0]) << EC.message() << '\n';
       return 1;
     }
   }
@@ -488,16 +739,22 @@ static int compileModule(char **argv, LLVMContext &Context) {
   // Build up all of the passes that we want to do to the module.
   legacy::PassManager PM;
 
-  // Add an appropriate TargetLibraryInfo pass for the module's triple.
-  TargetLibraryInfoImpl TLII(Triple(M->getTargetTriple()));
-
-  // The -disable-simplify-libcalls flag actually disables all builtin optzns.
-  if (DisableSimplifyLibCalls)
-    TLII.disableAllFunctions();
-  PM.add(new TargetLibraryInfoWrapperPass(TLII));
+  // Add an appropriate TargetLibraryInfo pass for the module's triple.  The
+  // pass takes a copy, so one prototype per triple is enough.
+  if (!Target.TLII || Target.TLIITripleStr != M->getTargetTriple()) {
+    Target.TLIITripleStr = M->getTargetTriple();
+    Target.TLII = llvm::make_unique<TargetLibraryInfoImpl>(
+        Triple(M->getTargetTriple()));
+
+    // The -disable-simplify-libcalls flag actually disables all builtin
+    // optzns.
+    if (DisableSimplifyLibCalls)
+      Target.TLII->disableAllFunctions();
+  }
+  PM.add(new TargetLibraryInfoWrapperPass(*Target.TLII));
 
   // Add the target data from the target machine, if it exists, or the module.
-  M->setDataLayout(Target->createDataLayout());
+  M->setDataLayout(Target.Machine->createDataLayout());
 
   // This needs to be done after setting datalayout since it calls verifier
   // to check debug info whereas verifier relies on correct datalayout.
@@ -505,10 +762,13 @@ static int compileModule(char **argv, LLVMContext &Context) {
 
   // Verify module immediately to catch problems before doInitialization() is
   // called on any passes.
-  if (!NoVerify && verifyModule(*M, &errs())) {
+  PhaseTimer VerifyTimer(Phase::Verify, InputFilename);
+  bool Broken = !NoVerify && verifyModule(*M, &Diag);
+  VerifyTimer.stop();
+  if (Broken) {
     std::string Prefix =
         (Twine(argv[0]) + Twine(": ") + Twine(InputFilename)).str();
-    WithColor::error(errs(), Prefix) << "input module is broken!\n";
+    WithColor::error(Diag, Prefix) << "input module is broken!\n";
     return 1;
   }
 
@@ -518,7 +778,7 @@ static int compileModule(char **argv, LLVMContext &Context) {
 
   if (RelaxAll.getNumOccurrences() > 0 &&
       FileType != TargetMachine::CGFT_ObjectFile)
-    WithColor::warning(errs(), argv[0])
+    WithColor::warning(Diag, argv[0])
         << ": warning: ignoring -mc-relax-all because filetype != obj";
 
   {
@@ -530,20 +790,21 @@ static int compileModule(char **argv, LLVMContext &Context) {
     std::unique_ptr<raw_svector_ostream> BOS;
     if ((FileType != TargetMachine::CGFT_AssemblyFile &&
          !Out->os().supportsSeeking()) ||
-        CompileTwice) {
+        CompileTwice || !CacheKey.empty()) {
       BOS = make_unique<raw_svector_ostream>(Buffer);
       OS = BOS.get();
     }
 
     const char *argv0 = argv[0];
-    LLVMTargetMachine &LLVMTM = static_cast<LLVMTargetMachine&>(*Target);
+    LLVMTargetMachine &LLVMTM =
+        static_cast<LLVMTargetMachine&>(*Target.Machine);
 //    MachineModuleInfo *MMI = new MachineModuleInfo(&LLVMTM);
 
     // Construct a custom pass pipeline that starts after instruction
     // selection.
     if (!RunPassNames->empty()) {
 //      if (!MIR) {
-        WithColor::warning(errs(), argv[0])
+        WithColor::warning(Diag, argv[0])
             << "run-pass is for .mir file only.\n";
         return 1;
 //      }
@@ -566,10 +827,10 @@ static int compileModule(char **argv, LLVMContext &Context) {
 //      TPC.setInitialized();
 //      PM.add(createPrintMIRPass(*OS));
 //      PM.add(createFreeMachineFunctionPass());
-    } else if (Target->addPassesToEmitFile(PM, *OS,
-                                           DwoOut ? &DwoOut->os() : nullptr,
-                                           FileType, NoVerify/*, MMI*/)) {
-      WithColor::warning(errs(), argv[0])
+    } else if (Target.Machine->addPassesToEmitFile(
+                   PM, *OS, DwoOut ? &DwoOut->os() : nullptr, FileType,
+                   NoVerify/*, MMI*/)) {
+      WithColor::warning(Diag, argv[0])
           << "target does not support generation of this"
           << " file type!\n";
       return 1;
@@ -596,7 +857,12 @@ static int compileModule(char **argv, LLVMContext &Context) {
       Buffer.clear();
     }
 
-    PM.run(*M);
+    {
+      PhaseTimer CodegenTimer(Phase::Codegen, InputFilename);
+      PM.run(*M);
+    }
+    countEvent(NumModulesCompiled);
+    countEvent(NumBytesWritten, OS->tell());
 
     auto HasError =
         ((const LLCDiagnosticHandler *)(Context.getDiagHandlerPtr()))->HasError;
@@ -608,7 +874,7 @@ static int compileModule(char **argv, LLVMContext &Context) {
       if (Buffer.size() != CompileTwiceBuffer.size() ||
           (memcmp(Buffer.data(), CompileTwiceBuffer.data(), Buffer.size()) !=
            0)) {
-        errs()
+        Diag
             << "Running the pass manager twice changed the output.\n"
                "Writing the result of the second run to the specified output\n"
                "To generate the one-run comparison binary, just run without\n"
@@ -619,6 +885,11 @@ static int compileModule(char **argv, LLVMContext &Context) {
       }
     }
 
+    PhaseTimer WriteTimer(Phase::OutputWrite, InputFilename);
+    if (!CacheKey.empty())
+      Cache->store(CacheKey, {StringRef(Buffer.data(), Buffer.size()),
+                              std::to_string(TheTriple.getOS())});
+
     if (BOS) {
       Out->os() << Buffer;
     }
@@ -19,6 +19,7 @@
 #include "llvm-objdump.h"
 #include "llvm/ADT/Optional.h"
 #include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/Statistic.h"
 #include "llvm/ADT/StringExtras.h"
 #include "llvm/ADT/StringSet.h"
 #include "llvm/ADT/Triple.h"
@@ -58,6 +59,7 @@
 #include "llvm/Support/TargetRegistry.h"
 #include "llvm/Support/TargetSelect.h"
 #include "llvm/Support/raw_ostream.h"
+#include "common/Instrumentation.h"
 #include <algorithm>
 #include <cctype>
 #include <cstring>
@@ -68,6 +70,11 @@
 using namespace llvm;
 using namespace object;
 
+#define DEBUG_TYPE "objdump"
+
+STATISTIC(NumInstsDecoded, "Instructions disassembled");
+STATISTIC(NumBytesDecoded, "Bytes disassembled");
+
 cl::opt<bool>
     llvm::AllHeaders("all-headers",
                      cl::desc("Display all available header information"));
@@ -1691,11 +1698,16 @@ static void DisassembleObject(const ObjectFile *Obj, bool InlineRelocs) {
                                                    CommentStream);
         if (Size == 0)
           Size = 1;
-
-        PIP.printInst(*IP, Disassembled ? &Inst : nullptr,
-                      Bytes.slice(Index, Size), SectionAddr + Index, outs(), "",
-                      *STI, &SP, &Rels);
-        outs() << CommentStream.str();
+        countEvent(NumInstsDecoded);
+        countEvent(NumBytesDecoded, Size);
+
+        {
+          PhaseTimer FormatTimer(Phase::OutputFormatting);
+          PIP.printInst(*IP, Disassembled ? &Inst : nullptr,
+                        Bytes.slice(Index, Size), SectionAddr + Index, outs(),
+                        "", *STI, &SP, &Rels);
+          outs() << CommentStream.str();
+        }
         Comments.clear();
 
         // Try to resolve the target of a call, tail call, etc. to a specific
@@ -2273,8 +2285,10 @@ static void DumpObject(ObjectFile *o, const Archive *a = nullptr,
 
   if (ArchiveHeaders && !MachOOpt)
     printArchiveChild(a->getFileName(), *c);
-  if (Disassemble)
+  if (Disassemble) {
+    PhaseTimer DisassemblyTimer(Phase::Disassembly, o->getFileName());
     DisassembleObject(o, Relocations);
+  }
   if (Relocations && !Disassemble)
     PrintRelocations(o);
   if (DynamicRelocations)
@@ -2366,7 +2380,9 @@ static void DumpInput(StringRef file) {
   }
 
   // Attempt to open the binary.
+  PhaseTimer LoadTimer(Phase::ObjectLoad, file);
   Expected<OwningBinary<Binary>> BinaryOrErr = createBinary(file);
+  LoadTimer.stop();
   if (!BinaryOrErr)
     report_error(file, BinaryOrErr.takeError());
   Binary &Binary = *BinaryOrErr.get().getBinary();
@@ -2391,6 +2407,7 @@ int main(int argc, char **argv) {
   cl::AddExtraVersionPrinter(TargetRegistry::printRegisteredTargetsForVersion);
 
   cl::ParseCommandLineOptions(argc, argv, "llvm object file dumper\n");
+  initializeInstrumentation("mtl-gpu-objdump");
   TripleName = Triple::normalize(TripleName);
 
   ToolName = argv[0];
@@ -2446,5 +2463,7 @@ int main(int argc, char **argv) {
 
   llvm::for_each(InputFilenames, DumpInput);
 
+  if (!finishInstrumentation())
+    return EXIT_FAILURE;
   return EXIT_SUCCESS;
 }
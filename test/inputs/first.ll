@@ -0,0 +1,5 @@
+define float @add_twice(float %x) {
+  %a = fadd float %x, 1.0
+  %b = fadd float %a, 1.0
+  ret float %b
+}
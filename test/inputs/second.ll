@@ -0,0 +1,4 @@
+define float @scale(float %x, float %y) {
+  %a = fmul float %x, %y
+  ret float %a
+}
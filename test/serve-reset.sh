@@ -0,0 +1,46 @@
+#!/bin/sh
+# Checks that -serve requests start from the default options instead of inheriting flags and inputs from earlier requests
+# Needs mtl-gpu-asmcheck and mtl-gpu-asmcheck-client to be built, `make check` runs it
+
+set -eu
+
+dir=$(cd "$(dirname "$0")" && pwd)
+bin=$(cd "$dir/.." && pwd)
+tmp=$(mktemp -d)
+socket="$tmp/asmcheck.sock"
+server=
+
+cleanup() {
+	[ -z "$server" ] || kill "$server" 2>/dev/null || true
+	rm -rf "$tmp"
+}
+trap cleanup EXIT
+
+fail() {
+	echo "FAIL: $1"
+	shift
+	for file in "$@"; do
+		echo "--- $file"
+		cat "$file"
+	done
+	exit 1
+}
+
+"$bin/mtl-gpu-asmcheck" -serve="$socket" &
+server=$!
+tries=0
+while [ ! -S "$socket" ]; do
+	tries=$((tries + 1))
+	[ "$tries" -lt 100 ] || fail "server didn't create $socket"
+	sleep 0.1
+done
+
+cd "$dir/inputs"
+"$bin/mtl-gpu-asmcheck-client" "$socket" -dedup -emit-format=text first.ll > "$tmp/first.txt"
+"$bin/mtl-gpu-asmcheck-client" "$socket" second.ll > "$tmp/second.txt"
+
+grep -q "^Deduplicated" "$tmp/first.txt" || fail "the first request didn't apply -dedup" "$tmp/first.txt"
+! grep -q "^Deduplicated" "$tmp/second.txt" || fail "the second request inherited -dedup" "$tmp/second.txt"
+[ "$(grep -c "^Assembled" "$tmp/second.txt")" = 1 ] || fail "the second request compiled the first request's input too" "$tmp/second.txt"
+
+echo "PASS: serve requests don't inherit options"